@@ -0,0 +1,172 @@
+/*
+  Minimal runtime for the BareMetal build configuration, see baremetal.h.
+  Compiled to nothing in the Arduino configuration.
+*/
+
+#ifdef BAREMETAL
+
+#include "baremetal.h"
+
+#define RX_BUFFER_LEN  64  // same as the Arduino core, must be a power of 2
+
+UartSerial Serial;
+
+static volatile unsigned long timer1_ovf = 0;     // Timer1 overflows, 262144 us each
+static volatile unsigned long timer1_millis = 0;  // ms at the last overflow, wraps at 2^32 like the Arduino core
+static volatile word timer1_fract = 0;            // us at the last overflow not counted in timer1_millis (0-999)
+
+static volatile byte rx_buffer[RX_BUFFER_LEN];
+static volatile byte rx_head = 0;
+static volatile byte rx_tail = 0;
+
+void setup(void);
+void loop(void);
+
+ISR(TIMER1_OVF_vect) {
+  word fract = timer1_fract + 144;  // 262144 us = 262 ms + 144 us
+
+  timer1_ovf++;
+  timer1_millis += 262;
+  if (fract >= 1000) {
+    fract -= 1000;
+    timer1_millis++;
+  }
+  timer1_fract = fract;
+}
+
+ISR(USART_RX_vect) {
+  byte c = UDR0;
+  byte next = (rx_head + 1) & (RX_BUFFER_LEN - 1);
+
+  if (next != rx_tail) {  // drop the character if the buffer is full
+    rx_buffer[rx_head] = c;
+    rx_head = next;
+  }
+}
+
+unsigned long micros(void) {
+  unsigned long ovf;
+  word count;
+  byte sreg = SREG;
+
+  cli();
+  ovf = timer1_ovf;
+  count = TCNT1;
+  if ((TIFR1 & _BV(TOV1)) && count < 0x8000)  // overflow happened but the interrupt has not run yet
+    ovf++;
+  SREG = sreg;
+
+  return ((ovf << 16) | count) * 4;
+}
+
+unsigned long millis(void) {  // not micros() / 1000, which would wrap after 71 minutes
+  unsigned long ms;
+  unsigned long us;
+  word count;
+  byte sreg = SREG;
+
+  cli();
+  ms = timer1_millis;
+  us = timer1_fract;
+  count = TCNT1;
+  if ((TIFR1 & _BV(TOV1)) && count < 0x8000) {  // overflow happened but the interrupt has not run yet
+    ms += 262;
+    us += 144;
+  }
+  SREG = sreg;
+
+  return ms + (us + count * 4UL) / 1000;
+}
+
+void UartSerial::begin(unsigned long baud) {
+  word ubrr = (F_CPU / 4 / baud - 1) / 2;  // double speed mode, rounded like the Arduino core
+
+  UCSR0A = _BV(U2X0);
+  UBRR0H = ubrr >> 8;
+  UBRR0L = ubrr;
+  UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);  // 8N1
+  UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+  written = false;
+}
+
+void UartSerial::end(void) {
+  flush();
+  UCSR0B = 0;  // release RX/TX pins, they are DATA0/DATA1 in HVPP mode
+  rx_head = rx_tail = 0;
+}
+
+int UartSerial::available(void) {
+  return (rx_head - rx_tail) & (RX_BUFFER_LEN - 1);
+}
+
+int UartSerial::read(void) {
+  byte c;
+
+  if (rx_head == rx_tail)
+    return -1;
+  c = rx_buffer[rx_tail];
+  rx_tail = (rx_tail + 1) & (RX_BUFFER_LEN - 1);
+  return c;
+}
+
+void UartSerial::flush(void) {  // wait for transmission to complete
+  if (written)
+    while (!(UCSR0A & _BV(TXC0)));
+}
+
+size_t UartSerial::write(uint8_t c) {
+  while (!(UCSR0A & _BV(UDRE0)));
+  UCSR0A |= _BV(TXC0);  // clear transmit complete flag, so flush() waits for this character
+  UDR0 = c;
+  written = true;
+  return 1;
+}
+
+size_t UartSerial::write(const uint8_t *buf, size_t len) {
+  for (size_t i = 0; i < len; i++)
+    write(buf[i]);
+  return len;
+}
+
+size_t UartSerial::print(const char *s) {
+  size_t n = 0;
+
+  while (*s)
+    n += write(*s++);
+  return n;
+}
+
+size_t UartSerial::print(unsigned long n, int base) {
+  char buf[8 * sizeof(long) + 1];
+  char *s = &buf[sizeof(buf) - 1];
+
+  *s = '\0';
+  do {
+    byte digit = n % base;
+
+    *--s = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    n /= base;
+  } while (n);
+
+  return print(s);
+}
+
+size_t UartSerial::print(long n, int base) {
+  if (n < 0 && base == DEC)
+    return write('-') + print((unsigned long) -n, base);
+  return print((unsigned long) n, base);
+}
+
+int main(void) {
+  // Timer1 free running at clk/64 for millis/micros
+  TCCR1A = 0;
+  TCCR1B = _BV(CS11) | _BV(CS10);
+  TIMSK1 = _BV(TOIE1);
+  sei();
+
+  setup();
+  for (;;)
+    loop();
+}
+
+#endif
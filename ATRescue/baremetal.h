@@ -0,0 +1,132 @@
+/*
+  Minimal runtime used instead of the Arduino core by the BareMetal build configuration (BAREMETAL defined).
+
+  It provides only what the sketch needs, for the ATmega328P at 16 MHz (Arduino Uno pin numbering):
+   - pinMode, digitalWrite, digitalRead: direct register access, a constant pin compiles to a single sbi/cbi/sbic
+   - delay, delayMicroseconds: cycle counted busy loops, no timer involved
+   - millis, micros: Timer1 running at clk/64 (4 us resolution), the overflow interrupt fires every 262 ms
+     instead of Timer0 firing every 1 ms
+   - Serial: small UART driver, interrupt driven receive buffer and blocking transmit
+   - main(), calling setup() once and loop() forever, no other hardware is touched before setup()
+
+  Binary constants (B01000000...) still come from binary.h of the Arduino core, which is header only.
+*/
+
+#ifndef BAREMETAL_H
+#define BAREMETAL_H
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/delay_basic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <binary.h>
+
+#if !defined(__AVR_ATmega328P__) && !defined(__AVR_ATmega168__)
+  #error "The bare metal runtime only supports the Arduino Uno (ATmega168/328P)"
+#endif
+
+typedef uint8_t byte;
+typedef uint16_t word;
+typedef bool boolean;
+
+#define HIGH          1
+#define LOW           0
+#define INPUT         0
+#define OUTPUT        1
+#define INPUT_PULLUP  2
+
+#define DEC  10
+#define HEX  16
+
+// Arduino Uno pin numbers: digital 0-7 = PORTD, 8-13 = PORTB, A0-A5 (14-19) = PORTC
+#define A0  14
+#define A1  15
+#define A2  16
+#define A3  17
+#define A4  18
+#define A5  19
+
+#define PIN_MASK(pin)  _BV((pin) < 8 ? (pin) : (pin) < 14 ? (pin) - 8 : (pin) - 14)
+#define PIN_PORT(pin)  ((pin) < 8 ? &PORTD : (pin) < 14 ? &PORTB : &PORTC)
+#define PIN_DDR(pin)   ((pin) < 8 ? &DDRD : (pin) < 14 ? &DDRB : &DDRC)
+#define PIN_IN(pin)    ((pin) < 8 ? &PIND : (pin) < 14 ? &PINB : &PINC)
+
+static inline void pin_set(volatile uint8_t *reg, uint8_t mask, uint8_t val, bool constant) {
+  if (constant) {  // constant pin: a single sbi/cbi, which can't be interrupted
+    if (val)
+      *reg |= mask;
+    else
+      *reg &= ~mask;
+  } else {         // read-modify-write, don't let an interrupt change the register meanwhile
+    uint8_t sreg = SREG;
+
+    cli();
+    if (val)
+      *reg |= mask;
+    else
+      *reg &= ~mask;
+    SREG = sreg;
+  }
+}
+
+static inline void pinMode(uint8_t pin, uint8_t mode) {
+  pin_set(PIN_DDR(pin), PIN_MASK(pin), mode == OUTPUT, __builtin_constant_p(pin));
+  if (mode != OUTPUT)
+    pin_set(PIN_PORT(pin), PIN_MASK(pin), mode == INPUT_PULLUP, __builtin_constant_p(pin));
+}
+
+static inline void digitalWrite(uint8_t pin, uint8_t val) {
+  pin_set(PIN_PORT(pin), PIN_MASK(pin), val, __builtin_constant_p(pin));
+}
+
+static inline int digitalRead(uint8_t pin) {
+  return (*PIN_IN(pin) & PIN_MASK(pin)) ? HIGH : LOW;
+}
+
+static inline void delayMicroseconds(unsigned int us) {  // up to 16383 us
+  if (us == 0)
+    return;
+  _delay_loop_2(us * (F_CPU / 4000000UL));  // 4 cycles per iteration
+}
+
+static inline void delay(unsigned long ms) {
+  while (ms--)
+    _delay_loop_2(F_CPU / 4000UL);
+}
+
+unsigned long micros(void);
+unsigned long millis(void);
+
+class UartSerial {  // Serial port 0, 8N1
+public:
+  void begin(unsigned long baud);
+  void end(void);
+  int available(void);
+  int read(void);
+  void flush(void);
+  operator bool() { return true; }
+
+  size_t write(uint8_t c);
+  size_t write(const uint8_t *buf, size_t len);
+
+  size_t print(const char *s);
+  size_t print(char c) { return write(c); }
+  size_t print(unsigned long n, int base = DEC);
+  size_t print(long n, int base = DEC);
+  size_t print(unsigned int n, int base = DEC) { return print((unsigned long) n, base); }
+  size_t print(int n, int base = DEC) { return print((long) n, base); }
+  size_t print(unsigned char n, int base = DEC) { return print((unsigned long) n, base); }
+
+  size_t println(void) { return print("\r\n"); }
+  template <typename T> size_t println(T v) { return print(v) + println(); }
+  template <typename T> size_t println(T v, int base) { return print(v, base) + println(); }
+
+private:
+  bool written;  // something was transmitted since begin(), flush() must wait for TXC0
+};
+
+extern UartSerial Serial;
+
+#endif
@@ -23,6 +23,51 @@
   For a complete list of tested microcontrollers, see http://mightyohm.com/wiki/products:hvrescue:compatibility
 
   Changelog:
+  17/10/26 2.14
+   - added per-chip serialization: a persistent serial number is written to the target EEPROM and verified
+   - added host commands, accepted on the serial port while waiting for the button
+   - added target EEPROM read/write for HVPP and HVSP modes
+   - DATA line access moved to data_write/data_read/data_input (fixes Mega build without function prototypes)
+   - added production statistics, kept in wear levelled slots of the Arduino EEPROM
+   - RDY/SDO waits now time out after READY_TIMEOUT ms instead of hanging forever
+   - HVSP fuse read/burn sequences moved to HVSP_fuse_read/HVSP_fuse_burn
+   - new BareMetal build configuration: runs on the minimal runtime in baremetal.h instead of the Arduino core
+   - simavr support (SIMAVR defined): MCU/VCD trace description in simavr.c, bus primitives marked in GPIOR0
+     (host/simavr_rig.c runs the image against the host target model)
+   - optional interrupt driven HVSP engine (HVSP_ISR): Timer2 clocks queued frames out, the UART stays open
+   - programming mode entry checks the signature and retries with alternative timings (entry_profiles)
+   - session API: target_* operations for signature, erase, flash, EEPROM, fuses and lock in both HVPP and HVSP
+     modes, host commands run them in any order inside one programming mode session (hv ... off)
+   - added blank check of flash and EEPROM ranges, stops at the first programmed location
+   - optional macro engine (MACRO): bytecode uploaded by the host and kept in the Arduino EEPROM runs a whole
+     programming flow from the button or one host command
+   - optional pattern generator (VECTORS): host uploaded port vectors are played back with interrupts off,
+     PINB/PIND are captured at every step
+   - simavr: bus primitives also log their arguments (GPIOR1/GPIOR2), SIM_SCRIPT runs every operation once, its bus trace
+     and those of a loop() cycle per mode are checked against reference ones (host/golden, make check)
+   - bus timing (SCI half period, XTAL1/PAGEL strobe, OE to read, WR pulse) set by T_* and the timing command
+   - link characterisation host commands: ping with device timestamp, sink/source throughput probes, baud
+     rate change with fallback; host/linktune.py picks the baud rate and send-ahead window from them
+   - mode, baud rate and bus timing can be saved in the Arduino EEPROM: after a reset (ie. DTR on host connect)
+     the sketch comes back ready without the mode menu; mode and sync host commands
+   - added flash/EEPROM range CRC and burn-if-different fuse updates, for planning the cheapest rescue;
+     host/plan.py reads the part, plans it and runs it in one session
+   - added chip erase keeping the EEPROM: EESAVE is programmed around the erase, then its fuse is restored
+   - the button wait does the slow housekeeping (statistics save, entry variant lookup) so a cycle starts and
+     ends without EEPROM waits
+   - optional unrolled HVSP frame kernel (HVSP_FAST, Uno only): 11 cycles per SCI clock instead of 2 ms
+   - Arduino Leonardo/Micro support (LEONARDO): the host link is USB, so it stays open while DATA is in use; checked on
+     the host (host/atrescue_sim_leonardo, make check)
+   - single line operator jobs (HOSTCMD), ie. "hvsp L=62 H=DF E=FF lock=FF verify", '!' runs the last line again
+   - optional watchdog (WATCHDOG) armed while the target is in programming mode: a hang turns 12V off, the
+     reset is recorded in the EEPROM and reported at startup; fuse prompts time out after PROMPT_TIMEOUT
+   - HVPP command and address loads are skipped when the target already holds the value
+   - optional event journal (JOURNAL): 64 records in the Arduino EEPROM, written while idle, dumped by a host command
+   - optional bench host command (BENCH): bus primitives timed with Timer1 on the real board, min/mean/max cycles
+   - optional Arduino EEPROM write cache (EE_CACHE), written from the EEPROM ready interrupt while idle
+   - host simulation (host/): the sketch runs on a PC against a target model that checks the datasheet timing,
+     sweep.py searches the bus and entry timings in parallel and reports the fastest reliable ones
+
   31/03/18 2.13 Gionata Boccalini
    - moved function on top of setup and loop (to compile without function prototypes)
    - changed the logic on RST pin: now is inverting
@@ -93,21 +138,98 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include <Arduino.h>
+#ifdef BAREMETAL  // defined by the BareMetal build configuration
+  #include "baremetal.h"
+#else
+  #include <Arduino.h>
+#endif
+#include <avr/eeprom.h>
+#include <avr/wdt.h>
+#include <util/delay_basic.h>
+#include <util/crc16.h>
+#ifdef SIMAVR
+  #include <avr/sleep.h>
+#endif
 
 // User defined settings
 #define  MEGA         0       // Set this to 1 if you are using an Arduino Mega (default = 0)
+#define  LEONARDO     0       // Set this to 1 if you are using an Arduino Leonardo or Micro (default = 0)
 #define  DEFAULTMODE  ATMEGA  // If running in non-interactive mode, you need to set this to ATMEGA, TINY2313, or HVSP.
 #define  ASKMODE      1       // Set this to 1 to enable mode question at startup
 #define  INTERACTIVE  1       // Set this to 0 to disable interactive (serial) mode
 #define  BURN_EFUSE   0       // Set this to 1 to enable burning extended fuse byte
 #define  BAUD         9600    // Serial port rate at which to talk to PC
+#define  HOSTCMD      0       // Set this to 1 to accept host commands while waiting for the button
+#define  LINK_TIMEOUT 2000    // Host commands: longest wait for sink data and for the new baud rate check, in ms
+#define  BAUD_MIN     300     // Host commands: slowest and fastest rate the baud command (and a saved setting) may set
+#define  BAUD_MAX     2000000
+#define  SESSION_TIMEOUT 60000UL  // Host commands: a session is closed after this long without host traffic, in ms
+#define  SERIALIZE    0       // Set this to 1 to write a serial number into the target EEPROM after the fuses
+#define  STATS        0       // Set this to 1 to keep production statistics in the Arduino EEPROM
+#define  READY_TIMEOUT 100    // Longest wait for RDY/SDO after a write, in ms
+#define  HVSP_ISR     0       // Set this to 1 to clock HVSP frames from the Timer2 interrupt
+#define  HVSP_TICK    50      // Timer2 interrupt period for HVSP_ISR, one SCI edge per tick, in us (1-128)
+#define  HVSP_FAST    0       // Set this to 1 to clock HVSP frames with the unrolled kernel (Uno only)
+#define  ENTRY_OFF    10      // Power off time before retrying programming mode entry, in ms
+#define  MACRO        0       // Set this to 1 to run the stored macro instead of the fuse prompts
+#define  MACRO_TIMEOUT 10000UL  // MACRO: longest run, a macro still running then (ie. a branch loop) fails, in ms
+#define  VECTORS      0       // Set this to 1 to enable the raw bus pattern generator (host commands, Uno only)
+#define  WATCHDOG     0       // Set this to 1 to reset to a safe state (12V off) if the sketch hangs in programming mode
+#define  WDT_TIMEOUT  WDTO_1S // Watchdog period while the target is in programming mode
+#define  PROMPT_TIMEOUT 60000UL  // WATCHDOG: longest wait for a fuse value with 12V on, in ms
+#define  JOURNAL      0       // Set this to 1 to keep an event journal in the Arduino EEPROM
+#define  BENCH        0       // Set this to 1 to time the bus primitives with Timer1 (host commands)
+#define  EE_CACHE     0       // Set this to 1 to write the Arduino EEPROM in the background while idle
+
+// Bus timing defaults, in us (up to 16383), changed at run time with the timing host command
+#define  T_SCLK       1000    // SCI half period (HVSP)
+#define  T_STROBE     1000    // XTAL1 setup and pulse width, PAGEL pulse width (HVPP)
+#define  T_OE         1000    // !OE low to DATA read (HVPP)
+#define  T_WR         1000    // !WR pulse width (HVPP)
+#define  T_MAX        16383   // longest bus timing, delayMicroseconds() is only accurate up to this
+
+#ifdef HOST_CONFIG  // host simulation (host/Makefile): a configuration header changes the settings above
+  #include HOST_CONFIG
+#endif
+
+#if ((T_SCLK > T_MAX) || (T_STROBE > T_MAX) || (T_OE > T_MAX) || (T_WR > T_MAX))
+  #error "Bus timings must not exceed T_MAX (16383 us)"
+#endif
+
+#if (defined(BAREMETAL) && (MEGA == 1))
+  #error "The bare metal runtime does not support the Arduino Mega"
+#endif
+
+#if ((LEONARDO == 1) && ((MEGA == 1) || (HVSP_ISR == 1) || (HVSP_FAST == 1) || (VECTORS == 1)))
+  #error "The Leonardo has no Timer2 and a different port layout: no MEGA, HVSP_ISR, HVSP_FAST or VECTORS"
+#endif
+
+#if ((HVSP_FAST == 1) && ((MEGA == 1) || (HVSP_ISR == 1)))
+  #error "HVSP_FAST needs the Arduino Uno port layout and can't be used with HVSP_ISR"
+#endif
+
+#if ((VECTORS == 1) && ((MEGA == 1) || (HOSTCMD == 0)))
+  #error "VECTORS needs HOSTCMD and the Arduino Uno port layout"
+#endif
+
+#if ((BENCH == 1) && (HOSTCMD == 0))
+  #error "BENCH needs HOSTCMD"
+#endif
 
 // If interactive mode is off, these fuse settings are used instead of user prompted values
 #define  LFUSE        0x62    // default for ATmega168 = 0x62
 #define  HFUSE        0xDF    // default for ATmega168 = 0xDF
 #define  EFUSE        0xF9    // default for ATmega168 = 0xF9
 
+// Serialization settings: the number comes from a counter kept in the Arduino EEPROM and is incremented
+// for every part, also when verify fails, so a number is never issued twice.
+#define  SERIAL_ADDR       0x0000  // target EEPROM address of the serial number
+#define  SERIAL_BYTES      4       // length of the number (1-4 bytes)
+#define  SERIAL_MSB_FIRST  1       // byte order: 1 = big endian, 0 = little endian
+#define  SERIAL_FIRST      1       // first number issued on a blank Arduino EEPROM
+#define  SERIAL_PREFIX_LEN 0       // fixed bytes written before the number, ie. 3 for a MAC address OUI
+#define  SERIAL_PREFIX     0x02, 0x00, 0x00
+
 /*
   Data line assignments
   Fuse and command data for HVPP mode are sent using Arduino digital lines 0-7
@@ -127,6 +249,18 @@
     5  PE3  (PORTE)
     6  PH3  (PORTH)
     7  PH4  (PORTH)
+
+  Arduino Leonardo and Micro (ATmega32u4) - also scattered, but the serial port to the PC is native USB, so
+  unlike the Uno and Mega the host link doesn't share digital lines 0-1 with DATA:
+    Digital Line  AVR Signal Name
+    0  PD2  (PORTD)
+    1  PD3  (PORTD)
+    2  PD1  (PORTD)
+    3  PD0  (PORTD)
+    4  PD4  (PORTD)
+    5  PC6  (PORTC)
+    6  PD7  (PORTD)
+    7  PE6  (PORTE)
 */
 
 // Pin Assignments (you shouldn't need to change these)
@@ -188,15 +322,184 @@
 #define HVSP_WRITE_EFUSE_INSTR3  B01100110
 #define HVSP_WRITE_EFUSE_INSTR4  B01101110
 
+// EEPROM
+// Only the byte write variant is used: the page is programmed right after loading one byte.
+#define HVSP_WRITE_EEPROM_DATA   B00010001
+#define HVSP_WRITE_EEPROM_INSTR1 B01001100  // Instructions 2-4 follow the address and data loads,
+#define HVSP_WRITE_EEPROM_INSTR2 B01101101  // and have data = all zeros.
+#define HVSP_WRITE_EEPROM_INSTR3 B01100100
+#define HVSP_WRITE_EEPROM_INSTR4 B01101100
+
+#define HVSP_READ_EEPROM_DATA    B00000011
+#define HVSP_READ_EEPROM_INSTR1  B01001100
+#define HVSP_READ_EEPROM_INSTR2  B01101000
+#define HVSP_READ_EEPROM_INSTR3  B01101100
+
+// Signature
+#define HVSP_READ_SIG_DATA       B00001000  // Instruction 2 is the address load, with data = signature byte address.
+#define HVSP_READ_SIG_INSTR1     B01001100  // Instructions 3-4 have data = all zeros.
+#define HVSP_READ_SIG_INSTR3     B01101000
+#define HVSP_READ_SIG_INSTR4     B01101100
+
+// Flash
+#define HVSP_READ_FLASH_DATA     B00000010  // Followed by the address loads, then
+#define HVSP_READ_FLASH_INSTR1   B01001100  // instructions 2-3 read the low byte
+#define HVSP_READ_FLASH_INSTR2   B01101000  // and instructions 4-5 the high byte, all with data = all zeros.
+#define HVSP_READ_FLASH_INSTR3   B01101100
+#define HVSP_READ_FLASH_INSTR4   B01111000
+#define HVSP_READ_FLASH_INSTR5   B01111100
+
+#define HVSP_WRITE_FLASH_DATA    B00010000  // Each word is loaded with address low, data low, data high,
+#define HVSP_WRITE_FLASH_INSTR1  B01001100  // then latched with instructions 2-3.  The page is programmed by
+#define HVSP_WRITE_FLASH_INSTR2  B01111101  // address high and instructions 4-5, all with data = all zeros.
+#define HVSP_WRITE_FLASH_INSTR3  B01111100
+#define HVSP_WRITE_FLASH_INSTR4  B01100100
+#define HVSP_WRITE_FLASH_INSTR5  B01101100
+
+// Chip erase
+#define HVSP_ERASE_DATA          B10000000
+#define HVSP_ERASE_INSTR1        B01001100
+#define HVSP_ERASE_INSTR2        B01100100
+#define HVSP_ERASE_INSTR3        B01101100
+
+// Lock bits
+#define HVSP_WRITE_LOCK_DATA     B00100000  // Instruction 2 is the data load, with data = lock bits.
+#define HVSP_WRITE_LOCK_INSTR1   B01001100
+#define HVSP_WRITE_LOCK_INSTR3   B01100100
+#define HVSP_WRITE_LOCK_INSTR4   B01101100
+
+#define HVSP_READ_LOCK_DATA      B00000100
+#define HVSP_READ_LOCK_INSTR1    B01001100
+#define HVSP_READ_LOCK_INSTR2    B01111000
+#define HVSP_READ_LOCK_INSTR3    B01111100
+
+#define HVSP_NOP_DATA            B00000000  // No operation, ends page programming
+#define HVSP_NOP_INSTR           B01001100
+
+// Address and data loads, data contains the address or data byte
+#define HVSP_LOAD_ADDR_LOW_INSTR  B00001100
+#define HVSP_LOAD_ADDR_HIGH_INSTR B00011100
+#define HVSP_LOAD_DATA_LOW_INSTR  B00101100
+#define HVSP_LOAD_DATA_HIGH_INSTR B00111100
+
+// Arduino EEPROM layout: data kept across power cycles in the EEPROM of the Arduino itself
+#define  EE_SERIAL_NEXT  0x000  // next serial number to issue (4 bytes)
+#define  EE_SERIAL_LOG   0x010  // serial number records, SERIAL_LOG_LEN entries
+#define  EE_CONFIG       0x0D8  // saved settings (config_t)
+#define  EE_WDT          0x0E8  // last reset in programming mode (wdt_record)
+#define  EE_ENTRY        0x0F0  // programming mode entry variant that worked last, one byte per mode
+#define  SERIAL_LOG_LEN  16
+#define  EE_MACRO        0x090  // macro length, then MACRO_LEN bytes of macro
+#define  EE_STATS        0x100  // statistics slots, STATS_SLOTS entries of sequence number + stats_t
+#define  EE_JOURNAL      0x200  // event journal, JOURNAL_SLOTS records of journal_entry
+#define  STATS_SLOTS     4
+#define  STATS_SLOT_LEN  (sizeof(word) + sizeof(stats_t))
+
+#define  CMDLINE_LEN     80     // longest host command line, "buf" takes up to 32 data bytes
+#define  PAGE_BUF_LEN    128    // flash page buffer, largest page of the supported parts
+#define  HVSP_QUEUE_LEN  16     // HVSP frames queued for the Timer2 interrupt, must be a power of 2
+#define  ENTRY_VARIANTS  3      // programming mode entry variants for each mode
+#define  MACRO_LEN       64     // longest macro, in bytes
+#define  MACRO_OUT_LEN   16     // bytes a macro can emit
+#define  MACRO_TIMED_OUT 0xFF   // macro_run status when MACRO_TIMEOUT ran out
+#define  VECTOR_LEN      32     // pattern generator steps
+#define  CONFIG_MAGIC    0xA5   // marks saved settings as valid
+#define  JOURNAL_SLOTS   64     // journal records in the Arduino EEPROM (512 bytes)
+#define  JOURNAL_QUEUE   8      // journal records waiting to be written, must be a power of 2
+#define  EE_CACHE_LEN    48     // Arduino EEPROM bytes waiting to be written (EE_CACHE), at least one stats slot
+
 // Enable debug mode by uncommenting this line
 //#define DEBUG
 
 // Internal definitions
 enum modelist { ATMEGA, TINY2313, HVSP };
 enum fusesel { LFUSE_SEL, HFUSE_SEL, EFUSE_SEL };
+enum targetop { OP_SIG, OP_ERASE, OP_FUSE, OP_LOCK, OP_EE, OP_FLASH, OP_PAGE, OP_VERIFY,  // see target_op
+                OP_BLANK, OP_EE_BLANK, OP_CRC, OP_EE_CRC, OP_ERASE_KEEP };
+
+// Markers written to GPIOR0 when running in simavr: id when a primitive starts, id | 0x80 when it ends.
+// A GPIOR0 write is a single cycle "out", so the timing of the primitives is not affected.
+// Arguments (command, address, data, HVSP frame, byte read) go to GPIOR1/GPIOR2 just before the marker, so the
+// sequence of markers with their arguments is the logical bus trace, independent of timing.
+enum simmark { MARK_SCLK = 1, MARK_STROBE_XTAL, MARK_SEND_CMD, MARK_FUSE_BURN, MARK_FUSE_READ,
+               MARK_HVSP_READ, MARK_HVSP_WRITE, MARK_HV_ENTER, MARK_HV_EXIT, MARK_LOAD_ADDR, MARK_LOAD_DATA,
+               MARK_DATA_READ };
+
+#ifdef SIMAVR
+  #define SIM_MARK(m)     (GPIOR0 = (m))
+  #define SIM_DONE(m)     (GPIOR0 = (m) | 0x80)
+  #define SIM_ARG(a, b)   do { GPIOR1 = (a); GPIOR2 = (b); } while (0)
+#else
+  #define SIM_MARK(m)
+  #define SIM_DONE(m)
+  #define SIM_ARG(a, b)
+#endif
 
 // Global variables
 byte mode = DEFAULTMODE;  // programming mode
+unsigned long baud = BAUD;  // serial port rate, changed by the baud host command
+byte entry_first[3] = { 0xFF, 0xFF, 0xFF };  // entry variant to try first for each mode, 0xFF = not loaded yet
+byte entry_tries = 0;      // entry variants tried by the last hv_start
+
+struct timing_t {  // bus timing, in us
+  word sclk;
+  word strobe;
+  word oe;
+  word wr;
+};
+
+timing_t timing = { T_SCLK, T_STROBE, T_OE, T_WR };
+
+struct config_t {      // settings kept in the Arduino EEPROM across resets
+  byte magic;          // CONFIG_MAGIC when valid
+  byte mode;
+  unsigned long baud;
+  timing_t timing;
+};
+byte session = 0;         // 1 while the target is in programming mode
+int hvpp_cmd = -1;        // HVPP command the target holds, -1 = unknown
+int hvpp_addr[2] = { -1, -1 };  // HVPP address low and high byte the target holds, -1 = unknown
+
+#if (WATCHDOG == 1)
+enum wdtphase { PHASE_IDLE, PHASE_SESSION, PHASE_PROMPT };
+
+struct wdt_mark_t {  // what was running, kept across a reset
+  byte phase;
+  byte check;  // ~phase, anything else is RAM content from power up
+};
+
+struct wdt_record {  // last reset that hit a programming mode session, in the Arduino EEPROM
+  byte cause;  // MCUSR
+  byte phase;
+  word count;  // resets in programming mode so far
+};
+
+wdt_mark_t wdt_mark __attribute__((section(".noinit")));
+byte reset_cause __attribute__((section(".noinit")));  // MCUSR, saved before .bss is cleared
+
+#define WDT_FEED()  wdt_reset()
+#define WDT_PROMPT(start)  do { if (millis() - (start) < PROMPT_TIMEOUT) wdt_reset(); } while (0)
+#else
+#define WDT_FEED()
+#define WDT_PROMPT(start)
+#endif
+byte page_buf[PAGE_BUF_LEN];  // flash data for OP_PAGE and OP_VERIFY, filled by OP_FLASH
+
+// Programming mode entry timing.  Variant 0 is the original sequence, tuned for this board.  Variant 1 is the
+// datasheet alternative algorithm for parts that can't take a slow VCC rise (external clock, RSTDISBL
+// programmed): 12V goes to !RESET right after VCC.  Variant 2 backs off every delay.
+struct entry_profile {
+  byte vcc_to_hv;    // VCC high to 12V on !RESET, in us
+  byte sdo_release;  // 12V to SDO release (HVSP only), in us
+  byte settle;       // 12V to !OE/!WR release, in us
+  byte cmd_wait;     // wait before the first command, in ms
+};
+
+entry_profile entry_profiles[][ENTRY_VARIANTS] = {  // indexed by mode, not const: the host timing sweep sets variant 0
+  { { 80, 0, 10, 1 }, { 0, 0, 10, 1 }, { 80, 0, 100, 5 } },    // ATMEGA
+  { { 80, 0, 10, 1 }, { 0, 0, 10, 1 }, { 80, 0, 100, 5 } },    // TINY2313
+  { { 80, 1, 10, 1 }, { 0, 1, 10, 1 }, { 80, 10, 100, 5 } },   // HVSP
+};
 
 // These pin assignments change depending on which chip is being programmed,
 // so they can't be set using #define
@@ -204,23 +507,175 @@ byte mode = DEFAULTMODE;  // programming mode
 byte PAGEL = A5;  // ATtiny2313: PAGEL = BS1
 byte BS2 = 9;     // ATtiny2313: BS2 = XA1
 
+#if (SERIALIZE == 1)
+struct serial_record {  // serial number record, kept so the host can reconcile numbers with parts
+  unsigned long number;
+  byte status;          // 1 = written and verified, 0 = verify failed
+  byte fuses[3];        // LFUSE, HFUSE and EFUSE read back after burning
+};
+
+const byte serial_prefix[] = { SERIAL_PREFIX };
+#endif
+
+#if (STATS == 1)
+struct stats_t {                // production statistics
+  unsigned long cycles;         // cycles started (button presses)
+  unsigned long hv_entries;     // programming mode entries
+  unsigned long fuses_burned;   // fuse bytes burned
+  unsigned int verify_fail[3];  // verify failures of LFUSE, HFUSE, EFUSE
+  unsigned int timeouts;        // RDY/SDO timeouts
+  unsigned int retries;         // programming mode entry retries
+  unsigned long burn_time;      // sum of all burn times (first instruction to RDY/SDO high, HVPP and HVSP alike),
+                                // in units of 10 us (average = burn_time / fuses_burned)
+  unsigned int burn_max;        // longest burn, in units of 10 us
+  unsigned long cycle_time;     // sum of all cycle times, in ms (average = cycle_time / cycles)
+  unsigned long cycle_max;      // longest cycle, in ms
+};
+
+enum statsel { STATS_LIFE, STATS_SESSION };
+
+stats_t stats[2];     // lifetime statistics and statistics since power up
+word stats_seq = 0;   // sequence number of the last saved slot
+byte stats_slot = 0;  // next slot to save to
+byte stats_dirty = 0; // lifetime statistics changed since the last save, saved by idle_housekeeping
+
+#if (EE_CACHE == 1)
+static_assert(EE_CACHE_LEN >= STATS_SLOT_LEN, "EE_CACHE_LEN must hold a whole statistics slot");
+#endif
+
+#define STATS_ADD(field, n)  do { stats[STATS_LIFE].field += (n); stats[STATS_SESSION].field += (n); } while (0)
+#else
+#define STATS_ADD(field, n)
+#endif
+
+#if (HVSP_ISR == 1)
+struct hvsp_frame {  // HVSP frame queued for the Timer2 interrupt
+  byte data;
+  byte instr;
+  byte response;     // response of the target, valid once the frame is done
+};
+
+volatile hvsp_frame hvsp_queue[HVSP_QUEUE_LEN];
+volatile byte hvsp_head = 0;  // next free slot, moved by the main loop
+volatile byte hvsp_tail = 0;  // frame being clocked, moved by the interrupt when the frame is done
+volatile byte hvsp_done = 0;  // frames done, wraps around
+byte hvsp_seq = 0;            // frames queued, wraps around
+#endif
+
+#if (MACRO == 1)
+// Macro opcodes, operands follow the opcode.  r is the result register, CMP sets the flag tested by BNE.
+enum macroop {
+  M_END,    //                     leave programming mode and stop
+  M_ENTER,  //                     enter programming mode, fails if the target doesn't answer
+  M_EXIT,   //                     leave programming mode
+  M_CMD,    // command             send_cmd (HVPP)
+  M_ADDR,   // low, high           load address (HVPP)
+  M_DATA,   // data                load data low byte (HVPP)
+  M_READ,   // bs                  r = DATA with OE low, BS1 = bit 0, BS2 = bit 1 of bs (HVPP)
+  M_WR,     // bs                  !WR pulse with BS1/BS2 set as for M_READ (HVPP)
+  M_READY,  //                     wait for RDY/SDO, fails on timeout
+  M_HVSP,   // data, instr         r = HVSP_read(data, instr) (HVSP)
+  M_OP,     // op, low, high, val, write    r = target_op(op, high:low, val, write)
+  M_LDI,    // value               r = value
+  M_CMP,    // value               flag = (r == value)
+  M_BNE,    // offset              branch by a signed offset from the next opcode if the flag is clear
+  M_EMIT,   //                     append r to the macro output
+  M_DELAY,  // ms                  wait
+  M_FAIL    //                     leave programming mode and stop with an error
+};
+
+byte macro[MACRO_LEN + 5];     // macro, with room for the operands of a truncated last instruction
+byte macro_len = 0;
+byte macro_out[MACRO_OUT_LEN]; // bytes emitted by the last run
+byte macro_outlen = 0;
+#endif
+
+#if (VECTORS == 1)
+struct vector {  // pattern generator step
+  byte portb;    // PORTB, PORTC and PORTD are written in this order, then the step is held
+  byte portc;    // BUTTON (PC1) is always kept an input with its pullup on
+  byte portd;
+  byte ddrb;     // DDRB, DDRC and DDRD are written before the ports
+  byte ddrc;
+  byte ddrd;
+  word hold;     // hold time in units of 4 cycles (0.25 us), on top of the fixed cost of one step
+  byte pinb;     // PINB and PIND sampled at the end of the hold time
+  byte pind;
+};
+
+vector vectors[VECTOR_LEN];
+byte vector_len = 0;
+#endif
+
+#if (EE_CACHE == 1)
+struct ee_pending {  // Arduino EEPROM byte waiting to be written
+  word addr;
+  byte value;
+};
+
+ee_pending ee_cache[EE_CACHE_LEN];  // oldest first
+volatile byte ee_cached = 0;
+#endif
+
+#if (JOURNAL == 1)
+enum journalevent {  // a, b of each event
+  J_BOOT,     // MCUSR, mode
+  J_WDT,      // MCUSR, phase: reset that cut a session short (WATCHDOG)
+  J_ENTER,    // mode, attempts << 4 | entry variant (variant 0xF = failed, 1 attempt = no retry)
+  J_SIG,      // signature bytes 1 and 2
+  J_FUSE_L,   // value before, value after (J_FUSE_L + fusesel)
+  J_FUSE_H,
+  J_FUSE_E,
+  J_VERIFY,   // failed fuses (bit 0 LFUSE, 1 HFUSE, 2 EFUSE), 0 = OK
+  J_TIMEOUT   // mode, HVPP command loaded (0xFF = unknown or HVSP)
+};
+
+struct journal_entry {  // 8 bytes
+  byte seq;    // increments by one from record to record, the newest record is before the first gap
+  byte event;  // 0xFF = never written
+  byte a;
+  byte b;
+  word cycle;  // button cycles, kept across resets
+  word time;   // time since boot, in s
+};
+
+journal_entry journal_queue[JOURNAL_QUEUE];  // records waiting for idle_housekeeping
+byte journal_head = 0;
+byte journal_tail = 0;
+byte journal_next = 0;   // next slot to write
+byte journal_seq = 0;    // sequence number of the next record
+word journal_cycle = 0;
+#endif
+
+#if (HOSTCMD == 1)
+char cmdline[CMDLINE_LEN];  // host command being received
+char cmdlast[CMDLINE_LEN];  // last command run, '!' runs it again
+byte cmdlen = 0;
+unsigned long host_seen;    // last character received, a quiet host has its session closed
+#endif
+
 
 void sclk(void) {  // send serial clock pulse, used by HVSP commands
 
-  // These delays are much  longer than the minimum requirements,
-  // but we don't really care about speed.
-  delay(1);
+  // The default delays are much longer than the minimum requirements,
+  // but we don't really care about speed.  See timing.sclk.
+  SIM_MARK(MARK_SCLK);
+  delayMicroseconds(timing.sclk);
   digitalWrite(SCI, HIGH);
-  delay(1);
+  delayMicroseconds(timing.sclk);
   digitalWrite(SCI, LOW);
+  SIM_DONE(MARK_SCLK);
 }
 
 void strobe_xtal(void) {  // strobe xtal (usually to latch data on the bus)
 
-  delay(1);
+  SIM_MARK(MARK_STROBE_XTAL);
+  WDT_FEED();  // every HVPP transaction shows the sketch is alive
+  delayMicroseconds(timing.strobe);
   digitalWrite(XTAL1, HIGH);  // pulse XTAL to send command to target
-  delay(1);
+  delayMicroseconds(timing.strobe);
   digitalWrite(XTAL1, LOW);
+  SIM_DONE(MARK_STROBE_XTAL);
 }
 
 int hex2dec(byte c) { // converts one HEX character into a number
@@ -230,11 +685,525 @@ int hex2dec(byte c) { // converts one HEX character into a number
   else if (c >= 'A' && c <= 'F') {
     return c - 'A' + 10;
   }
+  else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
   return c;
 }
 
+// Arduino EEPROM access.  With EE_CACHE, writes only go to RAM; idle_housekeeping lets the EEPROM ready interrupt
+// write them out one byte at a time, in order, and ee_sync writes them before anything can reset the board.
+#if (EE_CACHE == 1)
+void ee_write_one(void) {  // Write the oldest cached byte, interrupts must be off and no write running
+  EEAR = ee_cache[0].addr;
+  EEDR = ee_cache[0].value;
+  EECR |= _BV(EEMPE);
+  EECR |= _BV(EEPE);  // within 4 cycles of EEMPE
+  ee_cached--;
+  memmove(ee_cache, ee_cache + 1, ee_cached * sizeof(ee_pending));
+  if (ee_cached == 0)
+    EECR &= ~_BV(EERIE);
+}
+
+ISR(EE_READY_vect) {  // The last write is done, start the next one
+  if (ee_cached)
+    ee_write_one();
+  else
+    EECR &= ~_BV(EERIE);
+}
+
+void ee_background(byte on) {  // Let the interrupt write the cache (idle), or keep the EEPROM quiet (programming)
+  if (on && ee_cached)
+    EECR |= _BV(EERIE);
+  else
+    EECR &= ~_BV(EERIE);
+}
+
+void ee_lock(void) {  // Turn interrupts off once no write is running, without waiting for one with interrupts off
+  byte sreg = SREG;
+
+  for (;;) {
+    while (EECR & _BV(EEPE));
+    cli();
+    if (!(EECR & _BV(EEPE)))  // the interrupt didn't start the next write meanwhile
+      return;
+    SREG = sreg;
+  }
+}
+
+void ee_sync(void) {  // Write every cached byte now
+  byte sreg = SREG;
+
+  while (ee_cached) {
+    ee_lock();
+    if (ee_cached)
+      ee_write_one();
+    SREG = sreg;
+  }
+  while (EECR & _BV(EEPE));
+}
+
+byte ee_read_byte(word addr) {
+  byte sreg = SREG;
+  byte value;
+  byte i;
+
+  ee_lock();  // the interrupt must not change EEAR or the cache meanwhile
+  for (i = ee_cached; i > 0 && ee_cache[i - 1].addr != addr; i--);  // newest first
+  value = i ? ee_cache[i - 1].value : eeprom_read_byte((const uint8_t *) addr);
+  SREG = sreg;
+  return value;
+}
+
+void ee_update_byte(word addr, byte value) {  // Cache the byte if it changes, a byte still waiting is rewritten in place
+  byte sreg = SREG;
+  byte i;
+
+  ee_lock();
+  for (i = 0; i < ee_cached && ee_cache[i].addr != addr; i++);
+  if (i < ee_cached) {
+    ee_cache[i].value = value;
+  } else if (eeprom_read_byte((const uint8_t *) addr) != value) {
+    if (ee_cached == EE_CACHE_LEN)
+      ee_write_one();  // full, the oldest byte goes out now; the next call waits for it with interrupts on
+    ee_cache[ee_cached].addr = addr;
+    ee_cache[ee_cached].value = value;
+    ee_cached++;
+  }
+  SREG = sreg;
+}
+
+void ee_read_block(void *dst, word addr, size_t len) {
+  for (byte *d = (byte *) dst; len; len--)
+    *d++ = ee_read_byte(addr++);
+}
+
+void ee_update_block(const void *src, word addr, size_t len) {
+  for (const byte *s = (const byte *) src; len; len--)
+    ee_update_byte(addr++, *s++);
+}
+#else
+byte ee_read_byte(word addr) {
+  return eeprom_read_byte((const uint8_t *) addr);
+}
+
+void ee_update_byte(word addr, byte value) {
+  eeprom_update_byte((uint8_t *) addr, value);
+}
+
+void ee_read_block(void *dst, word addr, size_t len) {
+  eeprom_read_block(dst, (const void *) addr, len);
+}
+
+void ee_update_block(const void *src, word addr, size_t len) {
+  eeprom_update_block(src, (void *) addr, len);
+}
+
+void ee_sync(void) {}
+#endif
+
+#if (STATS == 1)
+void stats_burn(unsigned long us) {  // account a fuse burn that took us microseconds
+  unsigned int t = us / 10;
+
+  STATS_ADD(fuses_burned, 1);
+  STATS_ADD(burn_time, t);
+  for (byte i = 0; i < 2; i++) {
+    if (t > stats[i].burn_max)
+      stats[i].burn_max = t;
+  }
+}
+
+void stats_cycle(unsigned long ms) {  // account a programming cycle that took ms milliseconds
+  STATS_ADD(cycle_time, ms);
+  for (byte i = 0; i < 2; i++) {
+    if (ms > stats[i].cycle_max)
+      stats[i].cycle_max = ms;
+  }
+}
+#endif
+
+#if (JOURNAL == 1)
+void journal_add(byte event, byte a, byte b) {  // Queue a record, written by idle_housekeeping; dropped if the queue is full
+  journal_entry *e = &journal_queue[journal_head & (JOURNAL_QUEUE - 1)];
+
+  if ((byte) (journal_head - journal_tail) == JOURNAL_QUEUE)
+    return;
+  e->event = event;
+  e->a = a;
+  e->b = b;
+  e->cycle = journal_cycle;
+  e->time = millis() / 1000;
+  journal_head++;
+}
+#endif
+
+#if (HVSP_ISR == 1)
+// Frames are clocked out by the Timer2 compare interrupt, while the main loop keeps running (and the
+// UART keeps sending and receiving, HVSP doesn't use DATA0/DATA1).  Each frame takes 22 ticks:
+// one tick sets SDI/SII and raises SCI, the next one lowers SCI and samples SDO, just like HVSP_read.
+ISR(TIMER2_COMPA_vect) {
+  static byte bit = 0;   // frame bit being clocked, 0-10
+  static byte high = 0;  // SCI is high
+  static byte data, instr, response;
+
+  if (!high) {
+    if (bit == 0) {  // start the next frame
+      if (hvsp_tail == hvsp_head) {  // queue empty, stop until HVSP_queue starts again
+        TIMSK2 &= ~_BV(OCIE2A);
+        return;
+      }
+      data = hvsp_queue[hvsp_tail].data;
+      instr = hvsp_queue[hvsp_tail].instr;
+      response = 0;
+    }
+
+    if (bit >= 1 && bit <= 8) {  // data and instruction bits, MSB first; 1st and last 2 bits are zero
+      digitalWrite(SDI, (data & 0x80) ? HIGH : LOW);
+      digitalWrite(SII, (instr & 0x80) ? HIGH : LOW);
+      data <<= 1;
+      instr <<= 1;
+    } else {
+      digitalWrite(SDI, LOW);
+      digitalWrite(SII, LOW);
+    }
+    digitalWrite(SCI, HIGH);
+    high = 1;
+  } else {
+    digitalWrite(SCI, LOW);
+    high = 0;
+
+    if (bit <= 7) {  // the response comes MSB first, starting after the 1st clock
+      response <<= 1;
+      if (digitalRead(SDO) == HIGH)
+        response |= 0x01;
+    }
+
+    if (++bit == 11) {  // frame done
+      hvsp_queue[hvsp_tail].response = response;
+      hvsp_tail = (hvsp_tail + 1) & (HVSP_QUEUE_LEN - 1);
+      hvsp_done++;
+      bit = 0;
+    }
+  }
+}
+
+void HVSP_timer_init(void) {  // Timer2 in CTC mode, interrupt enabled by HVSP_queue
+  TCCR2A = _BV(WGM21);
+  TCCR2B = _BV(CS21);  // clk/8, 0.5 us per count
+  OCR2A = HVSP_TICK * 2 - 1;
+  TIMSK2 = 0;
+}
+
+byte HVSP_queue(byte data, byte instr) {  // Queue a frame, returns its sequence number for HVSP_result
+  byte next = (hvsp_head + 1) & (HVSP_QUEUE_LEN - 1);
+  byte sreg;
+
+  while (next == hvsp_tail);  // queue full, wait for a frame to be done
+
+  hvsp_queue[hvsp_head].data = data;
+  hvsp_queue[hvsp_head].instr = instr;
+
+  sreg = SREG;
+  cli();
+  hvsp_head = next;
+  if (!(TIMSK2 & _BV(OCIE2A))) {  // engine stopped, restart it
+    TCNT2 = 0;
+    TIFR2 = _BV(OCF2A);
+    TIMSK2 |= _BV(OCIE2A);
+  }
+  SREG = sreg;
+
+  return hvsp_seq++;
+}
+
+byte HVSP_result(byte seq) {  // Wait for a queued frame to be done, returns the target response
+  while ((int8_t) (hvsp_done - seq) <= 0);
+  return hvsp_queue[seq & (HVSP_QUEUE_LEN - 1)].response;
+}
+
+void HVSP_sync(void) {  // Wait for all queued frames to be done
+  while (hvsp_tail != hvsp_head);
+}
+#endif
+
+#if (WATCHDOG == 1)
+static inline void safe_state(void) __attribute__((always_inline));
+static inline void safe_state(void) {  // 12V off, DATA and control lines tri-stated, target unpowered, without the Arduino core
+  // Nothing may keep driving the unpowered target, it would be back-powered through its I/O pins
+  #if (MEGA == 1)
+    PORTF |= _BV(PF0);  // RST (A0) high: 12V step-up converter off
+    DDRF |= _BV(PF0);
+    DDRE &= ~(_BV(PE0) | _BV(PE1) | _BV(PE3) | _BV(PE4) | _BV(PE5));  // DATA
+    PORTE &= ~(_BV(PE0) | _BV(PE1) | _BV(PE3) | _BV(PE4) | _BV(PE5));
+    DDRG &= ~_BV(PG5);
+    PORTG &= ~_BV(PG5);
+    DDRH &= ~(_BV(PH3) | _BV(PH4) | _BV(PH5) | _BV(PH6));  // DATA, XA0, PAGEL/BS2
+    PORTH &= ~(_BV(PH3) | _BV(PH4) | _BV(PH5) | _BV(PH6));
+    DDRB &= ~(_BV(PB4) | _BV(PB5) | _BV(PB7));  // WR, OE, RDY
+    PORTB &= ~(_BV(PB4) | _BV(PB5) | _BV(PB7));
+    DDRF &= ~(_BV(PF2) | _BV(PF3) | _BV(PF4) | _BV(PF5));  // BS1, XTAL1, XA1, PAGEL
+    PORTF &= ~(_BV(PF2) | _BV(PF3) | _BV(PF4) | _BV(PF5));
+    PORTB &= ~_BV(PB6); // VCC (D12) low
+    DDRB |= _BV(PB6);
+  #elif (LEONARDO == 1)
+    PORTF |= _BV(PF7);
+    DDRF |= _BV(PF7);
+    DDRD &= ~(_BV(PD0) | _BV(PD1) | _BV(PD2) | _BV(PD3) | _BV(PD4) | _BV(PD7));  // DATA
+    PORTD &= ~(_BV(PD0) | _BV(PD1) | _BV(PD2) | _BV(PD3) | _BV(PD4) | _BV(PD7));
+    DDRC &= ~(_BV(PC6) | _BV(PC7));  // DATA, RDY
+    PORTC &= ~(_BV(PC6) | _BV(PC7));
+    DDRE &= ~_BV(PE6);
+    PORTE &= ~_BV(PE6);
+    DDRB &= ~(_BV(PB4) | _BV(PB5) | _BV(PB6) | _BV(PB7));  // XA0, PAGEL/BS2, WR, OE
+    PORTB &= ~(_BV(PB4) | _BV(PB5) | _BV(PB6) | _BV(PB7));
+    DDRF &= ~(_BV(PF0) | _BV(PF1) | _BV(PF4) | _BV(PF5));  // PAGEL, XA1, XTAL1, BS1
+    PORTF &= ~(_BV(PF0) | _BV(PF1) | _BV(PF4) | _BV(PF5));
+    PORTD &= ~_BV(PD6);
+    DDRD |= _BV(PD6);
+  #else
+    PORTC |= _BV(PC0);
+    DDRC |= _BV(PC0);
+    DDRD = 0x00;  // DATA, the UART keeps TXD if it is enabled
+    PORTD = 0x00;
+    DDRB &= ~(_BV(PB0) | _BV(PB1) | _BV(PB2) | _BV(PB3) | _BV(PB5));  // XA0, PAGEL/BS2, WR, OE, RDY
+    PORTB &= ~(_BV(PB0) | _BV(PB1) | _BV(PB2) | _BV(PB3) | _BV(PB5));
+    DDRC &= ~(_BV(PC2) | _BV(PC3) | _BV(PC4) | _BV(PC5));  // BS1, XTAL1, XA1, PAGEL
+    PORTC &= ~(_BV(PC2) | _BV(PC3) | _BV(PC4) | _BV(PC5));
+    PORTB &= ~_BV(PB4);
+    DDRB |= _BV(PB4);
+  #endif
+}
+
+void wdt_safe_state(void) __attribute__((naked, used, section(".init3")));
+void wdt_safe_state(void) {  // Runs right after any reset, before the C runtime and setup(): 12V off, target unpowered
+  // DATA and the other control lines are inputs after a reset already, safe_state makes sure.  The Uno bootloader may have cleared
+  // MCUSR, so the phase marker, not WDRF, tells whether a session was cut short.
+  reset_cause = MCUSR;
+  MCUSR = 0;
+  wdt_disable();  // the watchdog keeps running after a watchdog reset
+  safe_state();
+}
+
+ISR(WDT_vect) {  // First watchdog timeout: the sketch hangs, the reset follows at the next timeout
+  safe_state();
+  ee_sync();  // nothing cached may be lost with the reset
+}
+
+void wdt_phase(byte phase) {  // Record what is running, for the report after a reset
+  wdt_mark.phase = phase;
+  wdt_mark.check = ~phase;
+}
+
+void wdt_arm(void) {  // Programming mode starts: the watchdog resets to the safe state if the sketch hangs
+  wdt_phase(PHASE_SESSION);
+  wdt_enable(WDT_TIMEOUT);
+  WDTCSR |= _BV(WDIE);  // interrupt first (safe state, EEPROM cache written), then reset
+}
+
+void wdt_disarm(void) {  // Programming mode is over
+  wdt_disable();
+  wdt_phase(PHASE_IDLE);
+}
+
+void wdt_report(void) {  // At startup: record and report a reset that cut a session short, the serial port must be open
+  wdt_record record;
+
+  if (wdt_mark.check == (byte) ~wdt_mark.phase && wdt_mark.phase != PHASE_IDLE) {
+    ee_read_block(&record, EE_WDT, sizeof(record));
+    record.count = (record.count == 0xFFFF) ? 1 : record.count + 1;  // blank EEPROM
+    record.cause = reset_cause;
+    record.phase = wdt_mark.phase;
+    ee_update_block(&record, EE_WDT, sizeof(record));
+    #if (JOURNAL == 1)
+      journal_add(J_WDT, reset_cause, wdt_mark.phase);
+    #endif
+
+    Serial.print((reset_cause & _BV(WDRF)) ? "Watchdog reset" : "Reset");
+    Serial.print(wdt_mark.phase == PHASE_PROMPT ? " waiting for a fuse value" : " in programming mode");
+    Serial.print(", 12V was turned off. Resets in programming mode: ");
+    Serial.println(record.count);
+  }
+  wdt_phase(PHASE_IDLE);
+}
+#endif
+
+byte wait_ready(void) {  // wait for RDY (or SDO in HVSP mode) to go high, returns 0 on timeout
+  unsigned long start = millis();
+
+  #if (HVSP_ISR == 1)
+    if (mode == HVSP)
+      HVSP_sync();  // SDO can only be checked after the last queued frame
+  #endif
+
+  while(digitalRead(RDY) == LOW) {  // SDO is the same pin as RDY
+    if (millis() - start > READY_TIMEOUT) {
+      STATS_ADD(timeouts, 1);
+      #if (JOURNAL == 1)
+        journal_add(J_TIMEOUT, mode, hvpp_cmd);
+      #endif
+      return 0;
+    }
+  }
+  return 1;
+}
+
+#if (MEGA == 1)  // functions specifically for the Arduino Mega
+
+void mega_data_write(byte data) { // Write a byte to digital lines 0-7
+  // This is really ugly, thanks to the way that digital lines 0-7 are implemented on the Mega.
+  PORTE &= ~(_BV(PE0) | _BV(PE1) | _BV(PE4) | _BV(PE5) | _BV(PE3));  // clear bits associated with digital pins 0-1, 2-3, 5
+  PORTE |= (data & 0x03);  // set lower 2 bits corresponding to digital pins 0-1
+  PORTE |= (data & 0x0C) << 2;  // set PORTE bits 4-5, corresponding to digital pins 2-3
+  PORTE |= (data & 0x20) >> 2;  // set PORTE bit 5, corresponding to digital pin 5
+  DDRE |= (_BV(PE0) | _BV(PE1) | _BV(PE4) | _BV(PE5) | _BV(PE3));  // set bits we are actually using to outputs
+
+  PORTG &= ~(_BV(PG5));  // clear bits associated with digital pins 4-5
+  PORTG |= (data & 0x10) << 1;  // set PORTG bit 5, corresponding to digital pin 4
+  DDRG |= (_BV(PG5));  // set to output
+
+  PORTH &= ~(_BV(PH3) | _BV(PH4));  // clear bites associated with digital pins 6-7
+  PORTH |= (data & 0xC0) >> 3;  // set PORTH bits 3-4, corresponding with digital pins 6-7
+  DDRH |= (_BV(PH3) | _BV(PH4));  // set bits to outputs
+}
+
+byte mega_data_read(void) { // Read a byte from digital lines 0-7
+  byte data = 0x00;  // initialize to zero
+  data |= (PINE & 0x03);  // set lower 2 bits
+  data |= (PINE & 0x30) >> 2;  // set bits 3-4 from PINE bits 4-5
+  data |= (PINE & 0x08) << 2;  // set bit 5 from PINE bit 3
+  data |= (PING & 0x20) >> 1;  // set bit 4 from PING bit 5
+  data |= (PINH & 0x18) << 3;  // set bits 6-7 from PINH bits 3-4
+
+  return data;
+}
+
+void mega_data_input(void) { // Set digital lines 0-7 to inputs and turn off pullups
+  PORTE &= ~(_BV(PE0) | _BV(PE1) | _BV(PE4) | _BV(PE5) | _BV(PE3));  // Mega digital pins 0-3, 5
+  DDRE &= ~(_BV(PE0) | _BV(PE1) | _BV(PE4) | _BV(PE5) | _BV(PE3));  // Set to input
+  PORTG &= ~(_BV(PG5));  // Mega digital pin 4
+  DDRG &= ~(_BV(PG5));  // Set to input
+  PORTH &= ~(_BV(PH3) | _BV(PH4));  // Mega digital pins 6-7
+  DDRH &= ~(_BV(PH3) | _BV(PH4));  // Set to input
+}
+#endif
+
+#if (LEONARDO == 1)  // functions specifically for the Arduino Leonardo/Micro
+
+#define LEONARDO_PORTD  (_BV(PD0) | _BV(PD1) | _BV(PD2) | _BV(PD3) | _BV(PD4) | _BV(PD7))  // digital pins 0-4, 6
+
+void leonardo_data_write(byte data) { // Write a byte to digital lines 0-7
+  byte portd = 0x00;
+  byte sreg = SREG;
+
+  if (data & 0x01) portd |= _BV(PD2);  // digital pin 0
+  if (data & 0x02) portd |= _BV(PD3);  // digital pin 1
+  if (data & 0x04) portd |= _BV(PD1);  // digital pin 2
+  if (data & 0x08) portd |= _BV(PD0);  // digital pin 3
+  if (data & 0x10) portd |= _BV(PD4);  // digital pin 4
+  if (data & 0x40) portd |= _BV(PD7);  // digital pin 6
+
+  cli();  // the USB interrupt blinks the TX LED on PD5, and PD6 is VCC
+  PORTD = (PORTD & ~LEONARDO_PORTD) | portd;
+  DDRD |= LEONARDO_PORTD;
+  if (data & 0x20)  // digital pin 5
+    PORTC |= _BV(PC6);
+  else
+    PORTC &= ~_BV(PC6);
+  DDRC |= _BV(PC6);
+  if (data & 0x80)  // digital pin 7
+    PORTE |= _BV(PE6);
+  else
+    PORTE &= ~_BV(PE6);
+  DDRE |= _BV(PE6);
+  SREG = sreg;
+}
+
+byte leonardo_data_read(void) { // Read a byte from digital lines 0-7
+  byte pind = PIND;
+  byte data = 0x00;
+
+  if (pind & _BV(PD2)) data |= 0x01;
+  if (pind & _BV(PD3)) data |= 0x02;
+  if (pind & _BV(PD1)) data |= 0x04;
+  if (pind & _BV(PD0)) data |= 0x08;
+  if (pind & _BV(PD4)) data |= 0x10;
+  if (PINC & _BV(PC6)) data |= 0x20;
+  if (pind & _BV(PD7)) data |= 0x40;
+  if (PINE & _BV(PE6)) data |= 0x80;
+
+  return data;
+}
+
+void leonardo_data_input(void) { // Set digital lines 0-7 to inputs and turn off pullups
+  byte sreg = SREG;
+
+  cli();
+  PORTD &= ~LEONARDO_PORTD;
+  DDRD &= ~LEONARDO_PORTD;
+  PORTC &= ~_BV(PC6);
+  DDRC &= ~_BV(PC6);
+  PORTE &= ~_BV(PE6);
+  DDRE &= ~_BV(PE6);
+  SREG = sreg;
+}
+#endif
+
+void data_write(byte data) {  // Drive a byte on DATA (digital lines 0-7)
+  #if (MEGA == 1)
+    mega_data_write(data);
+  #elif (LEONARDO == 1)
+    leonardo_data_write(data);
+  #else
+    PORTD = data;
+    DDRD = 0xFF;  // Set all DATA lines to outputs
+  #endif
+}
+
+byte data_read(void) {  // Read a byte from DATA
+  #if (MEGA == 1)
+    byte data = mega_data_read();
+  #elif (LEONARDO == 1)
+    byte data = leonardo_data_read();
+  #else
+    byte data = PIND;
+  #endif
+
+  SIM_ARG(data, 0);
+  SIM_MARK(MARK_DATA_READ);
+  return data;
+}
+
+void data_input(void) {  // Reset DATA to input to avoid bus contentions
+  #if (MEGA == 1)
+    mega_data_input();
+  #elif (LEONARDO == 1)
+    leonardo_data_input();
+  #else
+    PORTD = 0x00;
+    DDRD = 0x00;
+  #endif
+}
+
+void hvpp_forget(void) {  // The target may not hold the loaded command and address any more
+  hvpp_cmd = -1;
+  hvpp_addr[0] = hvpp_addr[1] = -1;
+}
+
 void send_cmd(byte command)  // Send command to target AVR
 {
+  // The target keeps the last command, it needs only be loaded once for any number of reads or writes
+  if (command == hvpp_cmd) {
+    if (mode != TINY2313)
+      digitalWrite(BS2, LOW);  // left as after a command load
+    return;
+  }
+  hvpp_cmd = command;
+  hvpp_addr[0] = hvpp_addr[1] = -1;  // the datasheets don't say the address survives a new command
+
+  SIM_ARG(command, 0);
+  SIM_MARK(MARK_SEND_CMD);
+
   // Set controls for command mode
   digitalWrite(XA1, HIGH);
   digitalWrite(XA0, LOW);
@@ -244,25 +1213,21 @@ void send_cmd(byte command)  // Send command to target AVR
     digitalWrite(BS2, LOW);  // Command load seems not to work if BS2 is high
 
 
-  #if (MEGA == 0)
-    PORTD = command;
-    DDRD = 0xFF;  // Set all DATA lines to outputs
-  #else
-    mega_data_write(command);
-  #endif
-
+  data_write(command);
   strobe_xtal();  // latch DATA
+  data_input();
 
-  #if (MEGA == 0)
-    PORTD = 0x00;
-    DDRD = 0x00;  // reset DATA to input to avoid bus contentions
-  #else
-    mega_data_input();
-  #endif
+  SIM_DONE(MARK_SEND_CMD);
 }
 
 void fuse_burn(byte fuse, int select)  // write high or low fuse to AVR
 {
+  #if (STATS == 1)
+    unsigned long start = micros();  // burn time: whole sequence to RDY, as in HVSP_fuse_burn
+  #endif
+
+  SIM_ARG(fuse, select);
+  SIM_MARK(MARK_FUSE_BURN);
 
   send_cmd(B01000000);  // Send command to enable fuse programming mode
 
@@ -273,25 +1238,12 @@ void fuse_burn(byte fuse, int select)  // write high or low fuse to AVR
   digitalWrite(BS1, LOW);
   if (mode != TINY2313)
     digitalWrite(BS2, LOW);
-  delay(1);
+  delayMicroseconds(timing.strobe);  // control line setup, was a fixed 1 ms
 
   // Load fuse value into target
-  #if (MEGA == 0)
-    PORTD = fuse;
-
-    DDRD = 0xFF;  // Set all DATA lines to outputs
-  #else
-    mega_data_write(fuse);
-  #endif
-
+  data_write(fuse);
   strobe_xtal();  // latch DATA
-
-  #if (MEGA == 0)
-    PORTD = 0x00;
-    DDRD = 0x00;  // reset DATA to input to avoid bus contentions
-  #else
-    mega_data_input();
-  #endif
+  data_input();
 
   // Decide which fuse location to burn
   switch (select) {
@@ -308,32 +1260,35 @@ void fuse_burn(byte fuse, int select)  // write high or low fuse to AVR
     digitalWrite(BS2, HIGH);
     break;
   }
-  delay(1);
+  delayMicroseconds(timing.wr);  // BS1/BS2 setup before !WR, was a fixed 1 ms
    // Burn the fuse
   digitalWrite(WR, LOW);
-  delay(1);
+  delayMicroseconds(timing.wr);
   digitalWrite(WR, HIGH);
   //delay(100);
 
-  while(digitalRead(RDY) == LOW);  // when RDY goes high, burn is done
+  wait_ready();  // when RDY goes high, burn is done
+  #if (STATS == 1)
+    stats_burn(micros() - start);
+  #endif
 
   // Reset control lines to original state
   digitalWrite(BS1, LOW);
   digitalWrite(BS2, LOW);
+
+  SIM_DONE(MARK_FUSE_BURN);
 }
 
 byte fuse_read(int select) {
   byte fuse;
 
+  SIM_ARG(select, 0);
+  SIM_MARK(MARK_FUSE_READ);
+
   send_cmd(B00000100);  // Send command to read fuse bits
 
   // Configure DATA as input so we can read back fuse values from target
-  #if (MEGA == 0)
-    PORTD = 0x00;
-    DDRD = 0x00;  // reset DATA to input to avoid bus contentions
-  #else
-    mega_data_input();
-  #endif
+  data_input();
 
   // Set control lines
   switch (select) {
@@ -356,15 +1311,14 @@ byte fuse_read(int select) {
 
   //  Read fuse
   digitalWrite(OE, LOW);
-  delay(1);
+  delayMicroseconds(timing.oe);
 
-  #if (MEGA == 0)
-    fuse = PIND;
-  #else
-    fuse = mega_data_read();
-  #endif
+  fuse = data_read();
 
   digitalWrite(OE, HIGH);  // Done reading, disable output enable line
+
+  SIM_ARG(fuse, select);
+  SIM_DONE(MARK_FUSE_READ);
   return fuse;
 }
 
@@ -373,16 +1327,27 @@ byte fuse_ask(void) {  // get desired fuse value from the user (via the serial p
   byte fuse;
   char serbuffer[2];
 
+  #if (WATCHDOG == 1)
+    unsigned long start = millis();  // the watchdog resets to the safe state after PROMPT_TIMEOUT
+
+    wdt_phase(PHASE_PROMPT);
+  #endif
   while (incomingByte != 'x') {  // crude way to wait for a hex string to come in
-    while (Serial.available() == 0);   // wait for a character to come in
+    while (Serial.available() == 0)    // wait for a character to come in
+      WDT_PROMPT(start);
     incomingByte = Serial.read();
   }
 
   // Hopefully the next two characters form a hex byte.  If not, we're hosed.
-  while (Serial.available() == 0);   // wait for character
+  while (Serial.available() == 0)    // wait for character
+    WDT_PROMPT(start);
   serbuffer[0] = Serial.read();      // get high byte of fuse value
-  while (Serial.available() == 0);   // wait for character
+  while (Serial.available() == 0)    // wait for character
+    WDT_PROMPT(start);
   serbuffer[1] = Serial.read();      // get low byte
+  #if (WATCHDOG == 1)
+    wdt_phase(PHASE_SESSION);
+  #endif
 
   fuse = hex2dec(serbuffer[1]) + hex2dec(serbuffer[0]) * 16;
 
@@ -392,10 +1357,94 @@ byte fuse_ask(void) {  // get desired fuse value from the user (via the serial p
 
 }
 
-byte HVSP_read(byte data, byte instr) { // Read a byte using the HVSP protocol
+#if (HVSP_FAST == 1)
+// One bit of an HVSP frame: n is the data/instruction bit clocked out, and the response bit sampled from the
+// previous clock.  SII (PB0) is set by one out to PORTB, SDI (PC4) is set and SCI (PC2) dropped by one out to
+// PORTC, SDO (PB5) is sampled with one in, then SCI rises.  11 cycles, no branches:
+//   bst, bld, bst, bld   1+1+1+1  data and instruction bits into the PORTC/PORTB images
+//   out PORTB, out PORTC 1+1      SII; SDI and the SCI falling edge together
+//   in, bst, bld         1+1+1    SDO into the response
+//   sbi PORTC            2        SCI rising edge, the target latches SDI/SII
+// At 16 MHz SCI is low for 5 cycles (312 ns) and high for 6 (375 ns), SDI/SII are set 5 cycles (312 ns) before
+// the rising edge and SII changes 4 cycles (250 ns) after it: the datasheet minimums are 110 ns and 50 ns.
+#define HVSP_FAST_BIT(n) \
+  "bst  %[data], " #n "\n\t" \
+  "bld  %[pc], 4\n\t" \
+  "bst  %[instr], " #n "\n\t" \
+  "bld  %[pb], 0\n\t" \
+  "out  %[portb], %[pb]\n\t" \
+  "out  %[portc], %[pc]\n\t" \
+  "in   __tmp_reg__, %[pinb]\n\t" \
+  "bst  __tmp_reg__, 5\n\t" \
+  "bld  %[response], " #n "\n\t" \
+  "sbi  %[portc], 2\n\t"
+
+byte HVSP_frame(byte data, byte instr) {  // Clock one 11 bit frame out, returns the target response
+  // Start bit 4 cycles, 8 data bits of 11 cycles, 2 stop bits 20 cycles: 112 cycles, 7 us at 16 MHz
+  byte pb, pc;  // PORTB/PORTC images, written back whole by the kernel
+  byte response;
+  byte sreg = SREG;
+
+  cli();  // the PORTB/PORTC images must stay valid, and no interrupt may stretch a clock
+  pb = PORTB & ~_BV(PB0);               // SII low
+  pc = PORTC & ~(_BV(PC4) | _BV(PC2));  // SDI and SCI low
+  asm volatile (
+    "out  %[portb], %[pb]\n\t"  // start bit: SDI = SII = 0
+    "out  %[portc], %[pc]\n\t"
+    "sbi  %[portc], 2\n\t"
+    HVSP_FAST_BIT(7)
+    HVSP_FAST_BIT(6)
+    HVSP_FAST_BIT(5)
+    HVSP_FAST_BIT(4)
+    HVSP_FAST_BIT(3)
+    HVSP_FAST_BIT(2)
+    HVSP_FAST_BIT(1)
+    HVSP_FAST_BIT(0)
+    "cbr  %[pb], 0x01\n\t"  // 1st stop bit: SDI = SII = 0
+    "cbr  %[pc], 0x10\n\t"
+    "out  %[portb], %[pb]\n\t"
+    "out  %[portc], %[pc]\n\t"
+    "nop\n\t"
+    "nop\n\t"
+    "sbi  %[portc], 2\n\t"
+    "nop\n\t"
+    "nop\n\t"
+    "cbi  %[portc], 2\n\t"  // 2nd stop bit
+    "nop\n\t"
+    "nop\n\t"
+    "sbi  %[portc], 2\n\t"
+    "nop\n\t"
+    "nop\n\t"
+    "cbi  %[portc], 2\n\t"  // SCI back low
+    : [response] "=&r" (response), [pb] "+d" (pb), [pc] "+d" (pc)
+    : [data] "r" (data), [instr] "r" (instr),
+      [portb] "I" (_SFR_IO_ADDR(PORTB)), [portc] "I" (_SFR_IO_ADDR(PORTC)), [pinb] "I" (_SFR_IO_ADDR(PINB))
+  );
+  SREG = sreg;
 
+  return response;
+}
+#endif
+
+byte HVSP_read(byte data, byte instr) { // Read a byte using the HVSP protocol
+  WDT_FEED();
+#if (HVSP_ISR == 1)
+  return HVSP_result(HVSP_queue(data, instr));
+#elif (HVSP_FAST == 1)
+  byte response;
+
+  SIM_ARG(data, instr);
+  SIM_MARK(MARK_HVSP_READ);
+  response = HVSP_frame(data, instr);
+  SIM_ARG(response, instr);
+  SIM_DONE(MARK_HVSP_READ);
+  return response;
+#else
   byte response = 0x00; // a place to hold the response from target
 
+  SIM_ARG(data, instr);
+  SIM_MARK(MARK_HVSP_READ);
+
   digitalWrite(SCI, LOW);  // set clock low
   // 1st bit is always zero
   digitalWrite(SDI, LOW);
@@ -441,95 +1490,1619 @@ byte HVSP_read(byte data, byte instr) { // Read a byte using the HVSP protocol
     sclk();
   }
 
+  SIM_ARG(response, instr);
+  SIM_DONE(MARK_HVSP_READ);
   return response;
+#endif
+}
+
+void HVSP_write(byte data, byte instr) { // Write to target using the HVSP protocol
+  WDT_FEED();
+#if (HVSP_ISR == 1)
+  HVSP_queue(data, instr);  // returns as soon as the frame is queued
+#elif (HVSP_FAST == 1)
+  SIM_ARG(data, instr);
+  SIM_MARK(MARK_HVSP_WRITE);
+  HVSP_frame(data, instr);
+  SIM_DONE(MARK_HVSP_WRITE);
+#else
+  SIM_ARG(data, instr);
+  SIM_MARK(MARK_HVSP_WRITE);
+
+  digitalWrite(SCI, LOW);  // set clock low
+
+  // 1st bit is always zero
+  digitalWrite(SDI, LOW);
+  digitalWrite(SII, LOW);
+  sclk();  // latch bit
+
+  // Send each bit of data and instruction byte serially, MSB first
+  // I do this by shifting the byte left 1 bit at a time and checking the value of the new MSB
+  for (int i=0; i<8; i++) {  // i is bit number
+    if ((data << i) & 0x80)  // shift data byte left and check if new MSB is 1 or 0
+      digitalWrite(SDI, HIGH);  // bit was 1, set pin high
+    else
+      digitalWrite(SDI, LOW);   // bit was 0, set pin low
+
+    if ((instr << i) & 0x80)  // same process for instruction byte
+      digitalWrite(SII, HIGH);
+    else
+      digitalWrite(SII, LOW);
+
+   sclk();  // strobe SCI (serial clock) to latch data
+  }
+
+  // Last 2 bits are always zero
+  for (int i=0; i<2; i++) {
+    digitalWrite(SDI, LOW);
+    digitalWrite(SII, LOW);
+    sclk();
+  }
+
+  SIM_DONE(MARK_HVSP_WRITE);
+#endif
+}
+
+byte HVSP_fuse_read(int select) {  // Read a fuse using the HVSP protocol
+  switch (select) {
+  case LFUSE_SEL:
+    HVSP_read(HVSP_READ_LFUSE_DATA, HVSP_READ_LFUSE_INSTR1);
+    HVSP_read(0x00, HVSP_READ_LFUSE_INSTR2);
+    return HVSP_read(0x00, HVSP_READ_LFUSE_INSTR3);
+  case HFUSE_SEL:
+    HVSP_read(HVSP_READ_HFUSE_DATA, HVSP_READ_HFUSE_INSTR1);
+    HVSP_read(0x00, HVSP_READ_HFUSE_INSTR2);
+    return HVSP_read(0x00, HVSP_READ_HFUSE_INSTR3);
+  case EFUSE_SEL:
+    HVSP_read(HVSP_READ_EFUSE_DATA, HVSP_READ_EFUSE_INSTR1);
+    HVSP_read(0x00, HVSP_READ_EFUSE_INSTR2);
+    return HVSP_read(0x00, HVSP_READ_EFUSE_INSTR3);
+  }
+  return 0xFF;
+}
+
+void HVSP_fuse_burn(byte fuse, int select) {  // Burn a fuse using the HVSP protocol
+  #if (STATS == 1)
+    unsigned long start = micros();  // burn time: whole sequence to SDO, as in fuse_burn
+  #endif
+
+  switch (select) {
+  case LFUSE_SEL:
+    HVSP_write(HVSP_WRITE_LFUSE_DATA, HVSP_WRITE_LFUSE_INSTR1);
+    HVSP_write(fuse, HVSP_WRITE_LFUSE_INSTR2);
+    HVSP_write(0x00, HVSP_WRITE_LFUSE_INSTR3);
+    HVSP_write(0x00, HVSP_WRITE_LFUSE_INSTR4);
+    break;
+  case HFUSE_SEL:
+    HVSP_write(HVSP_WRITE_HFUSE_DATA, HVSP_WRITE_HFUSE_INSTR1);
+    HVSP_write(fuse, HVSP_WRITE_HFUSE_INSTR2);
+    HVSP_write(0x00, HVSP_WRITE_HFUSE_INSTR3);
+    HVSP_write(0x00, HVSP_WRITE_HFUSE_INSTR4);
+    break;
+  case EFUSE_SEL:
+    HVSP_write(HVSP_WRITE_EFUSE_DATA, HVSP_WRITE_EFUSE_INSTR1);
+    HVSP_write(fuse, HVSP_WRITE_EFUSE_INSTR2);
+    HVSP_write(0x00, HVSP_WRITE_EFUSE_INSTR3);
+    HVSP_write(0x00, HVSP_WRITE_EFUSE_INSTR4);
+    break;
+  }
+
+  wait_ready();  // wait until SDO goes high, burn is done
+  #if (STATS == 1)
+    stats_burn(micros() - start);
+  #endif
+}
+
+void load_addr(byte addr, byte high) {  // Load address low (high = 0) or high (high = 1) byte into target
+  if (addr == hvpp_addr[high])  // the target still holds it
+    return;
+  hvpp_addr[high] = addr;
+
+  SIM_ARG(addr, high);
+  SIM_MARK(MARK_LOAD_ADDR);
+  digitalWrite(XA1, LOW);
+  digitalWrite(XA0, LOW);
+  digitalWrite(BS1, high ? HIGH : LOW);
+
+  data_write(addr);
+  strobe_xtal();  // latch address
+  data_input();
+  SIM_DONE(MARK_LOAD_ADDR);
+}
+
+void load_data(byte data, byte high) {  // Load data low (high = 0) or high (high = 1) byte into target
+  SIM_ARG(data, high);
+  SIM_MARK(MARK_LOAD_DATA);
+  digitalWrite(XA1, LOW);
+  digitalWrite(XA0, HIGH);
+  digitalWrite(BS1, high ? HIGH : LOW);
+
+  data_write(data);
+  strobe_xtal();  // latch data
+  data_input();
+  SIM_DONE(MARK_LOAD_DATA);
+}
+
+void target_eeprom_write(word addr, byte data) {  // Write one byte to the target EEPROM
+  if (mode == HVSP) {
+    HVSP_write(HVSP_WRITE_EEPROM_DATA, HVSP_WRITE_EEPROM_INSTR1);
+    HVSP_write(addr & 0xFF, HVSP_LOAD_ADDR_LOW_INSTR);
+    HVSP_write(addr >> 8, HVSP_LOAD_ADDR_HIGH_INSTR);
+    HVSP_write(data, HVSP_LOAD_DATA_LOW_INSTR);
+    HVSP_write(0x00, HVSP_WRITE_EEPROM_INSTR2);
+    HVSP_write(0x00, HVSP_WRITE_EEPROM_INSTR3);
+    HVSP_write(0x00, HVSP_WRITE_EEPROM_INSTR4);
+    wait_ready();  // wait until SDO goes high, write is done
+  } else {
+    send_cmd(B00010001);  // Send command to enable EEPROM programming mode
+    load_addr(addr >> 8, 1);
+    load_addr(addr & 0xFF, 0);
+    load_data(data, 0);
+
+    // Latch data into the page buffer
+    digitalWrite(BS1, LOW);
+    digitalWrite(PAGEL, HIGH);
+    delayMicroseconds(timing.strobe);
+    digitalWrite(PAGEL, LOW);
+
+    // Program the EEPROM page
+    digitalWrite(BS1, LOW);
+    digitalWrite(WR, LOW);
+    delayMicroseconds(timing.wr);
+    digitalWrite(WR, HIGH);
+
+    wait_ready();  // when RDY goes high, write is done
+  }
+}
+
+byte target_eeprom_read(word addr) {  // Read one byte from the target EEPROM
+  byte data;
+
+  if (mode == HVSP) {
+    HVSP_read(HVSP_READ_EEPROM_DATA, HVSP_READ_EEPROM_INSTR1);
+    HVSP_read(addr & 0xFF, HVSP_LOAD_ADDR_LOW_INSTR);
+    HVSP_read(addr >> 8, HVSP_LOAD_ADDR_HIGH_INSTR);
+    HVSP_read(0x00, HVSP_READ_EEPROM_INSTR2);
+    return HVSP_read(0x00, HVSP_READ_EEPROM_INSTR3);
+  }
+
+  send_cmd(B00000011);  // Send command to read EEPROM
+  load_addr(addr >> 8, 1);
+  load_addr(addr & 0xFF, 0);
+
+  digitalWrite(BS1, LOW);
+  digitalWrite(OE, LOW);
+  delayMicroseconds(timing.oe);
+  data = data_read();
+  digitalWrite(OE, HIGH);
+
+  return data;
+}
+
+byte target_signature(byte addr) {  // Read one signature byte (0-2) from the target
+  byte sig;
+
+  if (mode == HVSP) {
+    HVSP_read(HVSP_READ_SIG_DATA, HVSP_READ_SIG_INSTR1);
+    HVSP_read(addr, HVSP_LOAD_ADDR_LOW_INSTR);
+    HVSP_read(0x00, HVSP_READ_SIG_INSTR3);
+    return HVSP_read(0x00, HVSP_READ_SIG_INSTR4);
+  }
+
+  send_cmd(B00001000);  // Send command to read signature bytes
+  load_addr(addr, 0);
+
+  digitalWrite(BS1, LOW);
+  digitalWrite(OE, LOW);
+  delayMicroseconds(timing.oe);
+  sig = data_read();
+  digitalWrite(OE, HIGH);
+
+  return sig;
+}
+
+byte target_fuse_read(byte select) {  // Read a fuse (LFUSE_SEL, HFUSE_SEL, EFUSE_SEL)
+  if (mode == HVSP)
+    return HVSP_fuse_read(select);
+  return fuse_read(select);
+}
+
+void target_fuse_write(byte fuse, byte select) {  // Burn a fuse
+  if (mode == HVSP)
+    HVSP_fuse_burn(fuse, select);
+  else
+    fuse_burn(fuse, select);
+}
+
+byte target_fuse_update(byte fuse, byte select) {  // Burn a fuse only if it differs, returns the fuse read back
+  byte current = target_fuse_read(select);
+
+  if (current == fuse)
+    return current;
+  target_fuse_write(fuse, select);
+  fuse = target_fuse_read(select);
+  #if (JOURNAL == 1)
+    journal_add(J_FUSE_L + select, current, fuse);
+  #endif
+  return fuse;
+}
+
+byte target_lock_read(void) {  // Read the lock bits
+  byte lock;
+
+  if (mode == HVSP) {
+    HVSP_read(HVSP_READ_LOCK_DATA, HVSP_READ_LOCK_INSTR1);
+    HVSP_read(0x00, HVSP_READ_LOCK_INSTR2);
+    return HVSP_read(0x00, HVSP_READ_LOCK_INSTR3);
+  }
+
+  send_cmd(B00000100);  // Send command to read fuse and lock bits
+  digitalWrite(BS2, LOW);
+  digitalWrite(BS1, HIGH);
+  digitalWrite(OE, LOW);
+  delayMicroseconds(timing.oe);
+  lock = data_read();
+  digitalWrite(OE, HIGH);
+  digitalWrite(BS1, LOW);
+
+  return lock;
+}
+
+void target_lock_write(byte lock) {  // Write the lock bits, only a chip erase clears them again
+  if (mode == HVSP) {
+    HVSP_write(HVSP_WRITE_LOCK_DATA, HVSP_WRITE_LOCK_INSTR1);
+    HVSP_write(lock, HVSP_LOAD_DATA_LOW_INSTR);
+    HVSP_write(0x00, HVSP_WRITE_LOCK_INSTR3);
+    HVSP_write(0x00, HVSP_WRITE_LOCK_INSTR4);
+  } else {
+    send_cmd(B00100000);  // Send command to write lock bits
+    load_data(lock, 0);
+
+    digitalWrite(BS1, LOW);
+    digitalWrite(BS2, LOW);
+    digitalWrite(WR, LOW);
+    delayMicroseconds(timing.wr);
+    digitalWrite(WR, HIGH);
+  }
+  wait_ready();  // when RDY (SDO) goes high, write is done
+}
+
+void target_erase(void) {  // Chip erase: flash, EEPROM (unless EESAVE is programmed) and lock bits
+  if (mode == HVSP) {
+    HVSP_write(HVSP_ERASE_DATA, HVSP_ERASE_INSTR1);
+    HVSP_write(0x00, HVSP_ERASE_INSTR2);
+    HVSP_write(0x00, HVSP_ERASE_INSTR3);
+  } else {
+    send_cmd(B10000000);  // Send command to erase the chip
+    digitalWrite(WR, LOW);
+    delayMicroseconds(timing.wr);
+    digitalWrite(WR, HIGH);
+  }
+  wait_ready();  // when RDY (SDO) goes high, erase is done
+  hvpp_forget();
+}
+
+byte target_erase_keep(void) {  // Chip erase keeping the EEPROM, returns 0 if EESAVE couldn't be programmed
+  // EESAVE is HFUSE bit 6 on the ATtiny2313 and bit 3 on the ATmega and HVSP parts, but LFUSE bit 6 on the
+  // ATtiny13 (1E 90 07), where HFUSE bit 3 is DWEN.  Fuses are not affected by the erase.
+  byte select = HFUSE_SEL;
+  byte eesave = (mode == TINY2313) ? 0x40 : 0x08;
+  byte fuse;
+
+  if (mode == HVSP && target_signature(1) == 0x90 && target_signature(2) == 0x07) {
+    select = LFUSE_SEL;
+    eesave = 0x40;
+  }
+  fuse = target_fuse_read(select);
+  if ((fuse & eesave) && target_fuse_update(fuse & ~eesave, select) & eesave)
+    return 0;  // EESAVE not programmed (lock bits set?), don't lose the EEPROM
+  target_erase();
+  target_fuse_update(fuse, select);  // back to the original value
+  return 1;
+}
+
+word target_flash_read(word addr) {  // Read one word from the target flash, addr is a word address
+  byte low;
+  word data;
+
+  if (mode == HVSP) {
+    HVSP_read(HVSP_READ_FLASH_DATA, HVSP_READ_FLASH_INSTR1);
+    HVSP_read(addr & 0xFF, HVSP_LOAD_ADDR_LOW_INSTR);
+    HVSP_read(addr >> 8, HVSP_LOAD_ADDR_HIGH_INSTR);
+    HVSP_read(0x00, HVSP_READ_FLASH_INSTR2);
+    low = HVSP_read(0x00, HVSP_READ_FLASH_INSTR3);
+    HVSP_read(0x00, HVSP_READ_FLASH_INSTR4);
+    return (HVSP_read(0x00, HVSP_READ_FLASH_INSTR5) << 8) | low;
+  }
+
+  send_cmd(B00000010);  // Send command to read flash
+  load_addr(addr >> 8, 1);
+  load_addr(addr & 0xFF, 0);
+
+  digitalWrite(BS1, LOW);  // low byte
+  digitalWrite(OE, LOW);
+  delayMicroseconds(timing.oe);
+  low = data_read();
+  digitalWrite(BS1, HIGH);  // high byte
+  delayMicroseconds(timing.oe);
+  data = (data_read() << 8) | low;
+  digitalWrite(OE, HIGH);
+  digitalWrite(BS1, LOW);
+
+  return data;
+}
+
+word target_scan(byte eeprom, word addr, byte first) {  // Read the next flash word (EEPROM byte) of a scan
+  // Unlike target_flash_read the read command and the address high byte are only loaded for the first location
+  // (first = 1) and when the high byte changes, so each location costs an address low load and the read itself.
+  word data;
+
+  if (mode == HVSP) {
+    if (first || (addr & 0xFF) == 0) {
+      HVSP_read(eeprom ? HVSP_READ_EEPROM_DATA : HVSP_READ_FLASH_DATA, HVSP_READ_FLASH_INSTR1);
+      HVSP_read(addr >> 8, HVSP_LOAD_ADDR_HIGH_INSTR);
+    }
+    HVSP_read(addr & 0xFF, HVSP_LOAD_ADDR_LOW_INSTR);
+    HVSP_read(0x00, HVSP_READ_FLASH_INSTR2);  // same instructions read the EEPROM
+    data = HVSP_read(0x00, HVSP_READ_FLASH_INSTR3);
+    if (!eeprom) {
+      HVSP_read(0x00, HVSP_READ_FLASH_INSTR4);
+      data |= HVSP_read(0x00, HVSP_READ_FLASH_INSTR5) << 8;
+    }
+    return data;
+  }
+
+  if (first || (addr & 0xFF) == 0) {
+    send_cmd(eeprom ? B00000011 : B00000010);  // Send command to read EEPROM or flash
+    load_addr(addr >> 8, 1);
+  }
+  load_addr(addr & 0xFF, 0);
+
+  digitalWrite(BS1, LOW);  // low byte (EEPROM data)
+  digitalWrite(OE, LOW);
+  delayMicroseconds(timing.oe);
+  data = data_read();
+  if (!eeprom) {
+    digitalWrite(BS1, HIGH);  // high byte
+    delayMicroseconds(timing.oe);
+    data |= data_read() << 8;
+    digitalWrite(BS1, LOW);
+  }
+  digitalWrite(OE, HIGH);
+
+  return data;
+}
+
+word target_blank(byte eeprom, word addr, word count) {  // Blank check of count flash words (EEPROM bytes) from addr
+  // Returns the number of blank (0xFF) locations before the first programmed one, count if all are blank.
+  // Nothing is sent over serial.
+  word blank = eeprom ? 0xFF : 0xFFFF;
+  word i;
+
+  for (i = 0; i < count; i++, addr++)
+    if (target_scan(eeprom, addr, i == 0) != blank)
+      break;
+  return i;
+}
+
+word target_crc(byte eeprom, word addr, word count) {  // CRC-16 of count flash words (EEPROM bytes) from addr
+  // Same CRC as _crc16_update (polynomial 0xA001, start value 0xFFFF), flash words low byte first
+  word crc = 0xFFFF;
+  word data;
+
+  for (word i = 0; i < count; i++, addr++) {
+    data = target_scan(eeprom, addr, i == 0);
+    crc = _crc16_update(crc, data & 0xFF);
+    if (!eeprom)
+      crc = _crc16_update(crc, data >> 8);
+  }
+  return crc;
+}
+
+void target_flash_page(word addr, const byte *data, byte words) {  // Program one flash page from data (low byte first)
+  // addr is the word address of the page, words must not exceed the page size of the target
+  if (mode == HVSP) {
+    HVSP_write(HVSP_WRITE_FLASH_DATA, HVSP_WRITE_FLASH_INSTR1);
+    for (byte i = 0; i < words; i++) {
+      HVSP_write((addr + i) & 0xFF, HVSP_LOAD_ADDR_LOW_INSTR);
+      HVSP_write(data[2 * i], HVSP_LOAD_DATA_LOW_INSTR);
+      HVSP_write(data[2 * i + 1], HVSP_LOAD_DATA_HIGH_INSTR);
+      HVSP_write(0x00, HVSP_WRITE_FLASH_INSTR2);  // latch the word into the page buffer
+      HVSP_write(0x00, HVSP_WRITE_FLASH_INSTR3);
+    }
+    HVSP_write(addr >> 8, HVSP_LOAD_ADDR_HIGH_INSTR);
+    HVSP_write(0x00, HVSP_WRITE_FLASH_INSTR4);  // program the page
+    HVSP_write(0x00, HVSP_WRITE_FLASH_INSTR5);
+    wait_ready();  // wait until SDO goes high, page is done
+    HVSP_write(HVSP_NOP_DATA, HVSP_NOP_INSTR);  // end page programming
+    return;
+  }
+
+  send_cmd(B00010000);  // Send command to write flash
+  for (byte i = 0; i < words; i++) {
+    load_addr((addr + i) & 0xFF, 0);
+    load_data(data[2 * i], 0);
+    load_data(data[2 * i + 1], 1);
+
+    // Latch the word into the page buffer
+    digitalWrite(BS1, HIGH);
+    digitalWrite(PAGEL, HIGH);
+    delayMicroseconds(timing.strobe);
+    digitalWrite(PAGEL, LOW);
+  }
+  load_addr(addr >> 8, 1);
+
+  // Program the page
+  digitalWrite(BS1, LOW);
+  digitalWrite(WR, LOW);
+  delayMicroseconds(timing.wr);
+  digitalWrite(WR, HIGH);
+  wait_ready();  // when RDY goes high, page is done
+
+  send_cmd(B00000000);  // No operation, ends page programming
+}
+
+void hv_enter(const entry_profile *p) {  // Enter programming mode with the given timing
+  hvpp_forget();  // a fresh target holds no command or address
+  // Initialize pins to enter programming mode
+  data_input();  // set digital pins 0-7 as inputs for now
+  digitalWrite(PAGEL, LOW);
+  digitalWrite(XA1, LOW);
+  digitalWrite(XA0, LOW);
+  digitalWrite(BS1, LOW);
+  digitalWrite(BS2, LOW);
+  digitalWrite(WR, LOW);  // ATtiny2313 needs this to be low to enter programming mode, ATmega doesn't care
+  digitalWrite(OE, LOW);
+
+  if(mode == HVSP) {
+    digitalWrite(SDI, LOW);  // set necessary pin values to enter programming mode
+    digitalWrite(SII, LOW);
+    pinMode(SDO, OUTPUT);    // SDO is same as RDY pin
+    digitalWrite(SDO, LOW);  // needs to be low to enter programming mode
+  }
+
+  // Enter programming mode
+  SIM_MARK(MARK_HV_ENTER);
+  digitalWrite(VCC, HIGH);  // Apply VCC to start programming process
+  delayMicroseconds(p->vcc_to_hv);
+  digitalWrite(RST, LOW);   // Apply 12V to !RESET
+  STATS_ADD(hv_entries, 1);
+
+  if(mode == HVSP) {
+    // reset SDO after short delay, longer leads to logic contention because target sets SDO high after entering programming mode
+    delayMicroseconds(p->sdo_release);  // datasheet says 10us, 1us is needed to avoid drive contention on SDO
+    pinMode(SDO, INPUT);    // set to input to avoid logic contention
+  }
+
+  delayMicroseconds(p->settle);  // Give lots of time for part to enter programming mode
+  digitalWrite(OE, HIGH);
+  digitalWrite(WR, HIGH);   // Now that we're in programming mode we can disable !WR
+  delay(p->cmd_wait);
+  SIM_DONE(MARK_HV_ENTER);
+}
+
+void hv_exit(void) {  // Leave programming mode and power down the target
+  SIM_MARK(MARK_HV_EXIT);
+  #if (HVSP_ISR == 1)
+    HVSP_sync();
+  #endif
+  data_input();
+  digitalWrite(RST, HIGH);  // exit programming mode
+  delay(1);
+  digitalWrite(OE, LOW);
+  digitalWrite(WR, LOW);
+  digitalWrite(PAGEL, LOW);
+  digitalWrite(XA1, LOW);
+  digitalWrite(XA0, LOW);
+  digitalWrite(BS1, LOW);
+  digitalWrite(BS2, LOW);
+  digitalWrite(XTAL1, LOW);  // the next strobe_xtal needs its rising edge
+  digitalWrite(VCC, LOW);
+  hvpp_forget();
+  SIM_DONE(MARK_HV_EXIT);
+}
+
+byte entry_variant(void) {  // Entry variant that worked last in this mode, from the Arduino EEPROM the first time
+  if (entry_first[mode] == 0xFF) {
+    entry_first[mode] = ee_read_byte(EE_ENTRY + mode);
+    if (entry_first[mode] >= ENTRY_VARIANTS)  // blank EEPROM
+      entry_first[mode] = 0;
+  }
+  return entry_first[mode];
+}
+
+byte hv_start(void) {  // Enter programming mode, trying every entry variant; returns the one that worked or 0xFF
+  byte first = entry_variant();  // start from the variant that worked last
+  byte variant;
+
+  for (byte i = 0; i < ENTRY_VARIANTS; i++) {
+    variant = (first + i) % ENTRY_VARIANTS;
+    entry_tries = i + 1;
+    if (i > 0) {  // previous try failed: power down, let VCC drop and retry
+      hv_exit();
+      delay(ENTRY_OFF);
+      STATS_ADD(retries, 1);
+    }
+
+    hv_enter(&entry_profiles[mode][variant]);
+    if (target_signature(0) == 0x1E) {  // Atmel manufacturer code, the part is listening
+      if (variant != first) {
+        entry_first[mode] = variant;
+        ee_update_byte(EE_ENTRY + mode, variant);
+      }
+      return variant;
+    }
+  }
+  return 0xFF;
+}
+
+void bus_acquire(void) {  // Take DATA0/DATA1 back from the UART before driving the target
+  if (mode != HVSP && LEONARDO == 0)  // the Leonardo talks to the host over USB
+    Serial.end();  // waits for pending output
+}
+
+void bus_release(void) {  // Give DATA0/DATA1 back to the UART, the target must not drive DATA (OE high)
+  if (mode != HVSP && LEONARDO == 0)
+    Serial.begin(baud);
+}
+
+byte session_begin(void) {  // Power up the target in programming mode; returns the entry variant or 0xFF
+  byte entry;
+
+  if (session)
+    return 0;
+  #if (WATCHDOG == 1)
+    wdt_arm();
+  #endif
+  entry = hv_start();
+  #if (JOURNAL == 1)
+    journal_add(J_ENTER, mode, entry_tries << 4 | (entry & 0x0F));
+  #endif
+  if (entry == 0xFF) {
+    hv_exit();
+    #if (WATCHDOG == 1)
+      wdt_disarm();
+    #endif
+  } else {
+    session = 1;
+  }
+  return entry;
+}
+
+void session_end(void) {  // Leave programming mode, any number of target_* operations can run before this
+  if (session) {
+    hv_exit();
+    session = 0;
+    #if (WATCHDOG == 1)
+      wdt_disarm();
+    #endif
+  }
+}
+
+unsigned long target_op(byte op, word addr, word value, byte write) {  // Run one operation inside a session
+  // OP_SIG:    returns the 3 signature bytes, byte 0 in bits 16-23
+  // OP_ERASE:  chip erase
+  // OP_ERASE_KEEP: chip erase keeping the EEPROM, returns 0 if it couldn't be kept (nothing erased)
+  // OP_FUSE:   addr = LFUSE_SEL/HFUSE_SEL/EFUSE_SEL, burns value if write and different, returns the fuse
+  //            read back
+  // OP_LOCK:   writes value to the lock bits if write, returns the lock bits read back
+  // OP_EE:     writes value to EEPROM addr if write, returns the byte read back
+  // OP_FLASH:  reads value words from addr into page_buf, returns the number of words read
+  // OP_PAGE:   programs value words of page_buf into the page at addr
+  // OP_VERIFY: compares value words from addr with page_buf, returns the number of words matching
+  //            before the first difference (value if all of them match)
+  // OP_BLANK, OP_EE_BLANK: blank check of value flash words (EEPROM bytes) from addr, returns the number of
+  //            blank locations before the first programmed one (value if all of them are blank)
+  // OP_CRC, OP_EE_CRC: returns the CRC-16 of value flash words (EEPROM bytes) from addr, see target_crc
+  word i;
+
+  if (value > PAGE_BUF_LEN / 2 && (op == OP_FLASH || op == OP_PAGE || op == OP_VERIFY))
+    value = PAGE_BUF_LEN / 2;
+
+  switch (op) {
+  case OP_SIG:
+    return ((unsigned long) target_signature(0) << 16) | ((word) target_signature(1) << 8) | target_signature(2);
+  case OP_ERASE:
+    target_erase();
+    break;
+  case OP_ERASE_KEEP:
+    return target_erase_keep();
+  case OP_FUSE:
+    if (write)
+      return target_fuse_update(value, addr);
+    return target_fuse_read(addr);
+  case OP_LOCK:
+    if (write)
+      target_lock_write(value);
+    return target_lock_read();
+  case OP_EE:
+    if (write)
+      target_eeprom_write(addr, value);
+    return target_eeprom_read(addr);
+  case OP_FLASH:
+    for (i = 0; i < value; i++)
+      ((word *) page_buf)[i] = target_flash_read(addr + i);  // little endian, same as the flash
+    return value;
+  case OP_PAGE:
+    target_flash_page(addr, page_buf, value);
+    break;
+  case OP_VERIFY:
+    for (i = 0; i < value; i++)
+      if (target_flash_read(addr + i) != ((word *) page_buf)[i])
+        break;
+    return i;
+  case OP_BLANK:
+  case OP_EE_BLANK:
+    return target_blank(op == OP_EE_BLANK, addr, value);
+  case OP_CRC:
+  case OP_EE_CRC:
+    return target_crc(op == OP_EE_CRC, addr, value);
+  }
+  return 0;
+}
+
+#if (MACRO == 1)
+byte macro_run(void) {  // Run the macro, returns 0 if it ended normally, else 1 + the offset of the failing opcode
+  // or MACRO_TIMED_OUT
+  unsigned long start = millis();
+  byte pc = 0;
+  byte at;
+  byte r = 0;
+  byte flag = 1;
+  byte status = 0;
+  signed char offset;
+
+  macro_outlen = 0;
+
+  while (pc < macro_len && status == 0) {
+    if (millis() - start > MACRO_TIMEOUT) {  // a backward branch on a flag that never changes
+      status = MACRO_TIMED_OUT;
+      break;
+    }
+    WDT_FEED();  // the run is bounded by MACRO_TIMEOUT
+    at = pc;
+    switch (macro[pc++]) {
+    case M_END:
+      pc = macro_len;
+      break;
+    case M_ENTER:
+      if (session_begin() == 0xFF)
+        status = at + 1;
+      break;
+    case M_EXIT:
+      session_end();
+      break;
+    case M_CMD:
+      send_cmd(macro[pc++]);
+      break;
+    case M_ADDR:
+      load_addr(macro[pc + 1], 1);
+      load_addr(macro[pc], 0);
+      pc += 2;
+      break;
+    case M_DATA:
+      load_data(macro[pc++], 0);
+      break;
+    case M_READ:
+      digitalWrite(BS1, (macro[pc] & 1) ? HIGH : LOW);
+      digitalWrite(BS2, (macro[pc++] & 2) ? HIGH : LOW);
+      digitalWrite(OE, LOW);
+      delayMicroseconds(timing.oe);
+      r = data_read();
+      digitalWrite(OE, HIGH);
+      break;
+    case M_WR:
+      digitalWrite(BS1, (macro[pc] & 1) ? HIGH : LOW);
+      digitalWrite(BS2, (macro[pc++] & 2) ? HIGH : LOW);
+      digitalWrite(WR, LOW);
+      delayMicroseconds(timing.wr);
+      digitalWrite(WR, HIGH);
+      hvpp_forget();  // could have been a chip erase
+      break;
+    case M_READY:
+      if (!wait_ready())
+        status = at + 1;
+      break;
+    case M_HVSP:
+      r = HVSP_read(macro[pc], macro[pc + 1]);
+      pc += 2;
+      break;
+    case M_OP:
+      r = target_op(macro[pc], macro[pc + 1] | (macro[pc + 2] << 8), macro[pc + 3], macro[pc + 4]);
+      pc += 5;
+      break;
+    case M_LDI:
+      r = macro[pc++];
+      break;
+    case M_CMP:
+      flag = (r == macro[pc++]);
+      break;
+    case M_BNE:
+      offset = macro[pc++];
+      if (!flag)
+        pc += offset;
+      break;
+    case M_EMIT:
+      if (macro_outlen < MACRO_OUT_LEN)
+        macro_out[macro_outlen++] = r;
+      break;
+    case M_DELAY:
+      delay(macro[pc++]);
+      break;
+    default:  // M_FAIL and unknown opcodes
+      status = at + 1;
+      break;
+    }
+  }
+
+  session_end();
+  return status;
+}
+
+void macro_report(byte status) {  // Print the macro output and how it ended, the serial port must be open
+  for (byte i = 0; i < macro_outlen; i++) {
+    if (macro_out[i] < 0x10)
+      Serial.print("0");
+    Serial.print(macro_out[i], HEX);
+  }
+  Serial.println();
+  if (status == 0) {
+    Serial.println("Macro done.");
+  } else if (status == MACRO_TIMED_OUT) {
+    Serial.println("Macro stopped, it ran longer than MACRO_TIMEOUT.");
+  } else {
+    Serial.print("Macro failed at ");
+    Serial.println(status - 1, HEX);
+  }
+}
+
+void macro_load(void) {  // Load the macro from the Arduino EEPROM
+  macro_len = ee_read_byte(EE_MACRO);
+  if (macro_len > MACRO_LEN)  // blank EEPROM
+    macro_len = 0;
+  ee_read_block(macro, EE_MACRO + 1, macro_len);
+}
+
+void macro_save(void) {  // Save the macro to the Arduino EEPROM
+  ee_update_byte(EE_MACRO, macro_len);
+  ee_update_block(macro, EE_MACRO + 1, macro_len);
 }
+#endif
+
+#if (VECTORS == 1)
+void vector_run(void) {  // Play the vectors back at full speed, capturing PINB/PIND at the end of every step
+  // The caller hands the DATA lines over (Serial.end) and returns the pins to a safe state afterwards
+  byte sreg = SREG;
+
+  cli();  // no interrupt may stretch a step
+  for (vector *v = vectors; v < vectors + vector_len; v++) {
+    DDRB = v->ddrb;
+    DDRC = v->ddrc & ~_BV(PC1);
+    DDRD = v->ddrd;
+    PORTB = v->portb;
+    PORTC = v->portc | _BV(PC1);
+    PORTD = v->portd;
+    if (v->hold)
+      _delay_loop_2(v->hold);
+    v->pinb = PINB;
+    v->pind = PIND;
+  }
+  SREG = sreg;
+  hvpp_forget();  // anything could have been loaded
+}
+#endif
+
+#if (BENCH == 1)
+// Primitives timed by the bench command, no target or one that isn't in programming mode
+void bench_call(void) {}  // call and timer overhead, included in every other result
+void bench_sclk(void) { sclk(); }
+void bench_strobe(void) { strobe_xtal(); }
+void bench_cmd(void) { hvpp_forget(); send_cmd(B00000000); }  // no operation, the shadow is cleared so it is loaded
+void bench_oe(void) {  // read cycle of fuse_read
+  digitalWrite(OE, LOW);
+  delayMicroseconds(timing.oe);
+  data_read();
+  digitalWrite(OE, HIGH);
+}
+void bench_hvsp_read(void) { HVSP_read(HVSP_NOP_DATA, HVSP_NOP_INSTR); }
+void bench_hvsp_write(void) { HVSP_write(HVSP_NOP_DATA, HVSP_NOP_INSTR); }
+void bench_data_write(void) { data_write(0x55); }  // mega_data_write on the Mega
+void bench_data_read(void) { data_read(); }        // mega_data_read on the Mega
+
+struct bench_t {
+  const char *name;
+  void (*run)(void);
+};
+
+const bench_t benches[] = {
+  { "call", bench_call }, { "sclk", bench_sclk }, { "strobe_xtal", bench_strobe }, { "send_cmd", bench_cmd },
+  { "oe_read", bench_oe }, { "HVSP_read", bench_hvsp_read }, { "HVSP_write", bench_hvsp_write },
+  { "data_write", bench_data_write }, { "data_read", bench_data_read }
+};
+
+unsigned long bench_once(void (*run)(void), byte slow) {  // CPU cycles of one call, 0xFFFFFFFF if Timer1 overflowed
+  word count;
+
+  TCNT1 = 0;
+  TIFR1 = _BV(TOV1);
+  TCCR1B = slow ? (_BV(CS11) | _BV(CS10)) : _BV(CS10);  // clk/64: 262 ms range, clk/1: 4 ms
+  run();
+  count = TCNT1;
+  TCCR1B = 0;
+  if (TIFR1 & _BV(TOV1))
+    return 0xFFFFFFFF;
+  return slow ? count * 64UL : count;
+}
+
+void bench_run(word n) {  // Run every primitive n times, print name, min, mean and max CPU cycles
+  // Timer1 is borrowed and restored; the bare metal millis() runs from it and stands still meanwhile
+  byte tccr1a = TCCR1A;
+  byte tccr1b = TCCR1B;
+  byte timsk1 = TIMSK1;
+  word tcnt1 = TCNT1;
+
+  TCCR1B = 0;
+  TIMSK1 = 0;
+  TCCR1A = 0;  // normal mode
+  for (byte b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+    unsigned long t, min = 0xFFFFFFFF, max = 0, sum = 0;
+    byte slow;
+
+    bus_acquire();
+    slow = bench_once(benches[b].run, 1) >= 0xF000;  // first call picks the resolution
+    for (word i = 0; i < n; i++) {
+      t = bench_once(benches[b].run, slow);
+      if (t < min)
+        min = t;
+      if (t > max)
+        max = t;
+      sum += t;
+    }
+    #if (HVSP_ISR == 1)
+      HVSP_sync();
+    #endif
+    data_input();
+    bus_release();
+
+    Serial.print(benches[b].name);
+    if (max == 0xFFFFFFFF) {
+      Serial.println(" overflow");
+      continue;
+    }
+    Serial.print(" ");
+    Serial.print(min);
+    Serial.print(" ");
+    Serial.print(sum / n);
+    Serial.print(" ");
+    Serial.println(max);
+  }
+  TCNT1 = tcnt1;
+  TIFR1 = _BV(TOV1);
+  TCCR1A = tccr1a;
+  TIMSK1 = timsk1;
+  TCCR1B = tccr1b;
+}
+#endif
+
+#if (SERIALIZE == 1)
+unsigned long serial_next(void) {  // Next serial number to issue, from the Arduino EEPROM
+  unsigned long number;
+
+  ee_read_block(&number, EE_SERIAL_NEXT, sizeof(number));
+
+  if (number == 0xFFFFFFFF)  // blank EEPROM
+    number = SERIAL_FIRST;
+  return number;
+}
+
+byte serial_write(unsigned long number) {  // Write serial number to target EEPROM, returns 1 if verified
+  byte id[SERIAL_PREFIX_LEN + SERIAL_BYTES];
+  byte i;
+
+  memcpy(id, serial_prefix, SERIAL_PREFIX_LEN);
+  for (i = 0; i < SERIAL_BYTES; i++) {
+    #if (SERIAL_MSB_FIRST == 1)
+      id[SERIAL_PREFIX_LEN + SERIAL_BYTES - 1 - i] = number >> (8 * i);
+    #else
+      id[SERIAL_PREFIX_LEN + i] = number >> (8 * i);
+    #endif
+  }
+
+  for (i = 0; i < sizeof(id); i++)
+    target_eeprom_write(SERIAL_ADDR + i, id[i]);
+
+  // Read back to verify the write worked
+  for (i = 0; i < sizeof(id); i++) {
+    if (target_eeprom_read(SERIAL_ADDR + i) != id[i])
+      return 0;
+  }
+  return 1;
+}
+
+void serial_log(unsigned long number, byte status, byte lfuse, byte hfuse, byte efuse) {  // Record an issued number
+  serial_record rec;
+
+  rec.number = number;
+  rec.status = status;
+  rec.fuses[LFUSE_SEL] = lfuse;
+  rec.fuses[HFUSE_SEL] = hfuse;
+  rec.fuses[EFUSE_SEL] = efuse;
+
+  // Records are indexed by number, so no separate head pointer has to be written
+  ee_update_block(&rec, EE_SERIAL_LOG + (number % SERIAL_LOG_LEN) * sizeof(rec), sizeof(rec));
+  number++;
+  ee_update_block(&number, EE_SERIAL_NEXT, sizeof(number));
+}
+
+void serial_dump(void) {  // Print the serial number records, one per line: number, status, fuses
+  serial_record rec;
+
+  for (byte i = 0; i < SERIAL_LOG_LEN; i++) {
+    ee_read_block(&rec, EE_SERIAL_LOG + i * sizeof(rec), sizeof(rec));
+    if (rec.number == 0xFFFFFFFF)  // unused slot
+      continue;
+
+    Serial.print(rec.number, HEX);
+    Serial.print(rec.status ? " OK " : " FAIL ");
+    Serial.print(rec.fuses[LFUSE_SEL], HEX);
+    Serial.print(" ");
+    Serial.print(rec.fuses[HFUSE_SEL], HEX);
+    Serial.print(" ");
+    Serial.println(rec.fuses[EFUSE_SEL], HEX);
+  }
+}
+#endif
+
+#if (STATS == 1)
+void stats_load(void) {  // Load lifetime statistics from the newest slot, clear session statistics
+  byte found = 0;
+
+  for (byte i = 0; i < STATS_SLOTS; i++) {
+    word seq;
+
+    ee_read_block(&seq, EE_STATS + i * STATS_SLOT_LEN, sizeof(seq));
+
+    if (seq == 0xFFFF)  // blank slot
+      continue;
+    if (!found || (int16_t) (seq - stats_seq) > 0) {  // newer than the newest so far, allowing for wrap around
+      stats_seq = seq;
+      stats_slot = i;
+      found = 1;
+    }
+  }
+
+  memset(stats, 0, sizeof(stats));
+  if (found) {
+    ee_read_block(&stats[STATS_LIFE], EE_STATS + stats_slot * STATS_SLOT_LEN + sizeof(word), sizeof(stats_t));
+    stats_slot = (stats_slot + 1) % STATS_SLOTS;
+  }
+}
+
+void stats_save(void) {  // Save lifetime statistics to the next slot, so writes are spread over all of them
+  word addr = EE_STATS + stats_slot * STATS_SLOT_LEN;
+
+  stats_seq++;
+  if (stats_seq == 0xFFFF)  // reserved for blank slots
+    stats_seq = 0;
+
+  ee_update_block(&stats[STATS_LIFE], addr + sizeof(word), sizeof(stats_t));
+  // Sequence number goes last: if the save is interrupted the previous slot is still the newest one
+  ee_update_block(&stats_seq, addr, sizeof(stats_seq));
+
+  stats_slot = (stats_slot + 1) % STATS_SLOTS;
+}
+
+void stats_dump(void) {  // Binary dump: 'S', size of one record, lifetime record, session record
+  Serial.write('S');
+  Serial.write(sizeof(stats_t));
+  Serial.write((const uint8_t *) stats, sizeof(stats));
+}
+#endif
+
+#if (JOURNAL == 1)
+void journal_load(void) {  // Find the next slot to write: after the newest record, which is before the first gap
+  byte seq = ee_read_byte(EE_JOURNAL);
+  journal_entry last;
+
+  for (journal_next = 1; journal_next < JOURNAL_SLOTS; journal_next++) {
+    byte s = ee_read_byte(EE_JOURNAL + journal_next * sizeof(journal_entry));
+
+    if (s != (byte) (seq + 1))
+      break;
+    seq = s;
+  }
+  journal_next &= JOURNAL_SLOTS - 1;  // no gap: the last slot is the newest
+  ee_read_block(&last, EE_JOURNAL + ((journal_next - 1) & (JOURNAL_SLOTS - 1)) * sizeof(journal_entry), sizeof(last));
+  journal_seq = seq + 1;
+  journal_cycle = (last.event == 0xFF) ? 0 : last.cycle;
+}
+
+byte journal_flush(void) {  // Write one queued record, returns 0 if there was none
+  journal_entry *e = &journal_queue[journal_tail & (JOURNAL_QUEUE - 1)];
+
+  if (journal_tail == journal_head)
+    return 0;
+  e->seq = journal_seq++;
+  ee_update_block(e, EE_JOURNAL + journal_next * sizeof(journal_entry), sizeof(journal_entry));
+  journal_next = (journal_next + 1) & (JOURNAL_SLOTS - 1);
+  journal_tail++;
+  return 1;
+}
+
+void journal_dump(void) {  // Binary dump: 'J', size of one record, number of records, records oldest first
+  while (journal_flush());
+  Serial.write('J');
+  Serial.write(sizeof(journal_entry));
+  Serial.write(JOURNAL_SLOTS);
+  for (byte i = 0; i < JOURNAL_SLOTS; i++) {
+    journal_entry e;
+
+    ee_read_block(&e, EE_JOURNAL + ((journal_next + i) & (JOURNAL_SLOTS - 1)) * sizeof(journal_entry), sizeof(e));
+    Serial.write((const uint8_t *) &e, sizeof(e));
+  }
+}
+
+void journal_clear(void) {  // Erase all records, takes up to 1.7 s
+  for (word i = 0; i < JOURNAL_SLOTS * sizeof(journal_entry); i++) {
+    WDT_FEED();
+    ee_update_byte(EE_JOURNAL + i, 0xFF);
+  }
+  journal_tail = journal_head;
+  journal_next = 0;
+  journal_seq = 0;
+}
+#endif
+
+void mode_set(byte m) {  // Select the programming mode
+  mode = m;
+  // reassign PAGEL and BS2 to their combined counterparts on the '2313
+  PAGEL = (mode == TINY2313) ? BS1 : A5;
+  BS2 = (mode == TINY2313) ? XA1 : 9;
+}
+
+void mode_report(void) {  // Report which mode is selected
+  Serial.print("Selected mode: ");
+  switch(mode) {
+  case ATMEGA:
+    Serial.println("ATMEGA");
+    break;
+  case TINY2313:
+    Serial.println("ATtiny2313");
+    break;
+  case HVSP:
+    Serial.println("ATtiny/HVSP");
+    break;
+  }
+}
+
+byte config_load(void) {  // Load mode, baud rate and timing saved by config_save, returns 0 if there are none
+  config_t config;
+
+  ee_read_block(&config, EE_CONFIG, sizeof(config));
+  if (config.magic != CONFIG_MAGIC || config.mode > HVSP || config.baud < BAUD_MIN || config.baud > BAUD_MAX)
+    return 0;
+  mode = config.mode;
+  baud = config.baud;
+  timing = config.timing;
+  return 1;
+}
+
+void config_save(byte valid) {  // Save mode, baud rate and timing, or forget them (valid = 0)
+  config_t config = { valid ? (byte) CONFIG_MAGIC : (byte) 0xFF, mode, baud, timing };
 
-void HVSP_write(byte data, byte instr) { // Write to target using the HVSP protocol
+  ee_update_block(&config, EE_CONFIG, sizeof(config));
+}
 
-  digitalWrite(SCI, LOW);  // set clock low
+#if (HOSTCMD == 1)
+char *cmd_arg(void) {  // Next argument of the host command being run, NULL if there are no more
+  return strtok(NULL, " ");
+}
 
-  // 1st bit is always zero
-  digitalWrite(SDI, LOW);
-  digitalWrite(SII, LOW);
-  sclk();  // latch bit
+byte cmd_hex(const char *s, byte *buf, byte len) {  // Convert a string of hex bytes into buf, returns the count
+  byte n = 0;
 
-  // Send each bit of data and instruction byte serially, MSB first
-  // I do this by shifting the byte left 1 bit at a time and checking the value of the new MSB
-  for (int i=0; i<8; i++) {  // i is bit number
-    if ((data << i) & 0x80)  // shift data byte left and check if new MSB is 1 or 0
-      digitalWrite(SDI, HIGH);  // bit was 1, set pin high
-    else
-      digitalWrite(SDI, LOW);   // bit was 0, set pin low
+  for (; s && s[0] && s[1] && n < len; s += 2)
+    buf[n++] = hex2dec(s[0]) * 16 + hex2dec(s[1]);
+  return n;
+}
 
-    if ((instr << i) & 0x80)  // same process for instruction byte
-      digitalWrite(SII, HIGH);
-    else
-      digitalWrite(SII, LOW);
+byte cmd_target(char *cmd) {  // Run a target operation of the session, returns 0 if cmd isn't one
+  char *arg1 = cmd_arg();
+  char *arg2 = cmd_arg();
+  byte op, write;
+  word addr, value;
+  unsigned long result;
+
+  // all numbers are hex, addresses are byte addresses for EEPROM and word addresses for flash
+  addr = arg1 ? strtoul(arg1, NULL, 16) : 0;
+  value = arg2 ? strtoul(arg2, NULL, 16) : 1;
+  write = (arg2 != NULL);
+
+  if (strcmp(cmd, "sig") == 0) {               // sig
+    op = OP_SIG;
+  } else if (strcmp(cmd, "erase") == 0) {      // erase [keep]
+    op = (arg1 && strcmp(arg1, "keep") == 0) ? OP_ERASE_KEEP : OP_ERASE;
+  } else if (strcmp(cmd, "fuse") == 0) {       // fuse l|h|e [<value>]
+    op = OP_FUSE;
+    addr = (arg1 && arg1[0] == 'h') ? HFUSE_SEL : (arg1 && arg1[0] == 'e') ? EFUSE_SEL : LFUSE_SEL;
+  } else if (strcmp(cmd, "lock") == 0) {       // lock [<value>]
+    op = OP_LOCK;
+    value = addr;
+    write = (arg1 != NULL);
+  } else if (strcmp(cmd, "ee") == 0) {         // ee <addr> [<value>]
+    op = OP_EE;
+  } else if (strcmp(cmd, "flash") == 0) {      // flash <addr> [<words>]
+    op = OP_FLASH;
+  } else if (strcmp(cmd, "page") == 0) {       // page <addr> <words>
+    op = OP_PAGE;
+  } else if (strcmp(cmd, "verify") == 0) {     // verify <addr> <words>
+    op = OP_VERIFY;
+  } else if (strcmp(cmd, "blank") == 0) {      // blank <addr> <words>
+    op = OP_BLANK;
+  } else if (strcmp(cmd, "eeblank") == 0) {    // eeblank <addr> <bytes>
+    op = OP_EE_BLANK;
+  } else if (strcmp(cmd, "crc") == 0) {        // crc <addr> <words>
+    op = OP_CRC;
+  } else if (strcmp(cmd, "eecrc") == 0) {      // eecrc <addr> <bytes>
+    op = OP_EE_CRC;
+  } else {
+    return 0;
+  }
 
-   sclk();  // strobe SCI (serial clock) to latch data
+  if (!session) {
+    Serial.println("Not in programming mode, send hv first.");
+    return 1;
   }
 
-  // Last 2 bits are always zero
-  for (int i=0; i<2; i++) {
-    digitalWrite(SDI, LOW);
-    digitalWrite(SII, LOW);
-    sclk();
+  bus_acquire();
+  result = target_op(op, addr, value, write);
+  bus_release();
+
+  if (op == OP_FLASH) {
+    for (byte i = 0; i < 2 * result; i++) {
+      if (page_buf[i] < 0x10)
+        Serial.print("0");
+      Serial.print(page_buf[i], HEX);
+    }
+    Serial.println();
+  } else if (op == OP_VERIFY && result == value) {
+    Serial.println("OK");
+  } else if (op == OP_ERASE_KEEP) {
+    Serial.println(result ? "OK" : "EESAVE failed, not erased");
+  } else if (op == OP_VERIFY) {
+    Serial.print("Mismatch at ");
+    Serial.println(addr + result, HEX);
+  } else if ((op == OP_BLANK || op == OP_EE_BLANK) && result == value) {
+    Serial.println("Blank");
+  } else if (op == OP_BLANK || op == OP_EE_BLANK) {
+    Serial.print("Not blank at ");
+    Serial.println(addr + result, HEX);
+  } else if (op != OP_ERASE && op != OP_PAGE) {
+    Serial.println(result, HEX);
   }
+  return 1;
 }
 
-#if (MEGA == 1)  // functions specifically for the Arduino Mega
+byte cmd_job(char *cmd) {  // Run a whole operator job line, returns 0 if cmd isn't one
+  // [atmega|tiny2313|hvsp] [L=<fuse>] [H=<fuse>] [E=<fuse>] [lock=<bits>] [verify], values in hex
+  const char *const modes[] = { "atmega", "tiny2313", "hvsp" };
+  const char *const keys[] = { "L", "H", "E", "lock" };  // indexed like want
+  int want[4] = { -1, -1, -1, -1 };  // LFUSE_SEL, HFUSE_SEL, EFUSE_SEL, lock; -1 = leave alone
+  byte got[4];
+  byte m = mode;
+  byte verify = 0;
+  byte ok = 1;
+  byte i;
+
+  for (i = 0; i < sizeof(modes) / sizeof(modes[0]) && strcasecmp(cmd, modes[i]) != 0; i++);
+  if (i < sizeof(modes) / sizeof(modes[0])) {
+    m = i;
+    cmd = cmd_arg();
+  } else if (strchr(cmd, '=') == NULL) {
+    return 0;
+  }
 
-void mega_data_write(byte data) { // Write a byte to digital lines 0-7
-  // This is really ugly, thanks to the way that digital lines 0-7 are implemented on the Mega.
-  PORTE &= ~(_BV(PE0) | _BV(PE1) | _BV(PE4) | _BV(PE5) | _BV(PE3));  // clear bits associated with digital pins 0-1, 2-3, 5
-  PORTE |= (data & 0x03);  // set lower 2 bits corresponding to digital pins 0-1
-  PORTE |= (data & 0x0C) << 2;  // set PORTE bits 4-5, corresponding to digital pins 2-3
-  PORTE |= (data & 0x20) >> 2;  // set PORTE bit 5, corresponding to digital pin 5
-  DDRE |= (_BV(PE0) | _BV(PE1) | _BV(PE4) | _BV(PE5) | _BV(PE3));  // set bits we are actually using to outputs
+  for (; cmd; cmd = cmd_arg()) {
+    char *value = strchr(cmd, '=');
+    char *end;
+    unsigned long v;
 
-  PORTG &= ~(_BV(PG5));  // clear bits associated with digital pins 4-5
-  PORTG |= (data & 0x10) << 1;  // set PORTG bit 5, corresponding to digital pin 4
-  DDRG |= (_BV(PG5));  // set to output
+    if (value)
+      *value++ = '\0';
+    if (strcasecmp(cmd, "verify") == 0) {
+      verify = 1;
+      continue;
+    }
+    for (i = 0; i < 4 && (value == NULL || strcasecmp(cmd, keys[i]) != 0); i++);
+    if (i == 4) {
+      Serial.print("Unknown job item ");
+      Serial.println(cmd);
+      return 1;
+    }
+    v = strtoul(value, &end, 16);
+    if (*value == '\0' || *end != '\0' || v > 0xFF) {  // ie. L=1FF would be burned as FF
+      Serial.print("Bad value for ");
+      Serial.println(cmd);
+      return 1;
+    }
+    want[i] = v;
+  }
 
-  PORTH &= ~(_BV(PH3) | _BV(PH4));  // clear bites associated with digital pins 6-7
-  PORTH |= (data & 0xC0) >> 3;  // set PORTH bits 3-4, corresponding with digital pins 6-7
-  DDRH |= (_BV(PH3) | _BV(PH4));  // set bits to outputs
+  bus_acquire();
+  session_end();  // a job is a session of its own
+  bus_release();  // the bus handover follows the mode, so change it with the bus released
+  mode_set(m);
+  bus_acquire();
+  if (session_begin() == 0xFF) {
+    bus_release();
+    Serial.println("Could not enter programming mode.");
+    return 1;
+  }
+  // HFUSE first, as in the button cycle; each fuse is read back even if it is left alone
+  got[HFUSE_SEL] = want[HFUSE_SEL] < 0 ? target_fuse_read(HFUSE_SEL) : target_fuse_update(want[HFUSE_SEL], HFUSE_SEL);
+  got[LFUSE_SEL] = want[LFUSE_SEL] < 0 ? target_fuse_read(LFUSE_SEL) : target_fuse_update(want[LFUSE_SEL], LFUSE_SEL);
+  got[EFUSE_SEL] = want[EFUSE_SEL] < 0 ? target_fuse_read(EFUSE_SEL) : target_fuse_update(want[EFUSE_SEL], EFUSE_SEL);
+  got[3] = target_lock_read();
+  if (want[3] >= 0 && got[3] != want[3]) {  // like the fuses, written only if they differ
+    target_lock_write(want[3]);
+    got[3] = target_lock_read();
+  }
+  session_end();
+  bus_release();
+
+  for (i = 0; i < 4; i++) {
+    Serial.print(i == 3 ? "lock=" : i == HFUSE_SEL ? "H=" : i == EFUSE_SEL ? "E=" : "L=");
+    Serial.print(got[i], HEX);
+    Serial.print(" ");
+    if (want[i] >= 0 && got[i] != want[i])
+      ok = 0;
+  }
+  Serial.println(verify ? (ok ? "OK" : "FAIL") : "");
+  return 1;
 }
 
-byte mega_data_read(void) { // Read a byte from digital lines 0-7
-  byte data = 0x00;  // initialize to zero
-  data |= (PINE & 0x03);  // set lower 2 bits
-  data |= (PINE & 0x30) >> 2;  // set bits 3-4 from PINE bits 4-5
-  data |= (PINE & 0x08) << 2;  // set bit 5 from PINE bit 3
-  data |= (PING & 0x20) >> 1;  // set bit 4 from PING bit 5
-  data |= (PINH & 0x18) << 3;  // set bits 6-7 from PINH bits 3-4
+void cmd_exec(char *line) {  // Run one host command
+  char *cmd = strtok(line, " ");
+  char *arg;
+
+  if (cmd == NULL)
+    return;
+  #if (SERIALIZE == 1)
+  else if (strcmp(cmd, "serial") == 0) {  // serial [log | <next number in hex>]
+    arg = cmd_arg();
+    if (arg == NULL)
+      Serial.println(serial_next(), HEX);
+    else if (strcmp(arg, "log") == 0)
+      serial_dump();
+    else {
+      unsigned long number = strtoul(arg, NULL, 16);
+
+      ee_update_block(&number, EE_SERIAL_NEXT, sizeof(number));
+    }
+  }
+  #endif
+  #if (STATS == 1)
+  else if (strcmp(cmd, "stats") == 0) {  // stats [reset]
+    arg = cmd_arg();
+    if (arg == NULL) {
+      stats_dump();
+    } else if (strcmp(arg, "reset") == 0) {
+      memset(stats, 0, sizeof(stats));
+      stats_save();
+    }
+  }
+  #endif
+  #if (JOURNAL == 1)
+  else if (strcmp(cmd, "journal") == 0) {  // journal [clear]
+    arg = cmd_arg();
+    if (arg == NULL)
+      journal_dump();
+    else if (strcmp(arg, "clear") == 0 && session)
+      Serial.println("Not with the target in programming mode, send off first.");
+    else if (strcmp(arg, "clear") == 0)
+      journal_clear();
+  }
+  #endif
+  else if (strcmp(cmd, "hv") == 0) {  // hv: enter programming mode, target commands run until off
+    byte entry;
+
+    bus_acquire();
+    entry = session_begin();
+    bus_release();
+    if (entry == 0xFF) {
+      Serial.println("Could not enter programming mode.");
+    } else {
+      Serial.print("Entry variant ");
+      Serial.println(entry);
+    }
+  }
+  else if (strcmp(cmd, "off") == 0) {  // off: leave programming mode
+    bus_acquire();
+    session_end();
+    bus_release();
+  }
+  else if (strcmp(cmd, "buf") == 0) {  // buf <offset> <data>: load page_buf, data is a string of hex bytes
+    word offset;
 
-  return data;
+    arg = cmd_arg();
+    offset = arg ? strtoul(arg, NULL, 16) : 0;
+    if (offset < PAGE_BUF_LEN)
+      cmd_hex(cmd_arg(), page_buf + offset, PAGE_BUF_LEN - offset);
+  }
+  else if (strcmp(cmd, "sync") == 0) {  // sync: back to a known state, no session, nothing pending
+    bus_acquire();
+    session_end();
+    bus_release();
+    while (Serial.available())
+      Serial.read();
+    ee_sync();
+    Serial.println("sync ok");
+  }
+  else if (strcmp(cmd, "mode") == 0) {  // mode [1|2|3]: select the mode, numbered as in the mode question
+    arg = cmd_arg();
+    if (arg && arg[0] >= '1' && arg[0] <= '3') {
+      bus_acquire();
+      session_end();
+      bus_release();
+      mode_set(arg[0] - '1');
+    }
+    mode_report();
+  }
+  else if (strcmp(cmd, "save") == 0) {  // save [forget]: keep mode, baud rate and timing across resets
+    arg = cmd_arg();
+    config_save(arg == NULL);
+  }
+  else if (strcmp(cmd, "ping") == 0) {  // ping [<token>]: echo the token with the device time in us
+    unsigned long now = micros();
+
+    arg = cmd_arg();
+    Serial.print("pong ");
+    Serial.print(arg ? arg : "");
+    Serial.print(" ");
+    Serial.println(now);
+  }
+  else if (strcmp(cmd, "sink") == 0) {  // sink <n>: receive n raw bytes (0, 1, 2 ... 255, 0 ...)
+    unsigned long n, count = 0, errors = 0;
+    unsigned long start, last;
+
+    arg = cmd_arg();
+    n = arg ? strtoul(arg, NULL, 10) : 0;
+    start = last = millis();
+    while (count < n && millis() - last < LINK_TIMEOUT) {
+      WDT_FEED();  // a session may be open
+      if (Serial.available()) {
+        if ((byte) Serial.read() != (byte) count)
+          errors++;
+        count++;
+        last = millis();
+      }
+    }
+    Serial.print("sink ");  // bytes received, errors, time from the command to the last byte in ms
+    Serial.print(count);
+    Serial.print(" ");
+    Serial.print(errors);
+    Serial.print(" ");
+    Serial.println(last - start);
+  }
+  else if (strcmp(cmd, "source") == 0) {  // source <n>: send n raw bytes (0, 1, 2 ... 255, 0 ...)
+    unsigned long n, start;
+
+    arg = cmd_arg();
+    n = arg ? strtoul(arg, NULL, 10) : 0;
+    start = millis();
+    for (unsigned long i = 0; i < n; i++) {
+      WDT_FEED();
+      Serial.write((byte) i);
+    }
+    Serial.flush();
+    Serial.print("\r\nsource ");  // bytes sent, time in ms
+    Serial.print(n);
+    Serial.print(" ");
+    Serial.println(millis() - start);
+  }
+  else if (strcmp(cmd, "baud") == 0) {  // baud [<rate>]: switch rate, kept only if the host sends 'U' at the new one
+    unsigned long old = baud;
+    unsigned long start;
+    byte ok = 0;
+
+    arg = cmd_arg();
+    if (arg && (strtoul(arg, NULL, 10) < BAUD_MIN || strtoul(arg, NULL, 10) > BAUD_MAX)) {
+      Serial.println("Out of range, 300-2000000.");  // Serial.begin(0) would divide by zero
+    } else if (arg) {
+      Serial.print("baud ");
+      Serial.println(arg);
+      Serial.end();  // waits for the reply to go out at the old rate
+      baud = strtoul(arg, NULL, 10);
+      Serial.begin(baud);
+      for (start = millis(); !ok && millis() - start < LINK_TIMEOUT; ) {
+        WDT_FEED();
+        ok = (Serial.available() && Serial.read() == 'U');
+      }
+      if (!ok) {  // the host didn't make it, fall back
+        Serial.end();
+        baud = old;
+        Serial.begin(baud);
+      }
+    }
+    Serial.print("baud ");
+    Serial.println(baud);
+  }
+  else if (strcmp(cmd, "timing") == 0) {  // timing [sclk|strobe|oe|wr <us>]: bus timing, decimal
+    const char *const names[] = { "sclk", "strobe", "oe", "wr" };
+    word *values = (word *) &timing;
+    char *value;
+
+    arg = cmd_arg();
+    value = cmd_arg();
+    if (value && strtoul(value, NULL, 10) > T_MAX) {
+      Serial.println("Out of range, 0-16383 us.");
+      value = NULL;
+    }
+    for (byte i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+      if (arg && value && strcmp(arg, names[i]) == 0)
+        values[i] = strtoul(value, NULL, 10);
+      Serial.print(names[i]);
+      Serial.print(" ");
+      Serial.println(values[i]);
+    }
+  }
+  #if (BENCH == 1)
+  else if (strcmp(cmd, "bench") == 0) {  // bench [<n>]: time every bus primitive n times (decimal, 1-1000)
+    word n;
+
+    arg = cmd_arg();
+    n = arg ? strtoul(arg, NULL, 10) : 100;
+    if (session)
+      Serial.println("Not with the target in programming mode, send off first.");
+    else if (n >= 1 && n <= 1000)
+      bench_run(n);
+  }
+  #endif
+  #if (VECTORS == 1)
+  else if (strcmp(cmd, "vec") == 0) {  // vec clear | add <vectors> | run
+    arg = cmd_arg();
+    if (arg == NULL) {
+      Serial.println(vector_len);
+    } else if (strcmp(arg, "clear") == 0) {
+      vector_len = 0;
+    } else if (strcmp(arg, "add") == 0) {  // 8 bytes each: PORTB PORTC PORTD DDRB DDRC DDRD hold (little endian)
+      for (arg = cmd_arg(); vector_len < VECTOR_LEN && cmd_hex(arg, (byte *) &vectors[vector_len], 8) == 8;
+           arg += 16)
+        vector_len++;
+    } else if (strcmp(arg, "run") == 0 && !session) {
+      byte ports[6] = { PORTB, PORTC, PORTD, DDRB, DDRC, DDRD };  // XTAL1 low, no stray pullups afterwards
+
+      Serial.end();
+      vector_run();
+      PORTB = ports[0];
+      PORTC = ports[1];
+      PORTD = ports[2];
+      DDRB = ports[3];
+      DDRC = ports[4];
+      DDRD = ports[5];
+      hv_exit();  // back to the safe state: no 12V, no VCC, DATA released
+      Serial.begin(baud);
+      for (byte i = 0; i < vector_len; i++) {  // PINB PIND of every step
+        if (vectors[i].pinb < 0x10)
+          Serial.print("0");
+        Serial.print(vectors[i].pinb, HEX);
+        if (vectors[i].pind < 0x10)
+          Serial.print("0");
+        Serial.print(vectors[i].pind, HEX);
+      }
+      Serial.println();
+    }
+  }
+  #endif
+  #if (MACRO == 1)
+  else if (strcmp(cmd, "macro") == 0) {  // macro [clear | add <bytes> | save | run]
+    arg = cmd_arg();
+    if (arg == NULL) {
+      for (byte i = 0; i < macro_len; i++) {
+        if (macro[i] < 0x10)
+          Serial.print("0");
+        Serial.print(macro[i], HEX);
+      }
+      Serial.println();
+    } else if (strcmp(arg, "clear") == 0) {
+      macro_len = 0;
+    } else if (strcmp(arg, "add") == 0) {
+      macro_len += cmd_hex(cmd_arg(), macro + macro_len, MACRO_LEN - macro_len);
+    } else if (strcmp(arg, "save") == 0) {
+      macro_save();
+    } else if (strcmp(arg, "run") == 0) {
+      byte status;
+
+      bus_acquire();
+      status = macro_run();
+      bus_release();
+      macro_report(status);
+    }
+  }
+  #endif
+  else if (cmd_job(cmd) == 0 && cmd_target(cmd) == 0)
+    Serial.println("Unknown command.");
 }
 
-void mega_data_input(void) { // Set digital lines 0-7 to inputs and turn off pullups
-  PORTE &= ~(_BV(PE0) | _BV(PE1) | _BV(PE4) | _BV(PE5) | _BV(PE3));  // Mega digital pins 0-3, 5
-  DDRE &= ~(_BV(PE0) | _BV(PE1) | _BV(PE4) | _BV(PE5) | _BV(PE3));  // Set to input
-  PORTG &= ~(_BV(PG5));  // Mega digital pin 4
-  DDRG &= ~(_BV(PG5));  // Set to input
-  PORTH &= ~(_BV(PH3) | _BV(PH4));  // Mega digital pins 6-7
-  DDRH &= ~(_BV(PH3) | _BV(PH4));  // Set to input
+void cmd_poll(void) {  // Collect characters from the host, run the command when a line is complete
+  while (Serial.available()) {
+    char c = Serial.read();
+
+    host_seen = millis();
+    if (c == '!' && cmdlen == 0) {  // one key repeats the last command, no Enter needed
+      strcpy(cmdline, cmdlast);
+      cmd_exec(cmdline);
+    } else if (c == '\r' || c == '\n') {
+      if (cmdlen > 0) {
+        cmdline[cmdlen] = '\0';
+        strcpy(cmdlast, cmdline);
+        cmd_exec(cmdline);
+        cmdlen = 0;
+      }
+    } else if (cmdlen < CMDLINE_LEN - 1) {
+      cmdline[cmdlen++] = c;
+    }
+  }
+}
+#endif
+
+#if (defined(SIMAVR) && defined(SIM_SCRIPT))
+void sim_script(void) {  // Run every target operation once in HVPP and HVSP mode, then end the simulation
+  // The markers of this run are the logical bus trace; the host build (host/config/script.h) checks it against host/golden/script.trace.
+  // Without a target model RDY/SDO never go high, so each wait ends with a READY_TIMEOUT; that is part of the trace as well.
+  const byte modes[] = { ATMEGA, HVSP };
+
+  Serial.end();
+  for (byte i = 0; i < sizeof(modes); i++) {
+    mode_set(modes[i]);
+    hv_enter(&entry_profiles[mode][0]);
+    target_signature(0);
+    for (byte select = LFUSE_SEL; select <= EFUSE_SEL; select++)
+      target_fuse_write(target_fuse_read(select), select);
+    target_lock_write(target_lock_read());
+    target_eeprom_write(0, target_eeprom_read(0));
+    target_op(OP_FLASH, 0, 2, 0);
+    target_flash_page(0, page_buf, 2);
+    target_blank(0, 0, 2);
+    target_erase();
+    hv_exit();
+  }
+
+  cli();
+  sleep_enable();
+  sleep_cpu();  // simavr stops when the CPU sleeps with interrupts disabled
 }
 #endif
 
+void idle_housekeeping(void) {  // Slow bookkeeping while waiting for the button, one step per call to keep polling fast
+  // Nothing of the next job is staged here: its fuse diff needs the next part, which isn't in the socket yet.
+  #if (EE_CACHE == 1)
+    ee_background(1);  // cached Arduino EEPROM bytes are written meanwhile
+  #endif
+  #if (STATS == 1)
+    if (stats_dirty) {  // the slow part: up to STATS_SLOT_LEN EEPROM writes
+      stats_save();
+      stats_dirty = 0;
+      return;
+    }
+  #endif
+  #if (JOURNAL == 1)
+    if (journal_flush())  // one record, up to 8 EEPROM writes
+      return;
+  #endif
+  entry_variant();  // cached, so hv_start doesn't read the EEPROM
+}
 
 void setup() { // run once, when the sketch starts
 
+#if ((ASKMODE == 1) && (INTERACTIVE == 1))
   byte response = 0;    // user response from mode query
+  byte configured;      // settings were loaded from the EEPROM
+#endif
 
   // Set up control lines for HV parallel programming
 
-  #if (MEGA == 0)  // Set up data lines on original Arduino
-    PORTD = 0x00;  // clear digital pins 0-7
-    DDRD = 0x00;  // set digital pins 0-7 as inputs for now
-  #else  // Mega uses different ports for same pins, much more complicated setup.  yuck!
-     mega_data_input();
-  #endif
+  data_input();  // set digital pins 0-7 as inputs for now
 
   pinMode(VCC, OUTPUT);
   pinMode(RDY, INPUT);
@@ -550,16 +3123,56 @@ void setup() { // run once, when the sketch starts
   digitalWrite(RST, HIGH);  // Turn off 12V step-up converter (inverting)
   digitalWrite(VCC, LOW);
 
-  Serial.begin(BAUD);  // Open serial port, this works on the Mega also because we are using serial port 0
+  #if ((ASKMODE == 1) && (INTERACTIVE == 1))
+    configured = config_load();  // saved settings skip the mode question
+  #else
+    config_load();
+  #endif
+
+  Serial.begin(baud);  // Open serial port, this works on the Mega also because we are using serial port 0
+  #if ((LEONARDO == 1) && (INTERACTIVE == 1))
+    while (!Serial);  // USB: wait for the serial monitor, or the mode question is lost
+  #endif
+
+  #if (JOURNAL == 1)
+    journal_load();
+    #if (WATCHDOG == 1)
+      journal_add(J_BOOT, reset_cause, mode);
+    #else
+      journal_add(J_BOOT, MCUSR, mode);  // may have been cleared by the bootloader
+    #endif
+  #endif
+
+  #if (WATCHDOG == 1)
+    wdt_report();
+  #endif
+
+  #if (STATS == 1)
+    stats_load();
+  #endif
+
+  #if (MACRO == 1)
+    macro_load();
+  #endif
+
+  #if (HVSP_ISR == 1)
+    HVSP_timer_init();
+  #endif
+
+  #if (defined(SIMAVR) && defined(SIM_SCRIPT))
+    sim_script();
+  #endif
 
     // Ask user which chip family we are programming
     #if ((ASKMODE == 1) && (INTERACTIVE == 1))
-    Serial.println("Select mode:");
-    Serial.println("1: ATmega (28-pin)");
-    Serial.println("2: ATtiny2313");
-    Serial.println("3: ATtiny (8-pin) / HVSP");
+    if (!configured) {
+      Serial.println("Select mode:");
+      Serial.println("1: ATmega (28-pin)");
+      Serial.println("2: ATtiny2313");
+      Serial.println("3: ATtiny (8-pin) / HVSP");
+    }
 
-    while (response == 0) {
+    while (response == 0 && !configured) {
 
       while (Serial.available() == 0);   // wait for character
       response = Serial.read();  // get response from user
@@ -583,21 +3196,8 @@ void setup() { // run once, when the sketch starts
     #endif
 
     // Report which mode was selected
-    Serial.print("Selected mode: ");
-    switch(mode) {
-    case ATMEGA:
-      Serial.println("ATMEGA");
-      break;
-    case TINY2313:
-      Serial.println("ATtiny2313");
-      // reassign PAGEL and BS2 to their combined counterparts on the '2313
-      PAGEL = BS1;
-      BS2 = XA1;
-      break;
-    case HVSP:
-      Serial.println("ATtiny/HVSP");
-      break;
-    }
+    mode_set(mode);
+    mode_report();
 }
 
 void loop() {  // run over and over again
@@ -610,95 +3210,118 @@ void loop() {  // run over and over again
   byte read_efuse;              // fuses read from target for verify
 #endif
 
+  byte keep_serial;             // UART stays open while burning
+  byte entry;                   // programming mode entry variant that worked
+
+#if (STATS == 1)
+  unsigned long cycle_start;    // button press time
+#endif
+
+#if (SERIALIZE == 1)
+  unsigned long serial_number;  // number written to the target EEPROM
+  byte serial_ok;               // 1 if the number was verified
+#endif
+
   Serial.println("Insert target AVR and press button.");
-  Serial.end();
 
-  // Set lower 2 bits of DATA low.  This helps avoid serial garbage showing up when you insert a part.
-  #if (MEGA == 0)
-    DDRD = 0x03;
-    PORTD = 0x00;
-  #else  // Lower 2 bits are part of PORTE on the Mega
-    PORTE &= ~(_BV(PE0) | _BV(PE1));
-    DDRE |= (_BV(PE0) | _BV(PE1));
+  #if (HOSTCMD == 0)
+    Serial.end();
+
+    // Set lower 2 bits of DATA low.  This helps avoid serial garbage showing up when you insert a part.
+    #if (MEGA == 1)  // Lower 2 bits are part of PORTE on the Mega
+      PORTE &= ~(_BV(PE0) | _BV(PE1));
+      DDRE |= (_BV(PE0) | _BV(PE1));
+    #elif (LEONARDO == 0)  // nothing to do on the Leonardo, the serial port is USB
+      DDRD = 0x03;
+      PORTD = 0x00;
+    #endif
   #endif
 
   // wait for button press, debounce
   while(1) {
-    while (digitalRead(BUTTON) == HIGH);  // wait here until button is pressed
+    while (digitalRead(BUTTON) == HIGH) {  // wait here until button is pressed
+      idle_housekeeping();
+      #if (HOSTCMD == 1)
+        cmd_poll();  // serial port stays open to take host commands meanwhile
+        if (session && millis() - host_seen > SESSION_TIMEOUT) {  // the host went away, 12V off
+          bus_acquire();
+          session_end();
+          bus_release();
+          Serial.println("No host command for too long, programming mode left.");
+        }
+      #endif
+      WDT_FEED();  // a host session stays open while the host is active, see above
+    }
     delay(100);                            // simple debounce routine
     if (digitalRead(BUTTON) == LOW)       // if the button is still pressed, continue
       break;  // valid press was detected, continue on with rest of program
   }
-  // Initialize pins to enter programming mode
-  #if (MEGA == 0)  // Set up data lines on original Arduino
-    PORTD = 0x00;  // clear digital pins 0-7
-    DDRD = 0x00;  // set digital pins 0-7 as inputs for now
-  #else
-    mega_data_input();
+
+  #if (HOSTCMD == 1)
+    Serial.end();  // DATA lines are needed for programming, this waits for pending output
+    session_end();  // a session left open by the host is closed, the button starts a new one
   #endif
-  digitalWrite(PAGEL, LOW);
-  digitalWrite(XA1, LOW);
-  digitalWrite(XA0, LOW);
-  digitalWrite(BS1, LOW);
-  digitalWrite(BS2, LOW);
-  digitalWrite(WR, LOW);  // ATtiny2313 needs this to be low to enter programming mode, ATmega doesn't care
-  digitalWrite(OE, LOW);
 
-  if(mode == HVSP) {
-    digitalWrite(SDI, LOW);  // set necessary pin values to enter programming mode
-    digitalWrite(SII, LOW);
-    pinMode(SDO, OUTPUT);    // SDO is same as RDY pin
-    digitalWrite(SDO, LOW);  // needs to be low to enter programming mode
-  }
+  #if (EE_CACHE == 1)
+    ee_background(0);  // Arduino EEPROM writes wait for the next idle time
+  #endif
 
-  // Enter programming mode
-  digitalWrite(VCC, HIGH);  // Apply VCC to start programming process
-  delayMicroseconds(80);
-  digitalWrite(RST, LOW);   // Apply 12V to !RESET
+  #if (STATS == 1)
+    cycle_start = millis();
+    STATS_ADD(cycles, 1);
+  #endif
 
-  if(mode == HVSP) {
-    // reset SDO after short delay, longer leads to logic contention because target sets SDO high after entering programming mode
-    delayMicroseconds(1);   // datasheet says 10us, 1us is needed to avoid drive contention on SDO
-    pinMode(SDO, INPUT);    // set to input to avoid logic contention
-  }
+  #if (JOURNAL == 1)
+    journal_cycle++;
+  #endif
 
-  delayMicroseconds(10);  // Give lots of time for part to enter programming mode
-  digitalWrite(OE, HIGH);
-  digitalWrite(WR, HIGH);   // Now that we're in programming mode we can disable !WR
-  delay(1);
+  #if (MACRO == 1)
+    if (macro_len > 0) {  // the stored macro replaces the fuse prompts
+      entry = macro_run();
+      Serial.begin(baud);
+      macro_report(entry);
+      #if (STATS == 1)
+        stats_cycle(millis() - cycle_start);
+        stats_dirty = 1;  // saved by idle_housekeeping while waiting for the button
+      #endif
+      return;
+    }
+  #endif
+
+  entry = session_begin();
+
+  if (entry == 0xFF) {  // the part didn't answer with any entry variant
+    Serial.begin(baud);
+    Serial.println("Could not enter programming mode, check the target AVR.");
+    #if (STATS == 1)
+      stats_cycle(millis() - cycle_start);
+      stats_dirty = 1;  // saved by idle_housekeeping while waiting for the button
+    #endif
+    return;
+  }
 
   /****
    **** Now we're in programming mode until RST is set HIGH again
    ****/
 
-  if (mode == HVSP) {
-    HVSP_read(HVSP_READ_LFUSE_DATA, HVSP_READ_LFUSE_INSTR1);
-    HVSP_read(0x00, HVSP_READ_LFUSE_INSTR2);
-    read_lfuse = HVSP_read(0x00, HVSP_READ_LFUSE_INSTR3);
-
-    HVSP_read(HVSP_READ_HFUSE_DATA, HVSP_READ_HFUSE_INSTR1);
-    HVSP_read(0x00, HVSP_READ_HFUSE_INSTR2);
-    read_hfuse = HVSP_read(0x00, HVSP_READ_HFUSE_INSTR3);
-
-    #if (BURN_EFUSE == 1)
-      HVSP_read(HVSP_READ_EFUSE_DATA, HVSP_READ_EFUSE_INSTR1);
-      HVSP_read(0x00, HVSP_READ_EFUSE_INSTR2);
-      read_efuse = HVSP_read(0x00, HVSP_READ_EFUSE_INSTR3);
-    #endif
-
-  } else {
+  #if (JOURNAL == 1)
+    journal_add(J_SIG, target_signature(1), target_signature(2));
+  #endif
 
-    // Get current fuse settings stored on target device
-    read_lfuse = fuse_read(LFUSE_SEL);
-    read_hfuse = fuse_read(HFUSE_SEL);
-    #if (BURN_EFUSE == 1)
-      read_efuse = fuse_read(EFUSE_SEL);
-    #endif
-  }
+  // Get current fuse settings stored on target device
+  read_lfuse = target_fuse_read(LFUSE_SEL);
+  read_hfuse = target_fuse_read(HFUSE_SEL);
+  #if (BURN_EFUSE == 1)
+    read_efuse = target_fuse_read(EFUSE_SEL);
+  #endif
 
   // Open serial port again to print fuse values
-  Serial.begin(BAUD);
+  Serial.begin(baud);
   Serial.print("\n");
+  if (entry != 0) {
+    Serial.print("Entered programming mode with entry variant ");
+    Serial.println(entry);
+  }
   Serial.println("Existing fuse values:");
   Serial.print("LFUSE: ");
   Serial.println(read_lfuse, HEX);
@@ -734,76 +3357,63 @@ void loop() {  // run over and over again
   // I found that sometimes the 1st fuse burn would fail.  It turns out that DATA1 (which doubles as Arduino serial
   // TX) was still toggling by the time the 1st XTAL strobe latches the fuse program command.  Bad news.
 
-  UCSR0A |= _BV(TXC0);  // Reset serial transmit complete flag (need to do this manually because TX interrupts aren't used by Arduino)
-  Serial.println("Burning fuses...");
-  while(!(UCSR0A & _BV(TXC0)));  // Wait for serial transmission to complete before burning fuses!
-
-  Serial.end();    // We're done with serial comms (for now) so disable UART
-
-  // Now burn desired fuses
-  // How we do this depends on which mode we're in
-  if (mode == HVSP) {
-    HVSP_write(HVSP_WRITE_LFUSE_DATA, HVSP_WRITE_LFUSE_INSTR1);
-    HVSP_write(lfuse, HVSP_WRITE_LFUSE_INSTR2);
-    HVSP_write(0x00, HVSP_WRITE_LFUSE_INSTR3);
-    HVSP_write(0x00, HVSP_WRITE_LFUSE_INSTR4);
-    while(digitalRead(SDO) == LOW);  // wait until burn is done
-
-    HVSP_write(HVSP_WRITE_HFUSE_DATA, HVSP_WRITE_HFUSE_INSTR1);
-    HVSP_write(hfuse, HVSP_WRITE_HFUSE_INSTR2);
-    HVSP_write(0x00, HVSP_WRITE_HFUSE_INSTR3);
-    HVSP_write(0x00, HVSP_WRITE_HFUSE_INSTR4);
-    while(digitalRead(SDO) == LOW);
+  // With the interrupt driven HVSP engine there's no need for this: HVSP doesn't use DATA0/DATA1, so the UART
+  // keeps running while the frames are clocked out.
+  // On the Leonardo the serial port is USB and doesn't touch DATA at all.
+  keep_serial = (LEONARDO == 1) || ((HVSP_ISR == 1) && (mode == HVSP));
 
-    #if (BURN_EFUSE == 1)
-      HVSP_write(HVSP_WRITE_EFUSE_DATA, HVSP_WRITE_EFUSE_INSTR1);
-      HVSP_write(efuse, HVSP_WRITE_EFUSE_INSTR2);
-      HVSP_write(0x00, HVSP_WRITE_EFUSE_INSTR3);
-      HVSP_write(0x00, HVSP_WRITE_EFUSE_INSTR4);
-      while(digitalRead(SDO) == LOW);
+  #if (LEONARDO == 0)
+    UCSR0A |= _BV(TXC0);  // Reset serial transmit complete flag (need to do this manually because TX interrupts aren't used by Arduino)
+  #endif
+  Serial.println("Burning fuses...");
+  if (!keep_serial) {
+    #if (LEONARDO == 0)
+      while(!(UCSR0A & _BV(TXC0)));  // Wait for serial transmission to complete before burning fuses!
     #endif
 
-    // Read back fuse contents to verify burn worked
-    HVSP_read(HVSP_READ_LFUSE_DATA, HVSP_READ_LFUSE_INSTR1);
-    HVSP_read(0x00, HVSP_READ_LFUSE_INSTR2);
-    read_lfuse = HVSP_read(0x00, HVSP_READ_LFUSE_INSTR3);
-    HVSP_read(HVSP_READ_HFUSE_DATA, HVSP_READ_HFUSE_INSTR1);
-    HVSP_read(0x00, HVSP_READ_HFUSE_INSTR2);
-    read_hfuse = HVSP_read(0x00, HVSP_READ_HFUSE_INSTR3);
+    Serial.end();    // We're done with serial comms (for now) so disable UART
+  }
+
+  // Now burn desired fuses, HFUSE first (the order used by the original HVPP sequence).  Fuses that already
+  // have the desired value are left alone, the others are read back to verify the burn worked.
+  read_hfuse = target_fuse_update(hfuse, HFUSE_SEL);
+  read_lfuse = target_fuse_update(lfuse, LFUSE_SEL);
+  #if (BURN_EFUSE == 1)
+    read_efuse = target_fuse_update(efuse, EFUSE_SEL);
+  #endif
 
+  #if (STATS == 1)
+    if (read_lfuse != lfuse)
+      STATS_ADD(verify_fail[LFUSE_SEL], 1);
+    if (read_hfuse != hfuse)
+      STATS_ADD(verify_fail[HFUSE_SEL], 1);
     #if (BURN_EFUSE == 1)
-      HVSP_read(HVSP_READ_EFUSE_DATA, HVSP_READ_EFUSE_INSTR1);
-      HVSP_read(0x00, HVSP_READ_EFUSE_INSTR2);
-      read_efuse = HVSP_read(0x00, HVSP_READ_EFUSE_INSTR3);
+      if (read_efuse != efuse)
+        STATS_ADD(verify_fail[EFUSE_SEL], 1);
     #endif
+  #endif
 
-    } else {
-    //delay(10);
-
-    // First, program HFUSE
-    fuse_burn(hfuse, HFUSE_SEL);
-
-    // Now, program LFUSE
-    fuse_burn(lfuse, LFUSE_SEL);
-
+  #if (JOURNAL == 1)
     #if (BURN_EFUSE == 1)
-      // Lastly, program EFUSE
-      fuse_burn(efuse, EFUSE_SEL);
+      journal_add(J_VERIFY, (read_lfuse != lfuse) | (read_hfuse != hfuse) << 1 | (read_efuse != efuse) << 2, 0);
+    #else
+      journal_add(J_VERIFY, (read_lfuse != lfuse) | (read_hfuse != hfuse) << 1, 0);
     #endif
+  #endif
 
-    // Read back fuse contents to verify burn worked
-    read_lfuse = fuse_read(LFUSE_SEL);
-    read_hfuse = fuse_read(HFUSE_SEL);
-
+  #if (SERIALIZE == 1)
+    // Write the serial number in the same programming session
+    serial_number = serial_next();
+    serial_ok = serial_write(serial_number);
     #if (BURN_EFUSE == 1)
-      read_efuse = fuse_read(EFUSE_SEL);
+      serial_log(serial_number, serial_ok, read_lfuse, read_hfuse, read_efuse);
+    #else
+      serial_log(serial_number, serial_ok, read_lfuse, read_hfuse, 0xFF);
     #endif
+  #endif
 
-    // Done verifying
-    digitalWrite(OE, HIGH);
-  }
-
-  Serial.begin(BAUD);  // open serial port
+  if (!keep_serial)
+    Serial.begin(baud);  // open serial port
   Serial.print("\n");  // flush out any garbage data on the link left over from programming
   Serial.print("Read LFUSE: ");
   Serial.println(read_lfuse, HEX);
@@ -813,26 +3423,21 @@ void loop() {  // run over and over again
     Serial.print("Read EFUSE: ");
     Serial.println(read_efuse, HEX);
   #endif
+  #if (SERIALIZE == 1)
+    Serial.print("Serial number: ");
+    Serial.print(serial_number, HEX);
+    Serial.println(serial_ok ? " verified" : " VERIFY FAILED");
+  #endif
   Serial.println("Burn complete.");
   Serial.print("\n");
   Serial.println("It is now safe to remove the target AVR.");
   Serial.print("\n");
 
   // All done, disable outputs
-  #if (MEGA == 0)  // Set up data lines on original Arduino
-    PORTD = 0x00;  // clear digital pins 0-7
-    DDRD = 0x00;  // set digital pins 0-7 as inputs for now
-  #else
-    mega_data_input();
+  session_end();
+
+  #if (STATS == 1)
+    stats_cycle(millis() - cycle_start);
+    stats_dirty = 1;  // saved by idle_housekeeping while waiting for the button
   #endif
-  digitalWrite(RST, HIGH);  // exit programming mode
-  delay(1);
-  digitalWrite(OE, LOW);
-  digitalWrite(WR, LOW);
-  digitalWrite(PAGEL, LOW);
-  digitalWrite(XA1, LOW);
-  digitalWrite(XA0, LOW);
-  digitalWrite(BS1, LOW);
-  digitalWrite(BS2, LOW);
-  digitalWrite(VCC, LOW);
 }
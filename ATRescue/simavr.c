@@ -0,0 +1,41 @@
+/*
+  simavr support, compiled only when SIMAVR is defined (add it to the C and C++ defined symbols).
+
+  The .mmcu section tells simavr which MCU and clock to simulate, so the firmware image runs with just
+  "simavr ATRescue.elf", and which registers to trace into atrescue.vcd:
+   - PORTB/PORTC/PORTD and DDRD: every control line and the DATA bus driven by the Arduino
+   - PINB: RDY/SDO from the target
+   - GPIOR0: markers written by the sketch when a bus primitive starts (marker id) and ends (id | 0x80),
+     see enum simmark in main.cpp, so each primitive can be timed cycle for cycle
+   - GPIOR1/GPIOR2: arguments of the primitive, written just before its marker
+
+  Run alone, nothing drives RDY/SDO or DATA, so waits for the target end in their timeouts.  host/simavr_rig.c
+  runs the image with the host target model on the port pins and UART0 on a pty.
+
+  Scripted run: build with SIM_SCRIPT defined as well and the sketch runs every target operation once in HVPP
+  and HVSP mode, then sleeps with interrupts off, which ends the simulation.  The GPIOR0 changes with the
+  GPIOR1/GPIOR2 values at that time are the logical bus trace.  The reference trace of this script, with the
+  bus events of a target model between the markers, is host/golden/script.trace; "make check" in host/
+  compares against it (see README.md).
+*/
+
+#ifdef SIMAVR
+
+#include <avr/io.h>
+#include <simavr/avr/avr_mcu_section.h>
+
+AVR_MCU(F_CPU, "atmega328p");
+AVR_MCU_VCD_FILE("atrescue.vcd", 1000);
+
+const struct avr_mmcu_vcd_trace_t atrescue_trace[] _MMCU_ = {
+  { AVR_MCU_VCD_SYMBOL("PORTB"), .what = (void *) &PORTB, },
+  { AVR_MCU_VCD_SYMBOL("PORTC"), .what = (void *) &PORTC, },
+  { AVR_MCU_VCD_SYMBOL("PORTD"), .what = (void *) &PORTD, },
+  { AVR_MCU_VCD_SYMBOL("DDRD"), .what = (void *) &DDRD, },
+  { AVR_MCU_VCD_SYMBOL("PINB"), .what = (void *) &PINB, },
+  { AVR_MCU_VCD_SYMBOL("GPIOR0"), .what = (void *) &GPIOR0, },
+  { AVR_MCU_VCD_SYMBOL("GPIOR1"), .what = (void *) &GPIOR1, },
+  { AVR_MCU_VCD_SYMBOL("GPIOR2"), .what = (void *) &GPIOR2, },
+};
+
+#endif
@@ -0,0 +1,91 @@
+/*
+  Arduino core of the host simulation (sim.cpp), for building the sketch on a PC.
+
+  It provides only what the sketch needs, for the Uno, the Mega or the Leonardo (SIM_BOARD):
+   - pinMode, digitalWrite, digitalRead, delay, delayMicroseconds, millis, micros: advance the virtual clock by
+     what they take on the board (sim_costs), the pin changes where the real core changes it
+   - Serial: UART (Uno, Mega) owning D0/D1 while open, or USB (Leonardo), fed from the --input chunks
+   - the I/O registers of avr/io.h, EEPROM, and the shield with a target model in each socket
+*/
+
+#ifndef SIM_ARDUINO_H
+#define SIM_ARDUINO_H
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <binary.h>
+
+#define SIM_UNO       0
+#define SIM_MEGA      1
+#define SIM_LEONARDO  2
+
+#ifndef SIM_BOARD
+  #define SIM_BOARD  SIM_UNO
+#endif
+
+typedef uint8_t byte;
+typedef uint16_t word;
+typedef bool boolean;
+
+#define HIGH          1
+#define LOW           0
+#define INPUT         0
+#define OUTPUT        1
+#define INPUT_PULLUP  2
+
+#define DEC  10
+#define HEX  16
+
+#if (SIM_BOARD == SIM_MEGA)
+  #define A0  54
+#elif (SIM_BOARD == SIM_LEONARDO)
+  #define A0  18
+#else
+  #define A0  14
+#endif
+#define A1  (A0 + 1)
+#define A2  (A0 + 2)
+#define A3  (A0 + 3)
+#define A4  (A0 + 4)
+#define A5  (A0 + 5)
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+unsigned long millis(void);
+unsigned long micros(void);
+
+class SimSerial {  // Serial port 0 (Uno, Mega) or USB CDC (Leonardo)
+public:
+  void begin(unsigned long baud);
+  void end(void);
+  int available(void);
+  int read(void);
+  void flush(void);
+  operator bool() { return true; }
+
+  size_t write(uint8_t c);
+  size_t write(const uint8_t *buf, size_t len);
+
+  size_t print(const char *s);
+  size_t print(char c) { return write(c); }
+  size_t print(unsigned long n, int base = DEC);
+  size_t print(long n, int base = DEC);
+  size_t print(unsigned int n, int base = DEC) { return print((unsigned long) n, base); }
+  size_t print(int n, int base = DEC) { return print((long) n, base); }
+  size_t print(unsigned char n, int base = DEC) { return print((unsigned long) n, base); }
+
+  size_t println(void) { return print("\r\n"); }
+  template <typename T> size_t println(T v) { return print(v) + println(); }
+  template <typename T> size_t println(T v, int base) { return print(v, base) + println(); }
+};
+
+extern SimSerial Serial;
+
+#endif
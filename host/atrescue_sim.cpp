@@ -0,0 +1,267 @@
+/*
+  Host simulation harness: runs the sketch (main.cpp) against the target model and reports the result.
+
+  atrescue_sim [options]
+    --part NAME          part in the shield (default atmega328p): atmega328p atmega168 attiny2313 attiny85 attiny13;
+                         one for each mode may be given, the part for the sketch's mode is in the shield
+    --input TEXT         what the host types, chunks separated by '|', each sent when the sketch waits for input
+    --pty                the host link is a pseudo terminal instead, its name printed as "pty /dev/pts/N" first:
+                         host tools (plan.py) talk to the sketch as to a board, no button is pressed and the run
+                         goes on until killed (or --limit); idle, virtual time keeps pace with real time
+    --latency MS         pty: latency timer of the USB serial bridge, short replies are held that long (default 0)
+    --max-baud N         pty: fastest rate the bridge takes, above it about one byte in 16 is garbled (default any)
+    --cycles N           button presses, loop() runs once for each (default 1)
+    --timing S,X,O,W     bus timing in us: SCI half period, strobe, !OE to read, !WR pulse (timing_t)
+    --entry V,S,T,C      entry variant 0 of every mode: vcc_to_hv, sdo_release, settle (us), cmd_wait (ms)
+    --baud N             serial rate
+    --costs NAME         arduino (default) or baremetal: time taken by the core calls
+    --vcc-rise US        VCC pin high to the target powered, starts the 20-60 us window (default 40)
+    --sdo-drive US       12V to the target driving SDO (default 10)
+    --expect F=XX,...    fuses and lock bits the target must end with, ie. L=62,H=DF,E=FF,lock=FF
+    --trace FILE         GPIOR0 markers with their arguments and the bus events of the parts ("@ ..."), '-' = stdout
+    --trace-time         prefix the markers with their time, in us
+    --serial             copy the serial output to stdout
+    --checks             print the timing checks
+    --limit S            virtual time limit, in s (default 60)
+
+  The last line is "result ok=.. time_us=.. cycle_us=.. session_us=.. link_down_us=.. margin=.. worst=..
+  entry_margin=.. entry_worst=.. bus_margin=.. bus_worst=.. violations=..": ok is 1 when the run ended normally with
+  the --expect values, session_us the time the target was powered, link_down_us the time the host link was closed
+  between Serial.end() and Serial.begin() (0 on the Leonardo, whose USB link stays open), margin the smallest slack of a datasheet figure relative to
+  the figure and worst that figure (over all figures, the entry sequence ones, the bus ones), over all parts.  The
+  --expect values are those of the part for the mode the sketch ends in.  Exit status 0 when ok and no figure was
+  violated.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pty.h"
+#include "sim.h"
+#include "sketch.h"
+
+static tm_target parts[3];  // at most one for each mode
+static int nparts;
+
+static void usage(const char *msg) {
+  fprintf(stderr, "atrescue_sim: %s (see the comment at the top of atrescue_sim.cpp)\n", msg);
+  exit(2);
+}
+
+static int numbers(const char *s, unsigned long *v, int n) {  // Comma separated numbers, returns the count
+  char *end;
+  int i;
+
+  for (i = 0; i < n && *s; i++) {
+    v[i] = strtoul(s, &end, 0);
+    if (end == s || (*end && *end != ','))
+      return -1;
+    s = *end ? end + 1 : end;
+  }
+  return *s ? -1 : i;
+}
+
+static int expect_met(const char *expect) {  // 1 if the part for the sketch's mode holds the --expect values
+  const tm_target &target = (mode < 3 && sim_socket[mode]) ? *sim_socket[mode] : parts[0];
+  char buf[128], *item;
+
+  snprintf(buf, sizeof(buf), "%s", expect);
+  for (item = strtok(buf, ","); item; item = strtok(NULL, ",")) {
+    char *eq = strchr(item, '=');
+    unsigned long v;
+    uint8_t got;
+
+    if (!eq)
+      usage("bad --expect");
+    *eq = 0;
+    v = strtoul(eq + 1, NULL, 16);
+    if (!strcmp(item, "L"))
+      got = target.fuse[0];
+    else if (!strcmp(item, "H"))
+      got = target.fuse[1];
+    else if (!strcmp(item, "E"))
+      got = target.fuse[2];
+    else if (!strcmp(item, "lock"))
+      got = target.lock;
+    else
+      usage("bad --expect");
+    if (got != v) {
+      fprintf(stderr, "expected %s=%02lX, target has %02X\n", item, v, got);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void print_checks(void) {
+  for (int p = 0; p < nparts; p++) {
+    printf("%-12s %10s %8s %12s %10s\n", parts[p].part->name, "limit_ns", "count", "worst_ns", "violations");
+    for (int i = 0; i < TM_CHECKS; i++) {
+      const tm_stat *s = &parts[p].stat[i];
+      if (s->count)
+        printf("%-12s %s%9lu %8lu %12lld %10lu\n", tm_limits[i].name, tm_limits[i].max ? "<" : ">",
+               (unsigned long) tm_limit_ns(&parts[p], i), s->count, (long long) s->worst, s->violations);
+    }
+  }
+}
+
+static void print_margin(const char *prefix, int first, int last) {  // "margin=.. worst=.." of the result line
+  int worst = -1, check;
+  double margin = 1e9, m;
+
+  for (int p = 0; p < nparts; p++) {
+    m = tm_margin(&parts[p], first, last, &check);
+    if (check >= 0 && m < margin) {
+      margin = m;
+      worst = check;
+    }
+  }
+  if (worst < 0)
+    printf(" %smargin=- %sworst=-", prefix, prefix);
+  else
+    printf(" %smargin=%.3f %sworst=%s", prefix, margin, prefix, tm_limits[worst].name);
+}
+
+int main(int argc, char **argv) {
+  const char *names[3] = { "atmega328p" }, *expect = NULL, *trace = NULL, *why = "done";
+  unsigned long cycles = 1, v[4], violations = 0;
+  uint32_t vcc_rise = 40000, sdo_drive = 10000;
+  bool checks = false, pty = false, limit = false;
+  uint64_t start, cycle_ns = 0;
+  int ok;
+
+  for (int i = 1; i < argc; i++) {
+    const char *opt = argv[i], *arg = (i + 1 < argc) ? argv[i + 1] : NULL;
+    bool takes_arg = true;
+
+    if (!strcmp(opt, "--trace-time") || !strcmp(opt, "--serial") || !strcmp(opt, "--checks") ||
+        !strcmp(opt, "--pty")) {
+      takes_arg = false;
+      sim_trace_time |= !strcmp(opt, "--trace-time");
+      checks |= !strcmp(opt, "--checks");
+      pty |= !strcmp(opt, "--pty");
+      if (!strcmp(opt, "--serial"))
+        sim_echo = stdout;
+    } else if (!arg) {
+      usage("missing argument");
+    } else if (!strcmp(opt, "--part")) {
+      if (nparts == 3)
+        usage("too many parts");
+      names[nparts++] = arg;
+    } else if (!strcmp(opt, "--input")) {
+      char buf[256], *chunk;
+      snprintf(buf, sizeof(buf), "%s", arg);
+      for (chunk = strtok(buf, "|"); chunk; chunk = strtok(NULL, "|"))
+        sim_input(chunk);
+    } else if (!strcmp(opt, "--cycles")) {
+      cycles = strtoul(arg, NULL, 0);
+    } else if (!strcmp(opt, "--timing")) {
+      if (numbers(arg, v, 4) != 4)
+        usage("bad --timing");
+      timing.sclk = v[0];
+      timing.strobe = v[1];
+      timing.oe = v[2];
+      timing.wr = v[3];
+    } else if (!strcmp(opt, "--entry")) {
+      if (numbers(arg, v, 4) != 4 || v[0] > 255 || v[1] > 255 || v[2] > 255 || v[3] > 255)
+        usage("bad --entry");
+      for (int m = 0; m < 3; m++)
+        entry_profiles[m][0] = (entry_profile) { (byte) v[0], (byte) v[1], (byte) v[2], (byte) v[3] };
+    } else if (!strcmp(opt, "--baud")) {
+      baud = strtoul(arg, NULL, 0);
+    } else if (!strcmp(opt, "--costs")) {
+      if (!strcmp(arg, "arduino"))
+        sim_cost = sim_costs_arduino;
+      else if (!strcmp(arg, "baremetal"))
+        sim_cost = sim_costs_baremetal;
+      else
+        usage("bad --costs");
+    } else if (!strcmp(opt, "--vcc-rise")) {
+      vcc_rise = strtoul(arg, NULL, 0) * 1000;
+    } else if (!strcmp(opt, "--sdo-drive")) {
+      sdo_drive = strtoul(arg, NULL, 0) * 1000;
+    } else if (!strcmp(opt, "--latency")) {
+      sim_latency = strtoull(arg, NULL, 0) * 1000000ULL;
+    } else if (!strcmp(opt, "--max-baud")) {
+      sim_max_baud = strtoul(arg, NULL, 0);
+    } else if (!strcmp(opt, "--expect")) {
+      expect = arg;
+    } else if (!strcmp(opt, "--trace")) {
+      trace = arg;
+    } else if (!strcmp(opt, "--limit")) {
+      sim_limit = strtoull(arg, NULL, 0) * 1000000000ULL;
+      limit = true;
+    } else {
+      usage("unknown option");
+    }
+    if (takes_arg)
+      i++;
+  }
+
+  if (pty) {
+    char name[64];
+
+    if ((sim_pty = pty_open(name, sizeof(name))) < 0)
+      usage("can't open a pty");
+    printf("pty %s\n", name);
+    fflush(stdout);
+    if (!limit)
+      sim_limit = UINT64_MAX;
+  }
+  if (trace) {
+    sim_trace = strcmp(trace, "-") ? fopen(trace, "w") : stdout;
+    if (!sim_trace)
+      usage("can't write the trace");
+  }
+  if (nparts == 0)
+    nparts = 1;
+  for (int p = 0; p < nparts; p++) {
+    const tm_part *part = tm_find_part(names[p]);
+    if (!part)
+      usage("unknown part");
+    tm_init(&parts[p], part);
+    parts[p].log = sim_trace;
+    parts[p].vcc_rise = vcc_rise;
+    parts[p].sdo_drive = sdo_drive;
+    if (nparts == 1) {  // in the shield whatever the mode
+      sim_socket[0] = sim_socket[1] = sim_socket[2] = &parts[0];
+    } else {
+      if (sim_socket[part->family])
+        usage("two parts for one mode");
+      sim_socket[part->family] = &parts[p];
+    }
+  }
+
+  try {
+    setup();
+    for (unsigned long c = 0; c < cycles; c++) {
+      start = sim_now;
+      if (!pty)
+        sim_button(sim_now, sim_now + 500000000ULL);  // pressed for 500 ms
+      loop();
+      cycle_ns += sim_now - start;
+    }
+  } catch (sim_end &e) {
+    why = e.why;
+  }
+  if (sim_echo)
+    fflush(sim_echo);
+
+  ok = strcmp(why, "time limit") != 0 && (!expect || expect_met(expect));
+  if (!ok && strcmp(why, "done"))
+    fprintf(stderr, "run ended: %s\n", why);
+  if (checks)
+    print_checks();
+  printf("result ok=%d time_us=%llu cycle_us=%llu session_us=%llu link_down_us=%llu", ok,
+         (unsigned long long) (sim_now / 1000), (unsigned long long) (cycles ? cycle_ns / cycles / 1000 : 0),
+         (unsigned long long) (sim_vcc_ns / 1000), (unsigned long long) (sim_link_down_ns / 1000));
+  print_margin("", 0, TM_CHECKS - 1);
+  print_margin("entry_", TM_VCC_HV_MIN, TM_SDO_RELEASE);
+  print_margin("bus_", TM_XHXL, TM_SHOV);
+  for (int p = 0; p < nparts; p++)
+    violations += tm_violations(&parts[p]);
+  printf(" violations=%lu\n", violations);
+  if (sim_trace && sim_trace != stdout)
+    fclose(sim_trace);
+  return ok && !violations ? 0 : 1;
+}
@@ -0,0 +1,18 @@
+/*
+  Arduino EEPROM of the host simulation, blank (0xFF) at the start of a run.  A byte that changes takes the
+  3.4 ms write time of the part.
+*/
+
+#ifndef SIM_AVR_EEPROM_H
+#define SIM_AVR_EEPROM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint8_t eeprom_read_byte(const uint8_t *addr);
+void eeprom_write_byte(uint8_t *addr, uint8_t value);
+void eeprom_update_byte(uint8_t *addr, uint8_t value);
+void eeprom_read_block(void *dst, const void *src, size_t n);
+void eeprom_update_block(const void *src, void *dst, size_t n);
+
+#endif
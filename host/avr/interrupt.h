@@ -0,0 +1,13 @@
+/*
+  Interrupt control of the host simulation: only the I flag in SREG, nothing interrupts the sketch.
+*/
+
+#ifndef SIM_AVR_INTERRUPT_H
+#define SIM_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+#define cli()  (SREG &= (uint8_t) ~_BV(SREG_I))
+#define sei()  (SREG |= _BV(SREG_I))
+
+#endif
@@ -0,0 +1,99 @@
+/*
+  I/O registers of the host simulation.  Every access goes through sim.cpp, which charges its time and passes the
+  pin levels on to the target model.  Only the registers the sketch uses are provided.
+*/
+
+#ifndef SIM_AVR_IO_H
+#define SIM_AVR_IO_H
+
+#include <stdint.h>
+
+#define _BV(bit)  (1 << (bit))
+
+enum sim_regid {  // PINx, DDRx, PORTx of each port, then the other registers
+  SIM_PINB, SIM_DDRB, SIM_PORTB, SIM_PINC, SIM_DDRC, SIM_PORTC, SIM_PIND, SIM_DDRD, SIM_PORTD,
+  SIM_PINE, SIM_DDRE, SIM_PORTE, SIM_PINF, SIM_DDRF, SIM_PORTF, SIM_PING, SIM_DDRG, SIM_PORTG,
+  SIM_PINH, SIM_DDRH, SIM_PORTH,
+  SIM_SREG, SIM_UCSR0A, SIM_GPIOR0, SIM_GPIOR1, SIM_GPIOR2, SIM_MCUSR,
+  SIM_REGS
+};
+
+uint8_t sim_reg_read(uint8_t id);
+void sim_reg_write(uint8_t id, uint8_t value);
+
+class sim_reg {  // an 8 bit I/O register
+public:
+  explicit sim_reg(uint8_t id) : id(id) {}
+  operator uint8_t() const { return sim_reg_read(id); }
+  sim_reg &operator=(uint8_t v) { sim_reg_write(id, v); return *this; }
+  sim_reg &operator=(const sim_reg &r) { sim_reg_write(id, (uint8_t) r); return *this; }
+  sim_reg &operator|=(int v) { sim_reg_write(id, sim_reg_read(id) | v); return *this; }
+  sim_reg &operator&=(int v) { sim_reg_write(id, sim_reg_read(id) & v); return *this; }
+  sim_reg &operator^=(int v) { sim_reg_write(id, sim_reg_read(id) ^ v); return *this; }
+
+private:
+  uint8_t id;
+};
+
+extern sim_reg PINB, DDRB, PORTB, PINC, DDRC, PORTC, PIND, DDRD, PORTD, PINE, DDRE, PORTE, PINF, DDRF, PORTF;
+extern sim_reg PING, DDRG, PORTG, PINH, DDRH, PORTH, SREG, UCSR0A, GPIOR0, GPIOR1, GPIOR2, MCUSR;
+
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+#define PC0 0
+#define PC1 1
+#define PC2 2
+#define PC3 3
+#define PC4 4
+#define PC5 5
+#define PC6 6
+#define PC7 7
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+#define PE0 0
+#define PE1 1
+#define PE2 2
+#define PE3 3
+#define PE4 4
+#define PE5 5
+#define PE6 6
+#define PE7 7
+#define PF0 0
+#define PF1 1
+#define PF2 2
+#define PF3 3
+#define PF4 4
+#define PF5 5
+#define PF6 6
+#define PF7 7
+#define PG0 0
+#define PG1 1
+#define PG2 2
+#define PG3 3
+#define PG4 4
+#define PG5 5
+#define PH0 0
+#define PH1 1
+#define PH2 2
+#define PH3 3
+#define PH4 4
+#define PH5 5
+#define PH6 6
+#define PH7 7
+
+#define TXC0  6   // UCSR0A
+#define SREG_I  7
+
+#endif
@@ -0,0 +1,14 @@
+/*
+  Sleep of the host simulation: sleep_cpu() with interrupts off never wakes up, it ends the run (sim_end).
+*/
+
+#ifndef SIM_AVR_SLEEP_H
+#define SIM_AVR_SLEEP_H
+
+void sim_sleep(void);
+
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu()  sim_sleep()
+
+#endif
@@ -0,0 +1,14 @@
+/*
+  Watchdog of the host simulation: never runs (WATCHDOG must be 0, see config/check.h).
+*/
+
+#ifndef SIM_AVR_WDT_H
+#define SIM_AVR_WDT_H
+
+#define WDTO_1S  6
+
+#define wdt_reset()
+#define wdt_disable()
+#define wdt_enable(timeout)
+
+#endif
@@ -0,0 +1,207 @@
+#!/usr/bin/env python3
+"""
+Golden trace regression check over the host simulation.
+
+Every case runs the sketch against the target model at several timing corners, the loop() cycles on each board.  The trace of a run (GPIOR0
+markers with their arguments, and the bus events as the part takes them: loads, latches, writes, reads, HVSP
+frames) carries no time stamps, so it must be the same at every corner and equal to the reference in golden/.
+A case fails when its trace diverges from the reference, when the fuses don't come out as burned, or when a
+datasheet figure is violated.  The Mega and Leonardo shims must give the Uno traces, and on the Leonardo the host
+link (USB) must stay open all along.
+
+The host tools then run against atrescue_sim_hostcmd over its pty, in real time (a few seconds): plan.py takes an
+ATtiny13 through PLANS, one run after the other on the same part, and must print the expected plan every time.
+linktune.py then tunes a link with an FTDI like latency timer that can't go over 1000000 baud (TUNE): it must see
+the latency, fail 230400 (3.5% off at 16 MHz) and 2000000, and plan.py must write a whole ATtiny13 at the rate and
+window it picked.
+
+  python3 check.py             run every case (make check)
+  python3 check.py --update    rewrite golden/ from the Uno at the default corner, after an intended protocol change
+"""
+
+import argparse
+import difflib
+import os
+import re
+import subprocess
+import sys
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+GOLDEN = os.path.join(HERE, "golden")
+
+CYCLES = [  # reference, arguments
+  ("cycle_hvpp", ["--part", "atmega328p", "--input", "1|0xE2|0xDE", "--expect", "L=E2,H=DE"]),
+  ("cycle_tiny2313", ["--part", "attiny2313", "--input", "2|0xE4|0xDE", "--expect", "L=E4,H=DE"]),
+  ("cycle_hvsp", ["--part", "attiny85", "--input", "3|0xE2|0xDE", "--expect", "L=E2,H=DE"]),
+]
+
+BOARDS = [  # board, simulation, host link always open
+  ("uno", "atrescue_sim", False),
+  ("mega", "atrescue_sim_mega", False),
+  ("leonardo", "atrescue_sim_leonardo", True),
+]
+
+CASES = [("script", "uno", "atrescue_sim_script", ["--part", "atmega328p", "--part", "attiny85"], False)] + [
+  (name, board, sim, args, link) for board, sim, link in BOARDS for name, args in CYCLES]  # reference, board, ...
+
+CORNERS = [  # timing corners, the first one writes the reference
+  ("default", []),
+  ("fast", ["--timing", "0,0,0,0", "--entry", "70,0,10,1", "--vcc-rise", "30"]),
+  ("baremetal", ["--costs", "baremetal", "--timing", "1,1,1,1", "--vcc-rise", "50"]),
+]
+
+PAGES = ["page 0000", "page 0010", "page 0020", "page 0030"]
+
+PLANS = [  # plan.py arguments (images in build/), the plan it must print
+  (["--flash", "a.hex", "--eeprom", "e.hex", "--fuses", "H=FB", "--lock", "FE"],  # blank part: no erase
+   PAGES + ["ee: 7 bytes", "fuse h FB", "check the flash and EEPROM CRC", "lock FE"]),
+  (["--flash", "a.hex", "--eeprom", "e.hex", "--fuses", "H=FB", "--lock", "FE"], []),  # nothing differs
+  (["--flash", "b.hex", "--lock", "FE"],  # lock mode 2: erase, the EEPROM is saved and written back
+   ["erase: EEPROM saved (EESAVE blocked by the lock bits)"] + PAGES + ["ee: 7 bytes", "check the flash and EEPROM CRC",
+                                                                        "lock FE"]),
+  (["--flash", "b.hex", "--eeprom", "e.hex", "--fuses", "L=6A,H=FB"], []),
+  (["--flash", "a.hex", "--lock", "FF"],  # clearing the lock bits: erase, EEPROM saved
+   ["erase: EEPROM saved (EESAVE blocked by the lock bits)"] + PAGES + ["ee: 7 bytes", "check the flash and EEPROM CRC"]),
+  (["--flash", "b.hex"], ["erase keep: EEPROM kept with EESAVE"] + PAGES + ["check the flash CRC"]),
+  (["--flash", "b.hex", "--eeprom", "e.hex", "--lock", "FF"], []),
+]
+
+TUNE = (["--latency", "16", "--max-baud", "1000000"], "230400,1000000,2000000", 1000000)  # link, rates, best
+
+
+def write_hex(path, data):  # Intel HEX, 16 bytes per record
+  with open(path, "w") as f:
+    for addr in range(0, len(data), 16):
+      record = bytes([len(data[addr:addr + 16]), addr >> 8, addr & 0xFF, 0]) + data[addr:addr + 16]
+      f.write(":%s%02X\n" % (record.hex().upper(), -sum(record) & 0xFF))
+    f.write(":00000001FF\n")
+
+
+def run(sim, args):  # trace lines, the result line and its fields
+  trace = os.path.join(HERE, "build", "check.trace")
+  proc = subprocess.run([os.path.join(HERE, sim), "--trace", trace] + args, capture_output=True, text=True)
+  with open(trace) as f:
+    lines = f.read().splitlines()
+  result = proc.stdout.splitlines()[-1] if proc.stdout else "no result"
+  fields = dict(f.split("=", 1) for f in result.split()[1:]) if result.startswith("result") else {}
+  return proc.returncode, lines, result, fields, proc.stderr.strip()
+
+
+def main():
+  parser = argparse.ArgumentParser(description="Golden trace regression check over the host simulation")
+  parser.add_argument("--update", action="store_true", help="rewrite the reference traces")
+  args = parser.parse_args()
+
+  os.makedirs(os.path.join(HERE, "build"), exist_ok=True)
+  failed = 0
+  for name, board, sim, case_args, link in CASES:
+    golden = os.path.join(GOLDEN, name + ".trace")
+    for corner, corner_args in CORNERS:
+      status, lines, result, fields, errors = run(sim, case_args + corner_args)
+      problem = None
+      if status != 0:
+        problem = "%s%s" % (result, ("\n    " + errors) if errors else "")
+      elif link and fields.get("link_down_us") != "0":
+        problem = "host link closed for %s us" % fields.get("link_down_us")
+      elif args.update and corner == CORNERS[0][0] and board == "uno":
+        with open(golden, "w") as f:
+          f.write("\n".join(lines) + "\n")
+      else:
+        with open(golden) as f:
+          reference = f.read().splitlines()
+        if lines != reference:
+          diff = list(difflib.unified_diff(reference, lines, "golden/" + name + ".trace", corner, n=2, lineterm=""))
+          problem = "trace diverges:\n    " + "\n    ".join(diff[:20])
+      print("%-16s %-9s %-10s %s" % (name, board, corner, "FAIL " + problem if problem else "ok (%d events)" % len(lines)))
+      failed += problem is not None
+  if not args.update:
+    failed += plans()
+    failed += tune()
+  if failed:
+    sys.exit("%d run(s) failed" % failed)
+
+
+def plans():  # plan.py against the simulation, the number of runs that failed
+  build = os.path.join(HERE, "build")
+  write_hex(os.path.join(build, "a.hex"), bytes(range(100)))
+  write_hex(os.path.join(build, "b.hex"), bytes(range(1, 101)))
+  write_hex(os.path.join(build, "e.hex"), b"EEPROM!")
+  sim = subprocess.Popen([os.path.join(HERE, "atrescue_sim_hostcmd"), "--pty", "--part", "attiny13"],
+                         stdout=subprocess.PIPE, text=True)
+  failed = 0
+  try:
+    port = sim.stdout.readline().split()[1]
+    for number, (plan_args, expected) in enumerate(PLANS, 1):
+      start = time.monotonic()
+      cmd = ["python3", os.path.join(HERE, "plan.py"), "--port", port, "--baud", "115200", "--mode", "hvsp"]
+      proc = subprocess.run(cmd + [os.path.join(build, a) if a.endswith(".hex") else a for a in plan_args],
+                            capture_output=True, text=True, timeout=60)
+      lines = proc.stdout.splitlines()
+      steps = [line[2:] for line in lines if line.startswith("  ")]
+      problem = None
+      if proc.returncode:
+        problem = proc.stderr.strip()
+      elif steps != expected:
+        problem = "plan differs:\n    " + "\n    ".join(lines)
+      print("%-16s %-9s %-10s %s" % ("plan %d" % number, "uno", "pty", "FAIL " + problem if problem else
+                                     "ok (%d steps, %.1f s)" % (len(steps), time.monotonic() - start)))
+      failed += problem is not None
+  finally:
+    sim.kill()
+    sim.wait()
+  return failed
+
+
+def tune():  # linktune.py, then plan.py at what it picked, the number of runs that failed
+  build = os.path.join(HERE, "build")
+  link_args, rates, best = TUNE
+  image = bytes((i * 7) & 0xFF for i in range(1024))  # the whole flash
+  write_hex(os.path.join(build, "c.hex"), image)
+  sim = subprocess.Popen([os.path.join(HERE, "atrescue_sim_hostcmd"), "--pty", "--part", "attiny13"] + link_args,
+                         stdout=subprocess.PIPE, text=True)
+  failed = 0
+  try:
+    port = sim.stdout.readline().split()[1]
+    start = time.monotonic()
+    proc = subprocess.run(["python3", os.path.join(HERE, "linktune.py"), "--port", port, "--baud", "115200",
+                           "--rates", rates, "--apply"], capture_output=True, text=True, timeout=60)
+    lines = proc.stdout.splitlines()
+    latency = re.search(r"bridge latency (-?[\d.]+) ms", proc.stdout)
+    picked = re.fullmatch(r"--baud (\d+) --window (\d+)", lines[-1]) if lines else None
+    failing = [line.split(":")[0].strip() for line in lines if "FAIL" in line]
+    problem = None
+    if proc.returncode:
+      problem = proc.stderr.strip()
+    elif not latency or float(latency.group(1)) < 10:
+      problem = "latency timer not seen:\n    " + "\n    ".join(lines)
+    elif not picked or int(picked.group(1)) != best or not int(picked.group(2)) or failing != ["230400", "2000000"]:
+      problem = "tuned differently:\n    " + "\n    ".join(lines)
+    print("%-16s %-9s %-10s %s" % ("linktune", "uno", "pty", "FAIL " + problem if problem else
+                                   "ok (%s, %.1f s)" % (lines[-1], time.monotonic() - start)))
+    failed += problem is not None
+    if problem:
+      return failed
+
+    start = time.monotonic()
+    cmd = ["python3", os.path.join(HERE, "plan.py"), "--port", port, "--mode", "hvsp", "--flash",
+           os.path.join(build, "c.hex")] + lines[-1].split()
+    proc = subprocess.run(cmd, capture_output=True, text=True, timeout=60)
+    steps = [line[2:] for line in proc.stdout.splitlines() if line.startswith("  ")]
+    expected = ["page %04X" % page for page in range(0, 512, 16)] + ["check the flash CRC"]
+    problem = None
+    if proc.returncode:
+      problem = proc.stderr.strip()
+    elif steps != expected:
+      problem = "plan differs:\n    " + "\n    ".join(proc.stdout.splitlines())
+    print("%-16s %-9s %-10s %s" % ("plan window", "uno", "pty", "FAIL " + problem if problem else
+                                   "ok (%d steps, %.1f s)" % (len(steps), time.monotonic() - start)))
+    failed += problem is not None
+  finally:
+    sim.kill()
+    sim.wait()
+  return failed
+
+
+if __name__ == "__main__":
+  main()
@@ -0,0 +1,11 @@
+/*
+  Included last by every configuration: settings the host simulation can't run.
+*/
+
+#if ((WATCHDOG == 1) || (HVSP_ISR == 1) || (HVSP_FAST == 1) || (BENCH == 1) || (EE_CACHE == 1))
+  #error "The host simulation has no timers, watchdog or EEPROM interrupt: WATCHDOG, HVSP_ISR, HVSP_FAST, BENCH and EE_CACHE must be 0"
+#endif
+
+#if ((MEGA == 1) != (SIM_BOARD == SIM_MEGA)) || ((LEONARDO == 1) != (SIM_BOARD == SIM_LEONARDO))
+  #error "MEGA/LEONARDO don't match the simulated board (SIM_BOARD)"
+#endif
@@ -0,0 +1,21 @@
+/*
+  Arduino Uno with host commands for the host tools (plan.py) over --pty: no mode question, 115200 baud and the
+  fast bus timing sweep.py finds reliable, so a tool run takes seconds rather than minutes of real time.
+*/
+
+#undef  ASKMODE
+#define ASKMODE   0
+#undef  HOSTCMD
+#define HOSTCMD   1
+#undef  BAUD
+#define BAUD      115200
+#undef  T_SCLK
+#define T_SCLK    1
+#undef  T_STROBE
+#define T_STROBE  1
+#undef  T_OE
+#define T_OE      1
+#undef  T_WR
+#define T_WR      1
+
+#include "check.h"
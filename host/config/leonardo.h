@@ -0,0 +1,8 @@
+/*
+  Arduino Leonardo, settings as shipped otherwise.
+*/
+
+#undef  LEONARDO
+#define LEONARDO  1
+
+#include "check.h"
@@ -0,0 +1,8 @@
+/*
+  Arduino Mega, settings as shipped otherwise.
+*/
+
+#undef  MEGA
+#define MEGA  1
+
+#include "check.h"
@@ -0,0 +1,7 @@
+/*
+  Arduino Uno, SIM_SCRIPT: setup() runs every target operation once in HVPP and HVSP mode, then ends the run.
+*/
+
+#define SIM_SCRIPT
+
+#include "check.h"
@@ -0,0 +1,5 @@
+/*
+  Arduino Uno, settings as shipped: mode question and fuse prompts on the serial port.
+*/
+
+#include "check.h"
@@ -0,0 +1,127 @@
+"""
+Serial link to the sketch's host commands (HOSTCMD), for the host tools (plan.py).  Works with a board
+(/dev/ttyACM0, /dev/ttyUSB0) as with the simulation (atrescue_sim_hostcmd --pty), through termios only.
+
+  link = Link("/dev/ttyACM0", 115200, window=120)
+  link.sync()                       handshake of "Connecting without a reset" in README.md
+  link.command("fuse h")            ["DF"]: a command and the lines it replies
+  link.command("erase", replies=0)  a command without a reply, waits until it is done
+  link.send("buf 0 0C94...")        a command without a reply that doesn't use the bus, not waited for
+
+The Uno closes its serial port while the HVPP bus runs, so anything sent then is lost: a command is only sent once
+the previous one has replied.  Commands without a reply are followed by "ping <n>", sent again until "pong <n>"
+comes back.  send() only waits that way once more than window bytes went out unanswered; linktune.py measures
+how many the board takes.
+"""
+
+import os
+import select
+import termios
+import time
+import tty
+
+
+class LinkError(Exception):
+  pass
+
+
+class Link:
+  def __init__(self, port, baud=9600, window=0):
+    self.fd = os.open(port, os.O_RDWR | os.O_NOCTTY)
+    self.buf = b""
+    self.token = 0
+    self.window = window
+    self.ahead = 0  # bytes sent since the last reply
+    tty.setraw(self.fd)
+    attrs = termios.tcgetattr(self.fd)
+    attrs[2] &= ~termios.HUPCL  # closing the port doesn't drop DTR, so the next open doesn't reset the board
+    self.baud = baud
+    attrs[4] = attrs[5] = getattr(termios, "B%d" % baud)
+    termios.tcsetattr(self.fd, termios.TCSADRAIN, attrs)
+
+  def close(self):
+    os.close(self.fd)
+
+  def set_baud(self, baud):  # host side only
+    attrs = termios.tcgetattr(self.fd)
+    attrs[4] = attrs[5] = getattr(termios, "B%d" % baud)
+    termios.tcsetattr(self.fd, termios.TCSADRAIN, attrs)
+    self.baud = baud
+
+  def write(self, data):
+    if isinstance(data, str):
+      data = data.encode()
+    while data:
+      data = data[os.write(self.fd, data):]
+
+  def read(self, n, timeout):  # up to n bytes, fewer when timeout s pass without any
+    while len(self.buf) < n:
+      ready, _, _ = select.select([self.fd], [], [], timeout)
+      if not ready:
+        break
+      self.buf += os.read(self.fd, 4096)
+    data, self.buf = self.buf[:n], self.buf[n:]
+    return data
+
+  def readline(self, timeout=2.0):  # next line without CR LF, None when timeout s pass without one
+    end = time.monotonic() + timeout
+    while b"\n" not in self.buf:
+      left = end - time.monotonic()
+      ready, _, _ = select.select([self.fd], [], [], max(left, 0))
+      if not ready:
+        return None
+      self.buf += os.read(self.fd, 4096)
+    line, self.buf = self.buf.split(b"\n", 1)
+    return line.rstrip(b"\r").decode(errors="replace")
+
+  def drain(self, quiet=0.05):  # drop whatever comes until the line is quiet
+    while self.read(4096, quiet):
+      pass
+    self.buf = b""
+
+  def sync(self, tries=5):
+    for _ in range(tries):
+      self.write("\nsync\n")
+      while True:
+        line = self.readline(1.0)
+        if line is None:
+          break
+        if line == "sync ok":
+          return
+    raise LinkError("no reply to sync, is the sketch built with HOSTCMD?")
+
+  def ping(self, timeout=5.0):  # waits for the sketch to be back, returns the device time in us
+    self.token += 1
+    end = time.monotonic() + timeout
+    wait = 0.02
+    while time.monotonic() < end:
+      self.write("ping %d\n" % self.token)
+      limit = time.monotonic() + wait
+      while time.monotonic() < limit:
+        line = self.readline(max(limit - time.monotonic(), 0))
+        if line and line.startswith("pong %d " % self.token):
+          self.ahead = 0
+          return int(line.split()[2])
+      wait = min(wait * 2, 0.5)  # lost while the port was closed, or still busy
+    raise LinkError("no reply to ping")
+
+  def send(self, line):  # a command that neither replies nor uses the bus
+    self.write(line + "\n")
+    self.ahead += len(line) + 1
+    if self.ahead > self.window:
+      self.ping()
+
+  def command(self, line, replies=1, timeout=5.0):  # the reply lines
+    self.write(line + "\n")
+    self.ahead = 0
+    if replies == 0:
+      self.ping(timeout)
+      return []
+    lines = []
+    while len(lines) < replies:
+      reply = self.readline(timeout)
+      if reply is None:
+        raise LinkError("no reply to %r" % line)
+      if not reply.startswith("pong "):  # left over from a ping sent again
+        lines.append(reply)
+    return lines
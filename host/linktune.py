@@ -0,0 +1,195 @@
+#!/usr/bin/env python3
+"""
+Measures the host link of a board built with HOSTCMD and picks its baud rate and send-ahead window, for plan.py.
+
+  python3 linktune.py --port /dev/ttyUSB0 --baud 9600
+  python3 linktune.py --port /dev/ttyUSB0 --baud 9600 --apply    and keep the rate on the board (save)
+
+At the current rate it times ping round trips against the wire time of the two lines: what is left over is the
+USB serial bridge, ie. the 16 ms latency timer of an FTDI holding a short reply back.  Then every rate of --rates
+is tried with `baud` (the board falls back by itself when the host doesn't make it) and a quarter second of
+`sink` and `source` data; a rate passes when both arrive without an error.  The highest one that passes is the
+rate to use, the AVR can't make some rates within 3% (ie. 230400 at 16 MHz) and a bridge has its own limit.
+At that rate bursts of 1, 2, 4 ... pings are sent without waiting: the largest burst that comes back whole is
+what the board takes ahead of a reply, the window of plan.py.  The last line is the options for plan.py.
+"""
+
+import argparse
+import statistics
+import sys
+import time
+
+from link import Link, LinkError
+
+RATES = [9600, 19200, 38400, 57600, 115200, 230400, 500000, 1000000, 2000000]
+LINK_TIMEOUT = 2.0  # LINK_TIMEOUT of the sketch, in s
+
+
+def pattern(n):  # sink / source data
+  return bytes(i & 0xFF for i in range(n))
+
+
+def wire(n, baud):  # time n characters take on the line, in s
+  return n * 10.0 / baud
+
+
+def round_trips(link, count=20):  # ping round trips in s, the wire time of one
+  times = []
+  for i in range(count):
+    start = time.monotonic()
+    link.write("ping %d\n" % i)
+    line = link.readline(1.0)
+    if line is None or not line.startswith("pong %d " % i):
+      raise LinkError("no reply to ping %d" % i)
+    times.append(time.monotonic() - start)
+  return times, wire(len("ping %d\n" % count) + len(line) + 2, link.baud)
+
+
+def switch(link, rate):  # board and host to rate, False when the board fell back
+  link.write("baud %d\n" % rate)
+  line = link.readline(1.0)
+  link.set_baud(rate)
+  if line == "baud %d" % rate:
+    link.write("U")
+    if link.readline(1.0) is not None:  # the reply at the new rate, maybe garbled: the board took it
+      return True
+  time.sleep(LINK_TIMEOUT)  # wait for the fall back
+  return False
+
+
+def restore(link, base, rate, tries=8):  # board and host back to base from a rate that may garble
+  for _ in range(tries):
+    link.set_baud(rate)
+    link.drain()
+    link.write("\nbaud %d\n" % base)
+    if link.readline(1.0) is not None:  # the reply, maybe garbled: the board is at base now, or it didn't get it
+      link.set_baud(base)
+      link.write("U")
+    link.set_baud(base)
+    try:
+      link.sync(tries=1)
+      return
+    except LinkError:
+      pass
+  raise LinkError("lost the board at %d baud, reset it" % rate)
+
+
+def reply(line, word, count):  # the numbers of a "<word> <n> ..." reply, None when missing or garbled
+  fields = line.split() if line else []
+  if len(fields) != count + 1 or fields[0] != word or not all(f.isdigit() for f in fields[1:]):
+    return None
+  return [int(f) for f in fields[1:]]
+
+
+def sink(link, n):  # errors, device ms
+  link.write("sink %d\n" % n)
+  link.write(pattern(n))
+  numbers = reply(link.readline(wire(n, link.baud) + LINK_TIMEOUT + 1.0), "sink", 3)
+  if numbers is None:
+    return None, 0
+  return n - numbers[0] + numbers[1], numbers[2]
+
+
+def source(link, n):  # errors, device ms
+  link.write("source %d\n" % n)
+  data = link.read(n, 1.0)
+  errors = sum(a != b for a, b in zip(data, pattern(n))) + n - len(data)
+  while True:
+    line = link.readline(1.0)
+    if line is None:
+      return None, 0
+    numbers = reply(line, "source", 2)
+    if numbers:
+      return errors, numbers[1]
+
+
+def throughput(n, ms):  # bytes per s
+  return n * 1000.0 / ms if ms else 0.0
+
+
+def probe(link, rate):  # None when the rate fails, else the sink and source throughput in bytes per s
+  n = max(256, rate // 40)
+  down, down_ms = sink(link, n)
+  up, up_ms = source(link, n)
+  if down is None or up is None:
+    return "no reply, or a garbled one", None
+  if down or up:
+    return "%d / %d errors in %d bytes" % (down, up, n), None
+  return None, (throughput(n, down_ms), throughput(n, up_ms))
+
+
+def window(link, largest=64):  # bytes of the largest burst of pings that all come back
+  best = 0
+  burst = 1
+  while burst <= largest:
+    lines = ["ping %d.%d" % (burst, i) for i in range(burst)]
+    link.write("".join(line + "\n" for line in lines))
+    replies = []
+    while len(replies) < burst:
+      line = link.readline(0.5)
+      if line is None:
+        break
+      if line.startswith("pong "):
+        replies.append(line.split()[1])
+    if replies != [line.split()[1] for line in lines]:
+      link.drain()
+      link.sync()
+      break
+    best = sum(len(line) + 1 for line in lines)
+    burst *= 2
+  return best
+
+
+def main():
+  parser = argparse.ArgumentParser(description="Measure the host link and pick its baud rate and window")
+  parser.add_argument("--port", required=True)
+  parser.add_argument("--baud", type=int, default=9600, help="rate the board is at now")
+  parser.add_argument("--rates", default=",".join(str(r) for r in RATES), help="rates to try, comma separated")
+  parser.add_argument("--apply", action="store_true", help="leave the board at the rate found and save it")
+  args = parser.parse_args()
+
+  try:
+    link = Link(args.port, args.baud)
+    link.sync()
+    times, line = round_trips(link)
+    excess = statistics.median(times) - line
+    print("rtt %d: min %.2f median %.2f max %.2f ms, wire %.2f ms, bridge latency %.1f ms" % (
+      args.baud, min(times) * 1000, statistics.median(times) * 1000, max(times) * 1000, line * 1000, excess * 1000))
+
+    best = None
+    for rate in [int(r) for r in args.rates.split(",")]:
+      if rate == args.baud:
+        ok = True
+      else:
+        ok = switch(link, rate)
+      if not ok:
+        problem = "no reply at the new rate"
+      else:
+        problem, speeds = probe(link, rate)
+      if problem:
+        print("%8d: FAIL %s" % (rate, problem))
+      else:
+        print("%8d: ok, sink %d B/s, source %d B/s" % (rate, speeds[0], speeds[1]))
+        best = rate
+      if rate != args.baud:
+        restore(link, args.baud, rate)
+    if best is None:
+      sys.exit("no rate works")
+
+    if best != args.baud and not switch(link, best):
+      sys.exit("can't switch to %d baud again" % best)
+    times, line = round_trips(link)
+    size = window(link)
+    print("rtt %d: median %.2f ms, window %d bytes" % (best, statistics.median(times) * 1000, size))
+    if args.apply:
+      link.write("save\n")
+      link.ping()
+    elif best != args.baud:
+      restore(link, args.baud, best)
+    print("--baud %d --window %d" % (best, size))
+  except LinkError as e:
+    sys.exit(str(e))
+
+
+if __name__ == "__main__":
+  main()
@@ -0,0 +1,326 @@
+#!/usr/bin/env python3
+"""
+Rescue job planner: reads the state of the part in the shield over the host commands (HOSTCMD), works out the
+shortest sequence of operations that takes it to the desired state and runs it in one programming mode session.
+
+  python3 plan.py --port /dev/ttyACM0 --mode hvsp --flash blink.hex --fuses L=62,H=DF --lock FC
+  python3 plan.py --port /dev/ttyACM0 --mode atmega --eeprom cal.hex --dry-run     print the plan only
+
+Desired state: --flash and --eeprom images (Intel HEX, bytes not in the file are 0xFF), --fuses and --lock.  What
+isn't given is kept as it is, across an erase too.  Current state: signature, fuses, lock bits, the CRC of the
+whole flash and, if it differs, of every page, the CRC of every EEPROM block and, if it differs, its bytes.
+
+The plan:
+ - flash: nothing if the CRCs match.  Pages that differ and are blank are programmed without an erase; a page that
+   differs and isn't blank needs a chip erase, after which every page that isn't blank is programmed.
+ - the lock bits are only cleared by an erase, and lock mode 2 or 3 blocks every write: if fuses, EEPROM or flash
+   must change then, the part is erased too.
+ - around an erase the EEPROM is kept with "erase keep" (EESAVE); with the lock bits set EESAVE can't be
+   programmed, so the EEPROM is read before a plain erase and written back.  Flash that must be kept is read and
+   programmed back the same way.  In lock mode 3 nothing can be read: what must be kept has to be given.
+ - EEPROM bytes that differ, fuses that differ (HFUSE first), then the flash and EEPROM CRCs are checked, and the
+   lock bits are written last, only if they differ, since they block the read back.
+
+Against the simulation: make, then ./atrescue_sim_hostcmd --pty --part attiny85 and --port the pty it prints.
+"""
+
+import argparse
+import sys
+
+from link import Link, LinkError
+
+MODES = {"atmega": 1, "tiny2313": 2, "hvsp": 3}
+
+PARTS = {  # signature: name, mode, flash words, page words, EEPROM bytes, fuse bytes
+  (0x1E, 0x95, 0x0F): ("ATmega328P", "atmega", 16384, 64, 1024, 3),
+  (0x1E, 0x94, 0x06): ("ATmega168", "atmega", 8192, 64, 512, 3),
+  (0x1E, 0x91, 0x0A): ("ATtiny2313", "tiny2313", 1024, 16, 128, 3),
+  (0x1E, 0x93, 0x0B): ("ATtiny85", "hvsp", 4096, 32, 512, 3),
+  (0x1E, 0x90, 0x07): ("ATtiny13", "hvsp", 512, 16, 64, 2),
+}
+
+FUSES = ("l", "h", "e")
+EE_BLOCK = 64   # EEPROM bytes per CRC
+BUF_BYTES = 32  # data bytes per buf command
+
+
+class PlanError(Exception):
+  pass
+
+
+def crc16(data):  # avr-libc _crc16_update from 0xFFFF, the crc and eecrc commands
+  crc = 0xFFFF
+  for b in data:
+    crc ^= b
+    for _ in range(8):
+      crc = (crc >> 1) ^ 0xA001 if crc & 1 else crc >> 1
+  return crc
+
+
+BLANK_CRC = {n: crc16(b"\xff" * n) for n in (32, 64, 128)}  # of an erased flash page, by page bytes
+
+
+def read_hex(path, size):  # Intel HEX image, unused bytes 0xFF
+  image = bytearray(b"\xff" * size)
+  base = 0
+  with open(path) as f:
+    for number, line in enumerate(f, 1):
+      line = line.strip()
+      if not line:
+        continue
+      record = bytes.fromhex(line[1:])
+      if line[0] != ":" or len(record) != record[0] + 5 or sum(record) & 0xFF:
+        raise PlanError("%s:%d: bad record" % (path, number))
+      count, addr, kind, data = record[0], record[1] << 8 | record[2], record[3], record[4:-1]
+      if kind == 0:
+        if base + addr + count > size:
+          raise PlanError("%s:%d: beyond the part's %d bytes" % (path, number, size))
+        image[base + addr:base + addr + count] = data
+      elif kind == 1:
+        break
+      elif kind == 2:
+        base = (data[0] << 8 | data[1]) << 4
+      elif kind == 4:
+        base = (data[0] << 8 | data[1]) << 16
+  return image
+
+
+def hex_value(line):  # a reply that must be a hex number
+  try:
+    return int(line, 16)
+  except ValueError:
+    raise PlanError("unexpected reply: %s" % line)
+
+
+class Planner:
+  def __init__(self, link, part, args):
+    self.link = link
+    self.name, _, self.words, self.page_words, self.ee_size, self.nfuses = part
+    self.page_bytes = 2 * self.page_words
+    self.pages = self.words // self.page_words
+    self.args = args
+    self.steps = []  # description, function, its arguments
+    self.flash_image = self.eeprom_image = None  # what the part holds once the plan ran, None = left alone
+
+  def cmd(self, line, replies=1):
+    return self.link.command(line, replies)
+
+  def crc(self, page):  # of a flash page
+    return hex_value(self.cmd("crc %X %X" % (page * self.page_words, self.page_words))[0])
+
+  def read_page(self, page):
+    return bytes.fromhex(self.cmd("flash %X %X" % (page * self.page_words, self.page_words))[0])
+
+  def read_eeprom(self, blocks, base):  # current EEPROM: bytes of blocks read one at a time, the rest as in base
+    data = bytearray(base)
+    for block in blocks:
+      for addr in range(block * EE_BLOCK, min((block + 1) * EE_BLOCK, self.ee_size)):
+        data[addr] = hex_value(self.cmd("ee %X" % addr)[0])
+    return data
+
+  def ee_blocks(self, image):  # EEPROM blocks whose CRC differs from image
+    blocks = []
+    for addr in range(0, self.ee_size, EE_BLOCK):
+      size = min(EE_BLOCK, self.ee_size - addr)
+      if hex_value(self.cmd("eecrc %X %X" % (addr, size))[0]) != crc16(image[addr:addr + size]):
+        blocks.append(addr // EE_BLOCK)
+    return blocks
+
+  def read_state(self):
+    self.fuses = [hex_value(self.cmd("fuse " + FUSES[i])[0]) for i in range(self.nfuses)]
+    self.lock = hex_value(self.cmd("lock")[0])
+    self.writable = bool(self.lock & 0x01)     # lock mode 1
+    self.readable = (self.lock & 0x03) != 0    # not lock mode 3
+    fuses = " ".join("%s=%02X" % (FUSES[i].upper(), v) for i, v in enumerate(self.fuses))
+    print("%s: %s lock=%02X%s" % (self.name, fuses, self.lock,
+                                  "" if self.writable else " (lock mode %d)" % (2 if self.readable else 3)))
+
+  def plan(self):
+    args = self.args
+    want_fuses = list(self.fuses)
+    for key, value in (args.fuses or {}).items():
+      if key >= self.nfuses:
+        raise PlanError("%s has no %sFUSE" % (self.name, FUSES[key].upper()))
+      want_fuses[key] = value
+    want_lock = self.lock if args.lock is None else args.lock
+    flash = read_hex(args.flash, 2 * self.words) if args.flash else None
+    eeprom = read_hex(args.eeprom, self.ee_size) if args.eeprom else None
+
+    # what differs, as far as it can be read
+    page_crcs = {}
+    if flash is None:
+      differ = []
+    elif not self.readable:
+      differ = list(range(self.pages))
+    elif hex_value(self.cmd("crc 0 %X" % self.words)[0]) == crc16(flash):
+      differ = []
+    else:
+      page_crcs = {p: self.crc(p) for p in range(self.pages)}
+      differ = [p for p in range(self.pages) if page_crcs[p] != crc16(self.page(flash, p))]
+    ee_current = None
+    if eeprom is not None and self.readable:
+      ee_current = self.read_eeprom(self.ee_blocks(eeprom), eeprom)
+    fuse_writes = [i for i in (1, 0, 2) if i < self.nfuses and want_fuses[i] != self.fuses[i]]
+
+    erase = any(page_crcs.get(p) != BLANK_CRC[self.page_bytes] for p in differ)  # not blank, or unknown
+    erase |= bool(want_lock & ~self.lock & 0xFF)  # lock bits are only cleared by an erase
+    erase |= not self.writable and bool(differ or fuse_writes or (eeprom is not None and ee_current != eeprom))
+    if erase:
+      self.plan_erase(flash, eeprom, ee_current, page_crcs)
+    else:
+      for p in differ:
+        self.program(p, flash)
+      if eeprom is not None:
+        self.write_eeprom(ee_current, eeprom)
+    for i in fuse_writes:
+      self.step("fuse %s %02X" % (FUSES[i], want_fuses[i]), self.fuse_write, i, want_fuses[i])
+    checked = [name for name, image in (("flash", self.flash_image), ("EEPROM", self.eeprom_image)) if image is not None]
+    if self.steps and checked:
+      self.step("check the %s CRC" % " and ".join(checked), self.verify)
+    if want_lock != (0xFF if erase else self.lock):
+      self.step("lock %02X" % want_lock, self.lock_write, want_lock)
+
+  def plan_erase(self, flash, eeprom, ee_current, page_crcs):
+    blank_ee = bytearray(b"\xff" * self.ee_size)
+    kept = ""
+    if flash is None:  # the program stays: the pages that aren't blank are read now and programmed back
+      if not self.readable:
+        raise PlanError("an erase is needed and lock mode 3 blocks reading the flash back: give --flash")
+      flash = bytearray(b"\xff" * 2 * self.words)
+      for p in range(self.pages):
+        if (page_crcs[p] if p in page_crcs else self.crc(p)) != BLANK_CRC[self.page_bytes]:
+          flash[p * self.page_bytes:(p + 1) * self.page_bytes] = self.read_page(p)
+      kept = ", flash saved"
+    if self.writable:  # EESAVE can be programmed
+      self.step("erase keep: EEPROM kept with EESAVE" + kept, self.erase, True)
+      current = ee_current
+    elif eeprom is not None:
+      self.step("erase" + kept, self.erase, False)
+      current = blank_ee
+    elif self.readable:  # lock mode 2 blocks EESAVE: read the EEPROM, write it back after the erase
+      eeprom = self.read_eeprom(self.ee_blocks(blank_ee), blank_ee)
+      self.step("erase: EEPROM saved (EESAVE blocked by the lock bits)" + kept, self.erase, False)
+      current = blank_ee
+    else:
+      raise PlanError("an erase is needed and lock mode 3 blocks reading the EEPROM back: give --eeprom")
+    for p in range(self.pages):
+      if self.page(flash, p) != b"\xff" * self.page_bytes:
+        self.program(p, flash)
+    if eeprom is not None:
+      self.write_eeprom(current, eeprom)
+
+  def page(self, image, page):
+    return bytes(image[page * self.page_bytes:(page + 1) * self.page_bytes])
+
+  def write_eeprom(self, current, image):
+    writes = [a for a in range(self.ee_size) if current[a] != image[a]]
+    if writes:
+      self.step("ee: %d bytes" % len(writes), self.ee_write, writes, image)
+    self.eeprom_image = image
+
+  def program(self, page, flash):
+    self.flash_image = flash
+    self.step("page %04X" % (page * self.page_words), self.page_write, page, flash)
+
+  def step(self, text, function, *args):
+    self.steps.append((text, function, args))
+
+  # the operations
+
+  def erase(self, keep):
+    if keep:
+      reply = self.cmd("erase keep")[0]
+      if reply != "OK":
+        raise PlanError("erase keep: %s" % reply)
+    else:
+      self.cmd("erase", 0)
+
+  def page_write(self, page, flash):
+    addr, data = page * self.page_words, self.page(flash, page)
+    for offset in range(0, len(data), BUF_BYTES):
+      self.link.send("buf %X %s" % (offset, data[offset:offset + BUF_BYTES].hex().upper()))
+    self.cmd("page %X %X" % (addr, self.page_words), 0)
+    reply = self.cmd("verify %X %X" % (addr, self.page_words))[0]
+    if reply != "OK":
+      raise PlanError("page %04X: %s" % (addr, reply))
+
+  def ee_write(self, addrs, image):
+    for a in addrs:
+      if hex_value(self.cmd("ee %X %02X" % (a, image[a]))[0]) != image[a]:
+        raise PlanError("EEPROM %04X: write failed" % a)
+
+  def fuse_write(self, i, value):
+    got = hex_value(self.cmd("fuse %s %02X" % (FUSES[i], value))[0])
+    if got != value:
+      raise PlanError("%sFUSE: burned %02X, reads %02X" % (FUSES[i].upper(), value, got))
+
+  def verify(self):
+    if self.flash_image is not None and hex_value(self.cmd("crc 0 %X" % self.words)[0]) != crc16(self.flash_image):
+      raise PlanError("flash CRC differs")
+    if self.eeprom_image is not None and hex_value(self.cmd("eecrc 0 %X" % self.ee_size)[0]) != crc16(self.eeprom_image):
+      raise PlanError("EEPROM CRC differs")
+
+  def lock_write(self, value):
+    got = hex_value(self.cmd("lock %02X" % value)[0])
+    if got != value:
+      raise PlanError("lock bits: wrote %02X, read %02X" % (value, got))
+
+
+def fuses(spec):  # L=62,H=DF -> {0: 0x62, 1: 0xDF}
+  result = {}
+  for item in spec.split(","):
+    key, _, value = item.partition("=")
+    if key.lower() not in FUSES or not value:
+      raise argparse.ArgumentTypeError("fuses are L=, H=, E=")
+    result[FUSES.index(key.lower())] = int(value, 16)
+  return result
+
+
+def main():
+  parser = argparse.ArgumentParser(description="Plan and run the operations that take a part to a desired state")
+  parser.add_argument("--port", required=True, help="serial port of the board, or the simulation's pty")
+  parser.add_argument("--baud", type=int, default=9600)
+  parser.add_argument("--window", type=int, default=0, help="bytes sent ahead of a reply, from linktune.py")
+  parser.add_argument("--mode", choices=sorted(MODES), help="default: the sketch's mode")
+  parser.add_argument("--flash", help="flash image, Intel HEX")
+  parser.add_argument("--eeprom", help="EEPROM image, Intel HEX")
+  parser.add_argument("--fuses", type=fuses, help="ie. L=62,H=DF,E=FF")
+  parser.add_argument("--lock", type=lambda v: int(v, 16), help="lock bits, hex")
+  parser.add_argument("--dry-run", action="store_true", help="print the plan, change nothing")
+  args = parser.parse_args()
+
+  link = Link(args.port, args.baud, args.window)
+  try:
+    link.sync()
+    if args.mode:
+      link.command("mode %d" % MODES[args.mode])
+    reply = link.command("hv")[0]
+    if not reply.startswith("Entry variant"):
+      raise PlanError(reply)
+    sig = hex_value(link.command("sig")[0])
+    sig = (sig >> 16, sig >> 8 & 0xFF, sig & 0xFF)
+    if sig not in PARTS:
+      raise PlanError("unknown signature %02X %02X %02X" % sig)
+    planner = Planner(link, PARTS[sig], args)
+    planner.read_state()
+    planner.plan()
+    print("plan:" if planner.steps else "plan: nothing to do")
+    for text, _, _ in planner.steps:
+      print("  " + text)
+    if not args.dry_run:
+      for text, function, step_args in planner.steps:
+        function(*step_args)
+      if planner.steps:
+        print("done")
+  except (LinkError, PlanError) as e:
+    sys.exit("plan.py: %s" % e)
+  finally:
+    try:
+      link.command("off", 0)
+    except LinkError:
+      pass
+    link.close()
+
+
+if __name__ == "__main__":
+  main()
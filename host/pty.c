@@ -0,0 +1,46 @@
+/*
+  Pseudo terminal as the host link of the simulation, see pty.h.
+*/
+
+#define _DEFAULT_SOURCE  // cfmakeraw()
+#define _XOPEN_SOURCE 600
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+#include "pty.h"
+
+int pty_open(char *name, unsigned len) {
+  int fd = posix_openpt(O_RDWR | O_NOCTTY), slave;
+  struct termios tio;
+
+  if (fd < 0 || grantpt(fd) || unlockpt(fd) || (slave = open(ptsname(fd), O_RDWR | O_NOCTTY)) < 0)
+    return -1;
+  tcgetattr(slave, &tio);  // raw until the host sets its own mode, the line discipline would echo and cook
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+  close(slave);
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  snprintf(name, len, "%s", ptsname(fd));
+  return fd;
+}
+
+unsigned long pty_baud(int fd) {
+  static const struct { speed_t code; unsigned long rate; } rates[] = {
+    { B300, 300 }, { B600, 600 }, { B1200, 1200 }, { B2400, 2400 }, { B4800, 4800 }, { B9600, 9600 },
+    { B19200, 19200 }, { B38400, 38400 }, { B57600, 57600 }, { B115200, 115200 }, { B230400, 230400 },
+    { B460800, 460800 }, { B500000, 500000 }, { B576000, 576000 }, { B921600, 921600 }, { B1000000, 1000000 },
+    { B1152000, 1152000 }, { B1500000, 1500000 }, { B2000000, 2000000 },
+  };
+  struct termios tio;
+  speed_t code;
+
+  if (tcgetattr(fd, &tio))  // the master sees the settings of the slave side
+    return 0;
+  code = cfgetospeed(&tio);
+  for (unsigned i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+    if (rates[i].code == code)
+      return rates[i].rate;
+  return 0;
+}
@@ -0,0 +1,20 @@
+/*
+  Pseudo terminal as the host link of the simulation (atrescue_sim --pty), apart from sim.cpp because termios.h
+  and the Arduino binary constants (B0, B110...) don't mix.
+*/
+
+#ifndef PTY_H
+#define PTY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int pty_open(char *name, unsigned len);  // master side in raw mode, nonblocking, its name in name; -1 on error
+unsigned long pty_baud(int fd);          // rate the host set on its side, 0 if none
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
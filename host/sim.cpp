@@ -0,0 +1,653 @@
+/*
+  Host simulation runtime, see sim.h and Arduino.h.
+*/
+
+#include <Arduino.h>
+#include <avr/eeprom.h>
+#include <util/delay_basic.h>
+#include <deque>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include "pty.h"
+#include "sim.h"
+
+#define  US  1000ULL
+#define  MS  1000000ULL
+
+// Arduino core on the Uno: digitalWrite() looks up the port and takes about 3.5 us, the pin changing near its
+// end; digitalRead() and pinMode() about the same.  baremetal.h turns constant pins into single instructions.
+const sim_costs sim_costs_arduino = { 3100, 400, 3125, 3750, 63, 1000, 500, 5000 };
+const sim_costs sim_costs_baremetal = { 63, 62, 125, 250, 63, 190, 500, 2000 };
+sim_costs sim_cost = sim_costs_arduino;
+
+uint64_t sim_now = 0;
+uint64_t sim_limit = 60000 * MS;
+tm_target *sim_socket[3];
+uint64_t sim_vcc_ns = 0;
+uint64_t sim_link_down_ns = 0;
+FILE *sim_trace = NULL;
+bool sim_trace_time = false;
+FILE *sim_echo = NULL;
+int sim_pty = -1;
+uint32_t sim_max_baud = 0;
+uint64_t sim_latency = 0;
+std::string sim_output;
+
+// Shield wiring, Arduino pin numbers (see Pin Assignments in main.cpp)
+#define  PIN_VCC     12
+#define  PIN_RDY     13
+#define  PIN_OE      11
+#define  PIN_WR      10
+#define  PIN_BS1     A2
+#define  PIN_XA0     8
+#define  PIN_XA1     A4
+#define  PIN_RST     A0
+#define  PIN_XTAL1   A3
+#define  PIN_BUTTON  A1
+#define  PIN_PAGEL   A5
+#define  PIN_BS2     9
+
+#define  UART_PINS  (SIM_BOARD != SIM_LEONARDO)  // D0/D1 are the UART, the Leonardo talks USB
+#define  E2SIZE     ((SIM_BOARD == SIM_MEGA) ? 4096 : 1024)
+#define  PINS       70
+#define  NONE       0xFF
+
+enum { B, C, D, E, F, G, H, PORTS };  // ports, in sim_regid order
+
+struct sim_pin {
+  uint8_t port;
+  uint8_t bit;
+};
+
+#if (SIM_BOARD == SIM_MEGA)
+static const sim_pin digital[14] = { { E, 0 }, { E, 1 }, { E, 4 }, { E, 5 }, { G, 5 }, { E, 3 }, { H, 3 },
+                                     { H, 4 }, { H, 5 }, { H, 6 }, { B, 4 }, { B, 5 }, { B, 6 }, { B, 7 } };
+static const sim_pin analog[6] = { { F, 0 }, { F, 1 }, { F, 2 }, { F, 3 }, { F, 4 }, { F, 5 } };
+#elif (SIM_BOARD == SIM_LEONARDO)
+static const sim_pin digital[14] = { { D, 2 }, { D, 3 }, { D, 1 }, { D, 0 }, { D, 4 }, { C, 6 }, { D, 7 },
+                                     { E, 6 }, { B, 4 }, { B, 5 }, { B, 6 }, { B, 7 }, { D, 6 }, { C, 7 } };
+static const sim_pin analog[6] = { { F, 7 }, { F, 6 }, { F, 5 }, { F, 4 }, { F, 1 }, { F, 0 } };
+#else
+static const sim_pin digital[14] = { { D, 0 }, { D, 1 }, { D, 2 }, { D, 3 }, { D, 4 }, { D, 5 }, { D, 6 },
+                                     { D, 7 }, { B, 0 }, { B, 1 }, { B, 2 }, { B, 3 }, { B, 4 }, { B, 5 } };
+static const sim_pin analog[6] = { { C, 0 }, { C, 1 }, { C, 2 }, { C, 3 }, { C, 4 }, { C, 5 } };
+#endif
+
+static uint8_t ddr[PORTS], port[PORTS];
+static uint8_t regs[SIM_REGS];  // SREG, GPIOR0-2, MCUSR
+static uint64_t button_from, button_until;
+static unsigned last_lines;
+static uint8_t last_data, last_mask;
+static uint64_t vcc_on;
+static tm_target *sim_target;  // part in the shield now
+
+extern byte mode;  // the sketch's mode picks the part
+
+static sim_pin pin_of(uint8_t pin) {
+  if (pin < 14)
+    return digital[pin];
+  if (pin >= A0 && pin < A0 + 6)
+    return analog[pin - A0];
+  return (sim_pin) { NONE, 0 };
+}
+
+static int pin_at(uint8_t p, uint8_t bit) {  // Arduino pin on a port bit, -1 if none
+  for (int pin = 0; pin < PINS; pin++) {
+    sim_pin s = pin_of(pin);
+    if (s.port == p && s.bit == bit)
+      return pin;
+  }
+  return -1;
+}
+
+// Serial port: bytes sent and received, with the time they are on the wire
+struct sim_byte {
+  uint64_t at;  // TX: start bit, RX: stop bit received
+  uint8_t value;
+};
+
+static bool serial_open;
+static uint64_t serial_closed = UINT64_MAX;  // when end() closed the port, UINT64_MAX = never opened
+static uint64_t char_ns = 10 * 1000000000ULL / 9600;  // 10 bits per byte
+static std::deque<sim_byte> tx, rx;
+static uint64_t tx_end, txc_clear;
+static std::deque<std::string> input;
+static unsigned long serial_baud;
+static uint64_t real_start;  // pty: monotonic clock at sim_now 0
+static uint64_t pty_read_at;  // pty: last look for host input
+static std::deque<sim_byte> bridge;  // pty: bytes in the USB bridge, at: stop bit received
+static uint32_t noise = 1;   // pty: which bytes a bad rate garbles, xorshift
+
+static void pty_service(void);
+
+static bool uart_owned(void) {  // the UART overrides D0/D1 while open
+  return UART_PINS && serial_open;
+}
+
+static uint8_t tx_level(uint64_t ns) {  // TX line at ns: start bit, 8 data bits LSB first, stop bit
+  uint64_t bit_ns = char_ns / 10;
+
+  for (const sim_byte &b : tx)
+    if (ns >= b.at && ns < b.at + char_ns) {
+      uint64_t bit = (ns - b.at) / bit_ns;
+      return bit == 0 ? 0 : bit > 8 ? 1 : (b.value >> (bit - 1)) & 1;
+    }
+  return 1;
+}
+
+static uint64_t tx_edge(uint64_t ns) {  // next bit boundary after ns, 0 = nothing left to send
+  uint64_t bit_ns = char_ns / 10;
+
+  for (const sim_byte &b : tx) {
+    if (ns < b.at)
+      return b.at;
+    if (ns < b.at + char_ns)
+      return b.at + ((ns - b.at) / bit_ns + 1) * bit_ns;
+  }
+  return 0;
+}
+
+static void pin_out(uint8_t pin, uint8_t *level, uint8_t *driven) {  // What the Arduino puts on a pin
+  sim_pin s = pin_of(pin);
+  uint8_t m;
+
+  if (uart_owned() && pin <= 1) {
+    *level = pin ? tx_level(sim_now) : 1;  // RX is held high by the USB serial chip
+    *driven = pin;
+    return;
+  }
+  if (s.port == NONE) {
+    *level = *driven = 0;
+    return;
+  }
+  m = _BV(s.bit);
+  *driven = (ddr[s.port] & m) != 0;
+  *level = (port[s.port] & m) != 0;  // output level or pull-up
+  if (!*driven && UART_PINS && pin == 0)
+    *level = 1;
+}
+
+static bool swap(void) {  // The operator puts in the part for the sketch's mode, 1 if it changed
+  if (mode >= 3 || sim_socket[mode] == sim_target)
+    return false;
+  if (sim_target)  // taken out: it sees everything off
+    tm_drive(sim_target, sim_now, 0, 0, 0);
+  sim_target = sim_socket[mode];
+  return true;
+}
+
+static void lines_sync(void) {  // Pass the shield lines on to the target
+  static const struct { uint8_t pin; unsigned line; } lines_of[] = {
+    { PIN_XTAL1, TM_XTAL1 }, { PIN_OE, TM_OE }, { PIN_WR, TM_WR }, { PIN_BS1, TM_BS1 }, { PIN_XA0, TM_XA0 },
+    { PIN_XA1, TM_XA1 }, { PIN_PAGEL, TM_PAGEL }, { PIN_BS2, TM_BS2 }
+  };
+  unsigned lines = 0;
+  uint8_t data = 0, mask = 0, level, driven;
+  bool swapped = swap();
+
+  pin_out(PIN_VCC, &level, &driven);
+  if (level && driven)
+    lines |= TM_VCC;
+  pin_out(PIN_RST, &level, &driven);
+  if (!level && driven)  // 12V_EN is active low
+    lines |= TM_HV;
+  for (unsigned i = 0; i < sizeof(lines_of) / sizeof(lines_of[0]); i++) {
+    pin_out(lines_of[i].pin, &level, &driven);
+    if (level)
+      lines |= lines_of[i].line;
+  }
+  pin_out(PIN_RDY, &level, &driven);
+  if (driven)
+    lines |= TM_RDY_DRIVEN | (level ? TM_RDY : 0);
+  for (uint8_t i = 0; i < 8; i++) {
+    pin_out(i, &level, &driven);
+    data |= level << i;
+    mask |= driven << i;
+  }
+
+  if ((lines ^ last_lines) & TM_VCC) {
+    if (lines & TM_VCC)
+      vcc_on = sim_now;
+    else
+      sim_vcc_ns += sim_now - vcc_on;
+  }
+  if (sim_target && (swapped || lines != last_lines || data != last_data || mask != last_mask))
+    tm_drive(sim_target, sim_now, lines, data, mask);
+  last_lines = lines;
+  last_data = data;
+  last_mask = mask;
+}
+
+void sim_advance(uint64_t ns) {
+  uint64_t end = sim_now + ns, edge;
+
+  while (uart_owned() && (edge = tx_edge(sim_now)) && edge <= end) {  // DATA1 toggles under the target
+    sim_now = edge;
+    lines_sync();
+  }
+  sim_now = end;
+  while (!tx.empty() && tx.front().at + char_ns <= sim_now)
+    tx.pop_front();
+  if (sim_pty >= 0)
+    pty_service();
+  if (sim_now >= sim_limit)
+    throw sim_end { "time limit" };
+}
+
+void sim_button(uint64_t from, uint64_t until) {
+  button_from = from;
+  button_until = until;
+}
+
+static uint8_t pin_in(int pin) {  // Level the Arduino reads on a pin
+  uint8_t level, driven, data;
+
+  if (pin < 0)
+    return 0;
+  pin_out(pin, &level, &driven);
+  if (driven)
+    return level;
+  if (sim_target && pin < 8 && (tm_data(sim_target, sim_now, &data) & _BV(pin)))
+    return (data >> pin) & 1;
+  if (sim_target && pin == PIN_RDY && tm_rdy(sim_target, sim_now) >= 0)
+    return tm_rdy(sim_target, sim_now);
+  if (pin == PIN_BUTTON && sim_now >= button_from && sim_now < button_until)
+    return 0;  // the button shorts A1 to GND
+  return level;
+}
+
+static uint8_t port_in(uint8_t p) {  // PINx, sampled now
+  uint8_t value = 0;
+  bool data = false, rdy = false;
+
+  if (swap() && sim_target)
+    tm_drive(sim_target, sim_now, last_lines, last_data, last_mask);
+  for (uint8_t bit = 0; bit < 8; bit++) {
+    int pin = pin_at(p, bit);
+    value |= pin_in(pin) << bit;
+    data |= pin >= 0 && pin < 8;
+    rdy |= pin == PIN_RDY;
+  }
+  if (sim_target && data)
+    tm_sample_data(sim_target, sim_now);
+  if (sim_target && rdy)
+    tm_sample_rdy(sim_target, sim_now);
+  return value;
+}
+
+sim_reg PINB(SIM_PINB), DDRB(SIM_DDRB), PORTB(SIM_PORTB), PINC(SIM_PINC), DDRC(SIM_DDRC), PORTC(SIM_PORTC);
+sim_reg PIND(SIM_PIND), DDRD(SIM_DDRD), PORTD(SIM_PORTD), PINE(SIM_PINE), DDRE(SIM_DDRE), PORTE(SIM_PORTE);
+sim_reg PINF(SIM_PINF), DDRF(SIM_DDRF), PORTF(SIM_PORTF), PING(SIM_PING), DDRG(SIM_DDRG), PORTG(SIM_PORTG);
+sim_reg PINH(SIM_PINH), DDRH(SIM_DDRH), PORTH(SIM_PORTH), SREG(SIM_SREG), UCSR0A(SIM_UCSR0A);
+sim_reg GPIOR0(SIM_GPIOR0), GPIOR1(SIM_GPIOR1), GPIOR2(SIM_GPIOR2), MCUSR(SIM_MCUSR);
+
+uint8_t sim_reg_read(uint8_t id) {
+  if (id >= SIM_GPIOR0 && id <= SIM_GPIOR2)  // markers are free: the timing is that of the real sketch
+    return regs[id];
+  sim_advance(sim_cost.reg);
+  if (id < SIM_SREG) {
+    uint8_t p = id / 3;
+    switch (id % 3) {
+      case 0: return port_in(p);
+      case 1: return ddr[p];
+      default: return port[p];
+    }
+  }
+  if (id == SIM_UCSR0A)  // TXC0: a byte went out since it was cleared and nothing is left
+    return (tx_end > txc_clear && tx_end <= sim_now) ? _BV(TXC0) : 0;
+  return regs[id];
+}
+
+static const char *const marker_names[] = { "", "sclk", "strobe_xtal", "send_cmd", "fuse_burn", "fuse_read",
+                                            "hvsp_read", "hvsp_write", "hv_enter", "hv_exit", "load_addr",
+                                            "load_data", "data_read" };
+
+void sim_reg_write(uint8_t id, uint8_t value) {
+  if (id == SIM_GPIOR0 && sim_trace) {
+    uint8_t m = value & 0x7F;
+    if (sim_trace_time)
+      fprintf(sim_trace, "%10.3f ", sim_now / 1000.0);
+    if (m < sizeof(marker_names) / sizeof(marker_names[0]))
+      fprintf(sim_trace, "%s%s", marker_names[m], (value & 0x80) ? ".end" : "");
+    else
+      fprintf(sim_trace, "marker%u%s", m, (value & 0x80) ? ".end" : "");
+    fprintf(sim_trace, " %02X %02X\n", regs[SIM_GPIOR1], regs[SIM_GPIOR2]);
+  }
+  if (id >= SIM_GPIOR0 && id <= SIM_GPIOR2) {
+    regs[id] = value;
+    return;
+  }
+  sim_advance(sim_cost.reg);
+  if (id < SIM_SREG) {
+    uint8_t p = id / 3;
+    switch (id % 3) {
+      case 0: port[p] ^= value; break;  // writing PINx toggles
+      case 1: ddr[p] = value; break;
+      default: port[p] = value; break;
+    }
+    lines_sync();
+    return;
+  }
+  if (id == SIM_UCSR0A) {
+    if (value & _BV(TXC0))  // written as 1 to clear it
+      txc_clear = sim_now;
+    return;
+  }
+  regs[id] = value;
+}
+
+// Arduino core
+void pinMode(uint8_t pin, uint8_t mode) {
+  sim_pin s = pin_of(pin);
+
+  sim_advance(sim_cost.pin_mode);
+  if (s.port == NONE)
+    return;
+  if (mode == OUTPUT) {
+    ddr[s.port] |= _BV(s.bit);
+  } else {
+    ddr[s.port] &= ~_BV(s.bit);
+    if (mode == INPUT_PULLUP)
+      port[s.port] |= _BV(s.bit);
+    else
+      port[s.port] &= ~_BV(s.bit);
+  }
+  lines_sync();
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+  sim_pin s = pin_of(pin);
+
+  sim_advance(sim_cost.write_pin);
+  if (s.port != NONE) {
+    if (val)
+      port[s.port] |= _BV(s.bit);
+    else
+      port[s.port] &= ~_BV(s.bit);
+    lines_sync();
+  }
+  sim_advance(sim_cost.write_after);
+}
+
+int digitalRead(uint8_t pin) {
+  sim_pin s = pin_of(pin);
+
+  sim_advance(sim_cost.read_pin);
+  if (s.port == NONE)
+    return LOW;
+  return (port_in(s.port) >> s.bit) & 1;
+}
+
+void delay(unsigned long ms) {
+  sim_advance(ms * MS);
+}
+
+void delayMicroseconds(unsigned int us) {
+  sim_advance(us <= 1 ? sim_cost.delay_short : us * US);
+}
+
+unsigned long millis(void) {
+  sim_advance(sim_cost.call);
+  return sim_now / MS;
+}
+
+unsigned long micros(void) {
+  sim_advance(sim_cost.call);
+  return sim_now / (4 * US) * 4;  // Timer0 resolution
+}
+
+void _delay_loop_2(uint16_t count) {
+  sim_advance((count ? count : 65536) * 250ULL);
+}
+
+void sim_sleep(void) {
+  if (!(regs[SIM_SREG] & _BV(SREG_I)))
+    throw sim_end { "sleep" };
+}
+
+// Arduino EEPROM
+static uint8_t eeprom[4096];
+static bool eeprom_ready;
+
+static uint8_t *ee_cell(const void *addr) {
+  if (!eeprom_ready) {  // blank
+    memset(eeprom, 0xFF, sizeof(eeprom));
+    eeprom_ready = true;
+  }
+  return &eeprom[(uintptr_t) addr % E2SIZE];
+}
+
+uint8_t eeprom_read_byte(const uint8_t *addr) {
+  sim_advance(sim_cost.call);
+  return *ee_cell(addr);
+}
+
+void eeprom_write_byte(uint8_t *addr, uint8_t value) {
+  sim_advance(3400 * US);
+  *ee_cell(addr) = value;
+}
+
+void eeprom_update_byte(uint8_t *addr, uint8_t value) {
+  if (eeprom_read_byte(addr) != value)
+    eeprom_write_byte(addr, value);
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    ((uint8_t *) dst)[i] = eeprom_read_byte((const uint8_t *) src + i);
+}
+
+void eeprom_update_block(const void *src, void *dst, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    eeprom_update_byte((uint8_t *) dst + i, ((const uint8_t *) src)[i]);
+}
+
+// Serial: 64 byte buffers like HardwareSerial; end() waits for the output and drops what was received
+SimSerial Serial;
+
+void sim_input(const char *chunk) {
+  input.push_back(chunk);
+}
+
+void SimSerial::begin(unsigned long baud) {
+  uint8_t drop[256];
+
+  sim_advance(sim_cost.call);
+  char_ns = (SIM_BOARD == SIM_LEONARDO) ? 10 * US : 10 * 1000000000ULL / baud;  // USB: about 10 us a byte
+  serial_baud = baud;
+  if (!serial_open && serial_closed != UINT64_MAX) {
+    sim_link_down_ns += sim_now - serial_closed;
+    if (sim_pty >= 0 && sim_now - serial_closed > MS)  // what the host sent meanwhile met a closed port; a USB
+      while (::read(sim_pty, drop, sizeof(drop)) > 0);  // host can't answer within a frame (1 ms), a pty host can
+  }
+  serial_open = true;
+  lines_sync();
+}
+
+void SimSerial::end(void) {
+  if (SIM_BOARD == SIM_LEONARDO)  // USB CDC: end() does nothing
+    return;
+  flush();
+  if (serial_open)
+    serial_closed = sim_now;
+  serial_open = false;
+  rx.clear();
+  lines_sync();
+}
+
+// Host link over a pty: what the USB serial bridge does to it.  A byte is garbled when the host's rate isn't the
+// sketch's, and about one in 16 when the AVR can't make the rate within 3% (UBRR with U2X, as the Arduino core
+// sets it, ie. 230400 is 3.5% off at 16 MHz) or the bridge can't take it (--max-baud).  The bridge passes the
+// sketch's output on once 62 bytes make a USB packet or its latency timer runs out (--latency, FTDI default
+// 16 ms).  Virtual time keeps pace with real time, so the host sees the sketch at the speed of the board.
+
+static uint8_t on_wire(uint8_t c) {  // byte as the other end receives it
+  unsigned long ubrr = (16000000UL / 4 / serial_baud - 1) / 2;
+  double error = 16000000.0 / 8 / (ubrr + 1) / serial_baud - 1;
+
+  if (SIM_BOARD == SIM_LEONARDO)  // USB CDC, the rate means nothing
+    return c;
+  if (pty_baud(sim_pty) != serial_baud)
+    return c ^ 0x5A;
+  if (error > 0.03 || error < -0.03 || (sim_max_baud && serial_baud > sim_max_baud)) {
+    noise ^= noise << 13;
+    noise ^= noise >> 17;
+    noise ^= noise << 5;
+    if (noise % 16 == 0)
+      return c ^ 0x10;
+  }
+  return c;
+}
+
+static void pty_read(void) {  // Take what the host sent, bytes arriving one after the other at the port's rate
+  uint8_t buf[256];
+  ssize_t n = ::read(sim_pty, buf, sizeof(buf));
+  uint64_t at = (!rx.empty() && rx.back().at > sim_now) ? rx.back().at : sim_now;
+
+  pty_read_at = sim_now;
+  for (ssize_t i = 0; i < n && serial_open; i++)  // lost on a closed port
+    rx.push_back((sim_byte) { at += char_ns, on_wire(buf[i]) });
+}
+
+static void bridge_flush(void) {  // The bytes received so far go to the host, dropped when it doesn't read
+  uint8_t buf[64];
+  size_t n = 0;
+  ssize_t sent;
+
+  while (!bridge.empty() && bridge.front().at <= sim_now) {
+    buf[n++] = bridge.front().value;
+    bridge.pop_front();
+    if (n == sizeof(buf) || bridge.empty() || bridge.front().at > sim_now) {
+      sent = ::write(sim_pty, buf, n);
+      (void) sent;
+      n = 0;
+    }
+  }
+}
+
+static uint64_t real_now(void) {  // monotonic clock, in ns
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pty_service(void) {  // Keep pace with real time, take input while the sketch is busy, pass output on
+  uint64_t real;
+
+  if (!real_start)
+    real_start = real_now() - sim_now;
+  real = real_now() - real_start;
+  if (serial_open && sim_now > real + MS)  // not between end() and begin(), the board takes microseconds there
+    usleep((sim_now - real) / US);
+  if (sim_now - pty_read_at >= 20 * US)
+    pty_read();
+  if (!bridge.empty() && (sim_now >= bridge.front().at + sim_latency ||  // the timer ran out
+                          (bridge.size() >= 62 && bridge[61].at <= sim_now)))  // a packet is full
+    bridge_flush();
+}
+
+static void pty_poll(void) {  // Nothing to read: with nothing to do, virtual time keeps pace with real time
+  struct pollfd p = { sim_pty, POLLIN, 0 };
+  uint64_t real;
+
+  if (!real_start)
+    real_start = real_now() - sim_now;
+  real = real_now() - real_start;
+  poll(&p, 1, sim_now > real ? (sim_now - real) / MS < 10 ? (sim_now - real) / MS : 10 : 0);
+  real = real_now() - real_start;
+  if (!rx.empty() && real > rx.front().at)  // catching up mustn't skip input already on the way
+    real = rx.front().at;
+  if (real > sim_now)
+    sim_advance(real - sim_now);
+  if (p.revents & POLLIN)  // after catching up: it arrives from now on
+    pty_read();
+  else if (p.revents & POLLHUP)  // nobody has the other end open
+    usleep(1000);
+}
+
+int SimSerial::available(void) {
+  int n = 0;
+
+  sim_advance(sim_cost.call);
+  if (!serial_open)
+    return 0;
+  if (sim_pty >= 0 && (rx.empty() || rx.front().at > sim_now)) {
+    pty_poll();
+  } else if (rx.empty() && !input.empty()) {  // the sketch waits for the host: send the next chunk
+    const std::string &s = input.front();
+    for (size_t i = 0; i < s.size(); i++)
+      rx.push_back((sim_byte) { sim_now + (i + 1) * char_ns, (uint8_t) s[i] });
+    input.pop_front();
+  }
+  for (auto b = rx.begin(); b != rx.end() && b->at <= sim_now; )  // the 64 byte ring holds 63, the rest is lost
+    if (++n > 63)
+      b = rx.erase(b);
+    else
+      b++;
+  return n > 63 ? 63 : n;
+}
+
+int SimSerial::read(void) {
+  uint8_t c;
+
+  if (!available() || rx.front().at > sim_now)
+    return -1;
+  c = rx.front().value;
+  rx.pop_front();
+  return c;
+}
+
+void SimSerial::flush(void) {
+  if (tx_end > sim_now)
+    sim_advance(tx_end - sim_now);
+}
+
+size_t SimSerial::write(uint8_t c) {
+  uint64_t start;
+
+  sim_advance(sim_cost.serial_write);
+  if (!serial_open)  // the transmitter is off, the byte never goes out
+    return 1;
+  start = tx_end > sim_now ? tx_end : sim_now;
+  if (start > sim_now + 64 * char_ns)  // buffer full: wait for room
+    sim_advance(start - 64 * char_ns - sim_now);
+  tx.push_back((sim_byte) { start, c });
+  tx_end = start + char_ns;
+  sim_output += (char) c;
+  if (sim_pty >= 0)
+    bridge.push_back((sim_byte) { start + char_ns, on_wire(c) });
+  if (sim_echo)
+    fputc(c, sim_echo);
+  return 1;
+}
+
+size_t SimSerial::write(const uint8_t *buf, size_t len) {
+  for (size_t i = 0; i < len; i++)
+    write(buf[i]);
+  return len;
+}
+
+size_t SimSerial::print(const char *s) {
+  return write((const uint8_t *) s, strlen(s));
+}
+
+size_t SimSerial::print(unsigned long n, int base) {
+  char buf[8 * sizeof(n) + 1];
+  char *p = &buf[sizeof(buf) - 1];
+
+  *p = 0;
+  do {
+    uint8_t d = n % base;
+    *--p = d < 10 ? '0' + d : 'A' + d - 10;
+    n /= base;
+  } while (n);
+  return print(p);
+}
+
+size_t SimSerial::print(long n, int base) {
+  if (n < 0 && base == DEC)
+    return print('-') + print((unsigned long) -n, base);
+  return print((unsigned long) n, base);
+}
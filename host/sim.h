@@ -0,0 +1,55 @@
+/*
+  Host simulation of the sketch on an Arduino with the HV Rescue Shield, see Arduino.h.
+
+  Time is virtual, in ns, and only moves when the sketch spends it: every core call and register access
+  advances it by what it takes on the board.  The target model (target_model.h) sees each change of the shield
+  lines at the time it happens and checks the datasheet timing.
+*/
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include "target_model.h"
+
+struct sim_costs {          // time the board takes, in ns
+  uint32_t write_pin;       // digitalWrite until the pin changes
+  uint32_t write_after;     // digitalWrite after the pin changed
+  uint32_t read_pin;        // digitalRead
+  uint32_t pin_mode;
+  uint32_t reg;             // one I/O register access (in, out, sbi/cbi take two)
+  uint32_t delay_short;     // delayMicroseconds(0) and (1)
+  uint32_t call;            // millis(), micros(), Serial.available()...
+  uint32_t serial_write;    // Serial.write() of one byte into the buffer
+};
+
+extern const sim_costs sim_costs_arduino;    // Arduino core, Uno at 16 MHz
+extern const sim_costs sim_costs_baremetal;  // baremetal.h, constant pins
+extern sim_costs sim_cost;
+
+struct sim_end {            // thrown to stop the sketch
+  const char *why;
+};
+
+extern uint64_t sim_now;    // virtual time, in ns
+extern uint64_t sim_limit;  // sim_end "time limit" there
+extern tm_target *sim_socket[3];  // part in the shield for each mode of the sketch (ATMEGA, TINY2313, HVSP), NULL =
+                                  // none; the operator swaps parts when the sketch changes mode
+extern uint64_t sim_vcc_ns;    // time the target was powered so far
+extern uint64_t sim_link_down_ns;  // time the host link was closed between Serial.end() and Serial.begin() so far
+extern FILE *sim_trace;     // GPIOR0 markers with their GPIOR1/GPIOR2 arguments, NULL = off
+extern bool sim_trace_time; // prefix each marker with its time, in us
+extern FILE *sim_echo;      // copy of the serial output, NULL = off
+extern int sim_pty;         // master side of a pty as the host link instead of the --input chunks, -1 = none
+extern uint32_t sim_max_baud;  // pty: fastest rate the USB serial bridge takes, 0 = any
+extern uint64_t sim_latency;   // pty: latency timer of the bridge, in ns
+extern std::string sim_output;  // serial output so far
+
+void sim_advance(uint64_t ns);
+void sim_button(uint64_t from, uint64_t until);  // button held down from/until, in virtual ns
+void sim_input(const char *chunk);  // host input, sent in one go when the sketch polls Serial with nothing left
+void sim_sleep(void);
+
+#endif
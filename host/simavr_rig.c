@@ -0,0 +1,363 @@
+/*
+  simavr rig: the firmware image built with SIMAVR runs in simavr against the target model (target_model.c), so
+  the bus primitives as compiled can be timed cycle for cycle with a part answering them.  Uno (ATmega328P) only.
+
+  simavr_rig [options] ATRescue.elf
+    --part NAME      part in the shield (default atmega328p), one for each mode may be given as with atrescue_sim;
+                     the sketch's mode variable (read through the ELF symbol table) picks the one in the shield
+    --trace FILE     GPIOR0 markers with their GPIOR1/GPIOR2 arguments and the bus events of the parts ("@ ..."),
+                     the format of atrescue_sim and host/golden, '-' = stdout
+    --trace-time     prefix the markers with their time, in us
+    --press MS       press the button at MS for 500 ms, may be repeated
+    --pty            UART0 on a pty through the uart_pty part of simavr (/tmp/simavr-uart0), for the host tools
+    --limit S        simulated time limit, in s (default 60)
+
+  The shield lines are PORTB/PORTC/PORTD with their DDRs, passed on to the model at every write, at the cycle of
+  the instruction.  The model drives RDY/SDO (PB5) and DATA (PORTD) back through the pin IRQs, again when its
+  outputs change on their own (busy time, output delays).  While the UART is on it owns PD0/PD1, as in the host
+  simulation.  The read timing figures (tOLDV, tBVDV, tSHOV) need the moment the sketch reads PINB/PIND, which
+  simavr doesn't report, so only the host simulation checks those.
+
+  A SIM_SCRIPT image runs its script and sleeps with interrupts off, which ends the run; its trace compares with
+  host/golden/script.trace as the host simulation's does (the logical trace has no time in it).  The last line is
+  "result time_us=.. margin=.. worst=.. violations=..", as in atrescue_sim.  The .mmcu section of the image still
+  writes atrescue.vcd.
+
+  Needs simavr (libsimavr, its headers and examples/parts/uart_pty.c) and libelf: "make simavr_rig" in host/,
+  with SIMAVR_INC, SIMAVR_LIB and SIMAVR_PARTS pointing at them.
+*/
+
+#include <fcntl.h>
+#include <gelf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+#include "sim_time.h"
+#include "sim_cycle_timers.h"
+#include "avr_ioport.h"
+#include "uart_pty.h"
+#include "target_model.h"
+
+// ATmega328P registers, data space addresses
+#define  R_DDRB    0x24
+#define  R_PORTB   0x25
+#define  R_DDRC    0x27
+#define  R_PORTC   0x28
+#define  R_DDRD    0x2A
+#define  R_PORTD   0x2B
+#define  R_GPIOR0  0x3E
+#define  R_GPIOR1  0x4A
+#define  R_GPIOR2  0x4B
+#define  R_UCSR0B  0xC1
+#define  RXEN0     4
+#define  TXEN0     3
+
+// Shield wiring, port bits (see Pin Assignments in main.cpp)
+#define  B_XA0     0  // PORTB
+#define  B_BS2     1
+#define  B_WR      2
+#define  B_OE      3
+#define  B_VCC     4
+#define  B_RDY     5
+#define  C_RST     0  // PORTC, 12V_EN active low
+#define  C_BUTTON  1
+#define  C_BS1     2
+#define  C_XTAL1   3
+#define  C_XA1     4
+#define  C_PAGEL   5
+
+#ifndef _BV
+#define  _BV(bit)  (1 << (bit))
+#endif
+
+static avr_t *avr;
+static struct tm_target parts[3];
+static struct tm_target *socket[3];  // part for each mode
+static struct tm_target *target;     // in the shield now
+static int nparts;
+static int mode_addr = -1;           // the sketch's mode variable, -1 = unknown
+static unsigned last_lines;
+static uint8_t last_data, last_mask;
+static int busy;                     // the rig itself raises pins, the port IRQs come back
+static int pressed;                  // button
+static FILE *trace;
+static int trace_time;
+static avr_irq_t *rdy_irq, *data_irq[8], *button_irq;
+
+static const char *const marker_names[] = { "", "sclk", "strobe_xtal", "send_cmd", "fuse_burn", "fuse_read",
+                                            "hvsp_read", "hvsp_write", "hv_enter", "hv_exit", "load_addr",
+                                            "load_data", "data_read" };
+
+static void usage(const char *msg) {
+  fprintf(stderr, "simavr_rig: %s (see the comment at the top of simavr_rig.c)\n", msg);
+  exit(2);
+}
+
+static uint64_t now(void) {  // simulated time, in ns
+  return avr_cycles_to_nsec(avr, avr->cycle);
+}
+
+static avr_cycle_count_t cycles(uint64_t ns) {  // first cycle at or after ns
+  return (ns * avr->frequency + 999999999) / 1000000000;
+}
+
+static int symbol(const char *file, const char *name) {  // data address of a variable of the image, -1 if none
+  int fd = open(file, O_RDONLY), addr = -1;
+  Elf *elf;
+  Elf_Scn *scn = NULL;
+  GElf_Shdr sh;
+  GElf_Sym sym;
+  Elf_Data *data;
+
+  if (fd < 0 || elf_version(EV_CURRENT) == EV_NONE || !(elf = elf_begin(fd, ELF_C_READ, NULL))) {
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  while ((scn = elf_nextscn(elf, scn)) && addr < 0) {
+    if (!gelf_getshdr(scn, &sh) || sh.sh_type != SHT_SYMTAB || !(data = elf_getdata(scn, NULL)))
+      continue;
+    for (size_t i = 0; i < sh.sh_size / sh.sh_entsize; i++)
+      if (gelf_getsym(data, i, &sym) && !strcmp(elf_strptr(elf, sh.sh_link, sym.st_name), name))
+        addr = sym.st_value & 0xFFFF;  // the data space is at 0x800000 in an AVR image
+  }
+  elf_end(elf);
+  close(fd);
+  return addr;
+}
+
+static void inputs(void) {  // RDY/SDO, DATA and the button, pull-ups where nothing drives them
+  uint64_t ns = now();               // (simavr raises the pull-ups again at every PORT write)
+  uint8_t data = 0, driven = target ? tm_data(target, ns, &data) : 0;
+  int rdy = target ? tm_rdy(target, ns) : -1;
+
+  busy++;
+  avr_raise_irq(rdy_irq, rdy >= 0 ? rdy : (avr->data[R_PORTB] >> B_RDY) & 1);
+  for (int i = 0; i < 8; i++)
+    avr_raise_irq(data_irq[i], (((driven & _BV(i)) ? data : avr->data[R_PORTD]) >> i) & 1);
+  avr_raise_irq(button_irq, !pressed);
+  busy--;
+}
+
+static avr_cycle_count_t change(avr_t *a, avr_cycle_count_t when, void *param) {  // the target's outputs moved
+  uint64_t next;
+
+  (void) a;
+  (void) when;
+  (void) param;
+  inputs();
+  next = target ? tm_next_change(target, now()) : 0;
+  return next ? cycles(next) : 0;
+}
+
+static void drive(void) {  // Pass the shield lines on to the target, as lines_sync() in sim.cpp
+  static const struct { uint8_t reg, bit; unsigned line; } lines_of[] = {
+    { R_PORTC, C_XTAL1, TM_XTAL1 }, { R_PORTB, B_OE, TM_OE }, { R_PORTB, B_WR, TM_WR }, { R_PORTC, C_BS1, TM_BS1 },
+    { R_PORTB, B_XA0, TM_XA0 }, { R_PORTC, C_XA1, TM_XA1 }, { R_PORTC, C_PAGEL, TM_PAGEL }, { R_PORTB, B_BS2, TM_BS2 }
+  };
+  uint8_t *d = avr->data, data = d[R_PORTD], mask = d[R_DDRD];
+  unsigned lines = 0;
+  struct tm_target *part = socket[0];
+  uint64_t ns = now(), next;
+
+  if (mode_addr >= 0 && d[mode_addr] < 3)  // the operator puts in the part for the sketch's mode
+    part = socket[d[mode_addr]];
+  if ((d[R_PORTB] & d[R_DDRB]) & _BV(B_VCC))
+    lines |= TM_VCC;
+  if ((~d[R_PORTC] & d[R_DDRC]) & _BV(C_RST))
+    lines |= TM_HV;
+  for (unsigned i = 0; i < sizeof(lines_of) / sizeof(lines_of[0]); i++)
+    if (d[lines_of[i].reg] & _BV(lines_of[i].bit))
+      lines |= lines_of[i].line;
+  if (d[R_DDRB] & _BV(B_RDY))
+    lines |= TM_RDY_DRIVEN | ((d[R_PORTB] & _BV(B_RDY)) ? TM_RDY : 0);
+  if (d[R_UCSR0B] & _BV(TXEN0)) {  // TXD idles high
+    data |= _BV(1);
+    mask |= _BV(1);
+  }
+  if (d[R_UCSR0B] & _BV(RXEN0)) {  // RXD is held high by the USB serial chip
+    data |= _BV(0);
+    mask &= ~_BV(0);
+  }
+
+  if (part != target) {
+    if (target)  // taken out: it sees everything off
+      tm_drive(target, ns, 0, 0, 0);
+    target = part;
+    last_lines = ~lines;
+  }
+  if (target && (lines != last_lines || data != last_data || mask != last_mask)) {
+    tm_drive(target, ns, lines, data, mask);
+    avr_cycle_timer_cancel(avr, change, NULL);
+    next = tm_next_change(target, ns);
+    if (next)
+      avr_cycle_timer_register(avr, cycles(next) - avr->cycle, change, NULL);
+  }
+  last_lines = lines;
+  last_data = data;
+  last_mask = mask;
+  inputs();
+}
+
+static void port_changed(avr_irq_t *irq, uint32_t value, void *param) {  // PORT or DDR write
+  (void) irq;
+  (void) value;
+  (void) param;
+  if (!busy)
+    drive();
+}
+
+static void gpior0_write(avr_t *a, avr_io_addr_t addr, uint8_t value, void *param) {  // marker
+  uint8_t m = value & 0x7F;
+
+  (void) param;
+  a->data[addr] = value;
+  if (!trace)
+    return;
+  if (trace_time)
+    fprintf(trace, "%10.3f ", now() / 1000.0);
+  if (m < sizeof(marker_names) / sizeof(marker_names[0]))
+    fprintf(trace, "%s%s", marker_names[m], (value & 0x80) ? ".end" : "");
+  else
+    fprintf(trace, "marker%u%s", m, (value & 0x80) ? ".end" : "");
+  fprintf(trace, " %02X %02X\n", a->data[R_GPIOR1], a->data[R_GPIOR2]);
+}
+
+static avr_cycle_count_t button(avr_t *a, avr_cycle_count_t when, void *param) {  // press, then release
+  (void) a;
+  (void) when;
+  pressed = (param == NULL);
+  inputs();
+  return 0;
+}
+
+static void print_margin(const char *prefix, int first, int last) {  // "margin=.. worst=.." of the result line
+  int worst = -1, check;
+  double margin = 1e9, m;
+
+  for (int p = 0; p < nparts; p++) {
+    m = tm_margin(&parts[p], first, last, &check);
+    if (check >= 0 && m < margin) {
+      margin = m;
+      worst = check;
+    }
+  }
+  if (worst < 0)
+    printf(" %smargin=- %sworst=-", prefix, prefix);
+  else
+    printf(" %smargin=%.3f %sworst=%s", prefix, margin, prefix, tm_limits[worst].name);
+}
+
+int main(int argc, char **argv) {
+  const char *names[3] = { "atmega328p" }, *image = NULL, *trace_file = NULL;
+  unsigned long presses[16], violations = 0;
+  int npresses = 0, pty = 0, state = cpu_Running;
+  uint64_t limit = 60000000000ULL;
+  elf_firmware_t firmware;
+  uart_pty_t uart;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--trace-time")) {
+      trace_time = 1;
+    } else if (!strcmp(argv[i], "--pty")) {
+      pty = 1;
+    } else if (argv[i][0] != '-') {
+      image = argv[i];
+    } else if (i + 1 >= argc) {
+      usage("option without its argument");
+    } else if (!strcmp(argv[i], "--part")) {
+      if (nparts == 3)
+        usage("at most 3 parts");
+      names[nparts++] = argv[++i];
+    } else if (!strcmp(argv[i], "--trace")) {
+      trace_file = argv[++i];
+    } else if (!strcmp(argv[i], "--press")) {
+      if (npresses == (int) (sizeof(presses) / sizeof(presses[0])))
+        usage("too many presses");
+      presses[npresses++] = strtoul(argv[++i], NULL, 0);
+    } else if (!strcmp(argv[i], "--limit")) {
+      limit = strtoull(argv[++i], NULL, 0) * 1000000000ULL;
+    } else {
+      usage("unknown option");
+    }
+  }
+  if (!image)
+    usage("no firmware image");
+
+  if (trace_file) {
+    trace = strcmp(trace_file, "-") ? fopen(trace_file, "w") : stdout;
+    if (!trace)
+      usage("can't write the trace");
+  }
+  if (nparts == 0)
+    nparts = 1;
+  for (int p = 0; p < nparts; p++) {
+    const struct tm_part *part = tm_find_part(names[p]);
+    if (!part)
+      usage("unknown part");
+    tm_init(&parts[p], part);
+    parts[p].log = trace;
+    if (nparts == 1) {  // in the shield whatever the mode
+      socket[0] = socket[1] = socket[2] = &parts[0];
+    } else {
+      if (socket[part->family])
+        usage("two parts for one mode");
+      socket[part->family] = &parts[p];
+    }
+  }
+
+  memset(&firmware, 0, sizeof(firmware));
+  if (elf_read_firmware(image, &firmware))
+    usage("can't read the firmware image");
+  if (strcmp(firmware.mmcu, "atmega328p"))
+    usage("not an ATmega328P image built with SIMAVR");
+  if ((mode_addr = symbol(image, "mode")) < 0 && nparts > 1)
+    usage("no mode variable in the image, one part only");
+  avr = avr_make_mcu_by_name(firmware.mmcu);
+  if (!avr || avr_init(avr))
+    usage("simavr can't make the MCU");
+  avr_load_firmware(avr, &firmware);
+
+  for (char port = 'B'; port <= 'D'; port++) {
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(port), IOPORT_IRQ_PIN_ALL), port_changed,
+                            NULL);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(port), IOPORT_IRQ_DIRECTION_ALL),
+                            port_changed, NULL);
+  }
+  rdy_irq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), B_RDY);
+  for (int i = 0; i < 8; i++)
+    data_irq[i] = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), i);
+  button_irq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('C'), C_BUTTON);
+  for (int i = 0; i < npresses; i++) {
+    avr_cycle_timer_register(avr, cycles(presses[i] * 1000000ULL), button, NULL);
+    avr_cycle_timer_register(avr, cycles((presses[i] + 500) * 1000000ULL), button, (void *) 1);
+  }
+  inputs();
+  avr_register_io_write(avr, R_GPIOR0, gpior0_write, NULL);
+  if (pty) {
+    uart_pty_init(avr, &uart);
+    uart_pty_connect(&uart, '0');
+  }
+
+  while (state != cpu_Done && state != cpu_Crashed && now() < limit)
+    state = avr_run(avr);
+
+  if (pty)
+    uart_pty_stop(&uart);
+  if (state == cpu_Crashed)
+    fprintf(stderr, "run ended: the firmware crashed\n");
+  printf("result time_us=%llu", (unsigned long long) (now() / 1000));
+  print_margin("", 0, TM_CHECKS - 1);
+  print_margin("entry_", TM_VCC_HV_MIN, TM_SDO_RELEASE);
+  print_margin("bus_", TM_XHXL, TM_SHOV);
+  for (int p = 0; p < nparts; p++)
+    violations += tm_violations(&parts[p]);
+  printf(" violations=%lu\n", violations);
+  if (trace && trace != stdout)
+    fclose(trace);
+  return state != cpu_Crashed && !violations ? 0 : 1;
+}
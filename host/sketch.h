@@ -0,0 +1,34 @@
+/*
+  Globals of the sketch (main.cpp) the simulation harness sets before setup() or reads back, declared as there.
+*/
+
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <Arduino.h>
+
+#define  ENTRY_VARIANTS  3
+
+struct timing_t {  // bus timing, in us
+  word sclk;
+  word strobe;
+  word oe;
+  word wr;
+};
+
+struct entry_profile {
+  byte vcc_to_hv;    // VCC high to 12V on !RESET, in us
+  byte sdo_release;  // 12V to SDO release (HVSP only), in us
+  byte settle;       // 12V to !OE/!WR release, in us
+  byte cmd_wait;     // wait before the first command, in ms
+};
+
+extern byte mode;
+extern unsigned long baud;
+extern timing_t timing;
+extern entry_profile entry_profiles[][ENTRY_VARIANTS];
+
+void setup();
+void loop();
+
+#endif
@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+"""
+Timing sweep over the host simulation: runs atrescue_sim for every combination of bus and entry timings, one
+simulation per CPU in parallel, and reports the timings that are both fast and reliable.
+
+A point is reliable when the fuses come out as burned and no datasheet figure is violated at any --vcc-rise
+corner.  Its cost is the session time (target powered, at the slowest corner), its robustness two margins, the
+smallest slack of a datasheet figure relative to the figure at the worst corner: one for the entry sequence
+figures, one for the bus figures.  The Pareto set holds the reliable points no other point beats on all three
+(points with the same result are listed once, with the longest timings); the fastest reliable point is its first
+line.
+
+  python3 sweep.py                       HVPP (ATmega328P) and HVSP (ATtiny85) with the default grids
+  python3 sweep.py --mode hvsp --sclk 0,1,2,5 --costs baremetal
+  python3 sweep.py --csv sweep.csv       every point, for plotting
+
+Grids are comma separated lists or start:stop:step ranges (stop included).  The sketch takes the result with the
+timing host command and T_* (bus timing) and entry_profiles variant 0 (entry timing).
+"""
+
+import argparse
+import concurrent.futures
+import csv
+import itertools
+import os
+import subprocess
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+MODES = {  # part, what the operator types, fuses expected afterwards, swept timings
+  "hvpp": ("atmega328p", "1|0xE2|0xDE", "L=E2,H=DE", ("strobe", "oe", "wr", "vcc_to_hv")),
+  "tiny2313": ("attiny2313", "2|0xE4|0xDE", "L=E4,H=DE", ("strobe", "oe", "wr", "vcc_to_hv")),
+  "hvsp": ("attiny85", "3|0xE2|0xDE", "L=E2,H=DE", ("sclk", "vcc_to_hv", "sdo_release")),
+}
+
+DEFAULTS = {  # sketch defaults (T_*, entry variant 0), used for the timings a mode doesn't sweep
+  "sclk": 1000, "strobe": 1000, "oe": 1000, "wr": 1000, "vcc_to_hv": 80, "sdo_release": 1, "settle": 10, "cmd_wait": 1,
+}
+
+GRIDS = {
+  "sclk": "0,1,2,5,10,20,50,100,1000",
+  "strobe": "0,1,2,5,100,1000",
+  "oe": "0,1,2,5,100,1000",
+  "wr": "0,1,2,5,100,1000",
+  "vcc_to_hv": "50:90:10",
+  "sdo_release": "0,1,2,5,10,20",
+  "settle": "10",
+  "cmd_wait": "1",
+}
+
+
+def grid(spec):
+  values = []
+  for item in spec.split(","):
+    if ":" in item:
+      start, stop, step = (int(v) for v in item.split(":"))
+      values.extend(range(start, stop + 1, step))
+    else:
+      values.append(int(item))
+  return values
+
+
+def simulate(sim, mode, point, args):  # one point at every corner, the worst result
+  part, text, expect, _ = MODES[mode]
+  result = {"ok": 1, "session_us": 0, "cycle_us": 0, "violations": 0,
+            "entry_margin": 1e9, "entry_worst": "-", "bus_margin": 1e9, "bus_worst": "-"}
+  for rise in args.vcc_rise:
+    cmd = [sim, "--part", part, "--input", text, "--expect", expect, "--costs", args.costs, "--vcc-rise", str(rise),
+           "--timing", "%(sclk)d,%(strobe)d,%(oe)d,%(wr)d" % point,
+           "--entry", "%(vcc_to_hv)d,%(sdo_release)d,%(settle)d,%(cmd_wait)d" % point]
+    out = subprocess.run(cmd, capture_output=True, text=True).stdout.splitlines()
+    fields = dict(f.split("=", 1) for f in out[-1].split()[1:]) if out and out[-1].startswith("result") else {}
+    if not fields:
+      result["ok"] = 0
+      continue
+    result["ok"] &= int(fields["ok"])
+    result["violations"] += int(fields["violations"])
+    result["session_us"] = max(result["session_us"], int(fields["session_us"]))
+    result["cycle_us"] = max(result["cycle_us"], int(fields["cycle_us"]))
+    for group in ("entry_", "bus_"):
+      if fields[group + "worst"] != "-" and float(fields[group + "margin"]) < result[group + "margin"]:
+        result[group + "margin"] = float(fields[group + "margin"])
+        result[group + "worst"] = "%s@%dus" % (fields[group + "worst"], rise)
+  result["reliable"] = int(result["ok"] and not result["violations"])
+  return result
+
+
+def beats(q, p):  # q at least as good as p on session time and both margins, better on one
+  a = (-q["session_us"], q["entry_margin"], q["bus_margin"])
+  b = (-p["session_us"], p["entry_margin"], p["bus_margin"])
+  return all(x >= y for x, y in zip(a, b)) and a != b
+
+
+def pareto(points):  # reliable points no other one beats, fastest first
+  reliable = {}
+  for p in points:  # of points with the same result, the one with the longest timings (last in grid order)
+    if p["reliable"]:
+      reliable[(p["session_us"], p["entry_margin"], p["bus_margin"])] = p
+  front = [p for p in reliable.values() if not any(beats(q, p) for q in reliable.values())]
+  return sorted(front, key=lambda p: (p["session_us"], -p["bus_margin"], -p["entry_margin"]))
+
+
+def sweep(mode, args):
+  names = ("sclk", "strobe", "oe", "wr", "vcc_to_hv", "sdo_release", "settle", "cmd_wait")
+  swept = MODES[mode][3]
+  axes = [grid(getattr(args, n)) if n in swept or getattr(args, n) != GRIDS[n] else [DEFAULTS[n]] for n in names]
+  points = [dict(zip(names, values)) for values in itertools.product(*axes)]
+  sim = os.path.join(HERE, args.sim)
+
+  with concurrent.futures.ThreadPoolExecutor(max_workers=args.jobs) as pool:  # each job waits on its process
+    results = list(pool.map(lambda p: simulate(sim, mode, p, args), points))
+  for p, r in zip(points, results):
+    p.update(r)
+
+  reliable = sum(p["reliable"] for p in points)
+  print("%s: %d points, %d reliable (%s costs, VCC rise %s us)" % (mode, len(points), reliable, args.costs,
+                                                                  ",".join(str(r) for r in args.vcc_rise)))
+  cols = [n for n in names if len(set(p[n] for p in points)) > 1]
+  print("  %s  %10s %10s  %-22s  %s" % ("  ".join("%11s" % c for c in cols), "session_us", "cycle_us", "entry margin",
+                                       "bus margin"))
+  for p in pareto(points):
+    print("  %s  %10d %10d  %6.3f %-15s  %6.3f %s" % ("  ".join("%11d" % p[c] for c in cols), p["session_us"],
+                                                      p["cycle_us"], p["entry_margin"], p["entry_worst"],
+                                                      p["bus_margin"], p["bus_worst"]))
+  if not reliable:
+    print("  no reliable point")
+  return points
+
+
+def main():
+  parser = argparse.ArgumentParser(description="Bus and entry timing sweep over the host simulation")
+  parser.add_argument("--mode", choices=sorted(MODES), action="append", help="default: hvpp and hvsp")
+  parser.add_argument("--sim", default="atrescue_sim", help="simulation binary (board), in this directory")
+  parser.add_argument("--costs", default="arduino", choices=("arduino", "baremetal"))
+  parser.add_argument("--vcc-rise", default="30,40,50", type=grid, help="VCC rise corners, in us")
+  parser.add_argument("--jobs", type=int, default=os.cpu_count() or 1)
+  parser.add_argument("--csv", help="write every point to this file")
+  for name, spec in GRIDS.items():
+    parser.add_argument("--" + name.replace("_", "-"), default=spec, dest=name)
+  args = parser.parse_args()
+
+  if not os.path.exists(os.path.join(HERE, args.sim)):
+    sys.exit("%s not built, run make first" % args.sim)
+  rows = []
+  for mode in args.mode or ["hvpp", "hvsp"]:
+    rows += [dict(p, mode=mode) for p in sweep(mode, args)]
+  if args.csv:
+    with open(args.csv, "w", newline="") as f:
+      writer = csv.DictWriter(f, fieldnames=list(rows[0].keys()))
+      writer.writeheader()
+      writer.writerows(rows)
+
+
+if __name__ == "__main__":
+  main()
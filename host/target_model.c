@@ -0,0 +1,600 @@
+/*
+  Target model, see target_model.h.
+*/
+
+#include <stdarg.h>
+#include <string.h>
+#include "target_model.h"
+
+#define  US  1000ULL
+#define  MS  1000000ULL
+
+#define  T_WRITE     (4500 * US)  // tWLRH: fuse, lock bits, flash page and EEPROM writes
+#define  T_ERASE     (9000 * US)  // tWLRH_CE: chip erase
+
+// Checks waiting for a later edge (pending)
+#define  P_ENTRY     0x001  // Prog_enable pins must not move for 10 us after 12V
+#define  P_FIRST     0x002  // no command seen yet, the first one must wait 300 us
+#define  P_SDO       0x004  // the shield still drives SDO after 12V (HVSP)
+#define  P_XTAL      0x008  // hold after XTAL1 low
+#define  P_PAGEL     0x010  // BS1 hold after PAGEL low
+#define  P_WR        0x020  // BS1/BS2 hold after !WR low
+#define  P_SCI       0x040  // SDI/SII hold after SCI high (HVSP)
+#define  P_PAGEL_WR  0x080  // PAGEL low to the next !WR low
+#define  P_XTAL_UP   0x100  // an XTAL1 pulse is running, loaded at its falling edge
+#define  P_SCI_UP    0x200  // an SCI pulse is running, shifted in at its falling edge (HVSP)
+#define  P_XTAL_SEEN 0x400  // XTAL1 had a falling edge since 12V
+#define  P_SCI_SEEN  0x800  // SCI had a falling edge since 12V (HVSP)
+
+#define  DATA_LINE   TM_LINES  // index of DATA in changed[]
+
+const struct tm_part tm_parts[] = {
+  { "atmega328p", TM_HVPP,     { 0x1E, 0x95, 0x0F }, { 0x62, 0xD9, 0xFF }, 16384, 64, 1024, 1, 0x08 },
+  { "atmega168",  TM_HVPP,     { 0x1E, 0x94, 0x06 }, { 0x62, 0xDF, 0xF9 },  8192, 64,  512, 1, 0x08 },
+  { "attiny2313", TM_TINY2313, { 0x1E, 0x91, 0x0A }, { 0x64, 0xDF, 0xFF },  1024, 16,  128, 1, 0x40 },
+  { "attiny85",   TM_HVSP,     { 0x1E, 0x93, 0x0B }, { 0x62, 0xDF, 0xFF },  4096, 32,  512, 1, 0x08 },
+  { "attiny13",   TM_HVSP,     { 0x1E, 0x90, 0x07 }, { 0x6A, 0xFF, 0xFF },   512, 16,   64, 0, 0x40 },
+  { NULL, 0, { 0 }, { 0 }, 0, 0, 0, 0, 0 }
+};
+
+const struct tm_limit tm_limits[TM_CHECKS] = {
+  { "vcc_hv_min",  20000, 0 },  // VCC up to 12V on !RESET: 20-60 us
+  { "vcc_hv_max",  60000, 1 },
+  { "prog_enable", 10000, 0 },  // Prog_enable pins held after 12V
+  { "first_cmd",  300000, 0 },  // 12V to the first command
+  { "sdo_release",     0, 1 },  // 12V to SDO let go by the shield, sdo_drive of the target
+  { "tXHXL", 150, 0 },          // XTAL1 pulse width high
+  { "tXLXH", 200, 0 },          // XTAL1 low to XTAL1 high
+  { "tDVXH",  67, 0 },          // DATA and control valid before XTAL1 high
+  { "tXLDX",  67, 0 },          // DATA and control hold after XTAL1 low
+  { "tBVPH",  67, 0 },          // BS1 valid before PAGEL high
+  { "tPHPL", 150, 0 },          // PAGEL pulse width high
+  { "tPLBX",  67, 0 },          // BS1 hold after PAGEL low
+  { "tBVWL",  67, 0 },          // BS1/BS2 valid to !WR low
+  { "tWLWH", 150, 0 },          // !WR pulse width low
+  { "tWLBX",  67, 0 },          // BS1/BS2 hold after !WR low
+  { "tPLWL",  67, 0 },          // PAGEL low to !WR low
+  { "tOLDV", 250, 0 },          // !OE low to DATA valid
+  { "tBVDV", 250, 0 },          // BS1/BS2 valid to DATA valid
+  { "tOHDZ", 250, 0 },          // !OE high to DATA tri-stated, the shield must not drive DATA before
+  { "tSHSL", 110, 0 },          // SCI pulse width high
+  { "tSLSH", 110, 0 },          // SCI pulse width low
+  { "tIVSH",  50, 0 },          // SDI/SII valid before SCI high
+  { "tSHIX",  50, 0 },          // SDI/SII hold after SCI high
+  { "tSHOV",  16, 0 },          // SCI high to SDO valid
+  { "busy",    0, 0 },          // a command while RDY/SDO is low
+};
+
+static const unsigned line_bit[TM_LINES] = {
+  TM_VCC, TM_HV, TM_XTAL1, TM_OE, TM_WR, TM_BS1, TM_XA0, TM_XA1, TM_PAGEL, TM_BS2, TM_RDY, TM_RDY_DRIVEN
+};
+
+const struct tm_part *tm_find_part(const char *name) {
+  for (const struct tm_part *p = tm_parts; p->name; p++)
+    if (strcmp(p->name, name) == 0)
+      return p;
+  return NULL;
+}
+
+uint32_t tm_limit_ns(const struct tm_target *t, int check) {
+  return check == TM_SDO_RELEASE ? t->sdo_drive : tm_limits[check].ns;
+}
+
+static int64_t record(struct tm_target *t, int check, int64_t slack) {  // Account one check, returns the slack
+  struct tm_stat *s = &t->stat[check];
+
+  if (s->count == 0 || slack < s->worst)
+    s->worst = slack;
+  s->count++;
+  if (slack < 0)
+    s->violations++;
+  return slack;
+}
+
+static void event(const struct tm_target *t, const char *format, ...) {  // One line of the bus event log
+  va_list args;
+
+  if (!t->log)
+    return;
+  va_start(args, format);
+  fputs("@ ", t->log);
+  vfprintf(t->log, format, args);
+  fputc('\n', t->log);
+  va_end(args);
+}
+
+static int64_t since(uint64_t ns, uint64_t then) {
+  return (int64_t) (ns - then);
+}
+
+static uint64_t latest(const struct tm_target *t, unsigned lines) {  // last change of any of the lines
+  uint64_t last = 0;
+
+  for (int i = 0; i < TM_LINES; i++)
+    if ((lines & line_bit[i]) && t->changed[i] > last)
+      last = t->changed[i];
+  return last;
+}
+
+static unsigned settled(const struct tm_target *t, uint64_t ns, unsigned lines, unsigned mask, uint32_t setup) {
+  // Lines as the target takes them at ns: a line in mask that changed less than setup ago has its old level
+  for (int i = 0; i < TM_LINES; i++)
+    if ((mask & line_bit[i]) && ns - t->changed[i] < setup)
+      lines = (lines & ~line_bit[i]) | (t->before & line_bit[i]);
+  return lines;
+}
+
+void tm_init(struct tm_target *t, const struct tm_part *part) {
+  memset(t, 0, sizeof(*t));
+  t->part = part;
+  t->vcc_rise = 40 * US;
+  t->sdo_drive = 10 * US;
+  memset(t->flash, 0xFF, sizeof(t->flash));
+  memset(t->eeprom, 0xFF, sizeof(t->eeprom));
+  memcpy(t->fuse, part->fuse, sizeof(t->fuse));
+  t->lock = 0xFF;
+}
+
+static void reset(struct tm_target *t) {  // Programming interface back to its power up state
+  if (t->prog)
+    event(t, "exit");
+  t->prog = 0;
+  t->pending = 0;
+  t->cmd = 0;
+  t->addr[0] = t->addr[1] = 0;
+  t->load[0] = t->load[1] = 0;
+  t->page_loaded = 0;
+  t->ee_count = 0;
+  t->busy_until = 0;
+  t->out = t->out_old = 0xFF;
+  t->out_valid = t->drive_until = 0;
+  t->bit = 0;
+  t->instr = 0x0C;  // HVSP: !WR and !OE high, nothing else
+}
+
+static uint8_t read_out(const struct tm_target *t, uint8_t bs1, uint8_t bs2) {  // Output for the loaded command
+  const struct tm_part *p = t->part;
+  uint16_t addr = t->addr[1] << 8 | t->addr[0];
+  uint16_t word;
+
+  switch (t->cmd) {
+  case 0x08:  // signature, calibration byte with BS1 high
+    if (bs1)
+      return 0x80;
+    return t->addr[0] < 3 ? p->sig[t->addr[0]] : 0xFF;
+  case 0x04:  // fuses and lock bits
+    if (bs2)
+      return bs1 ? t->fuse[1] : t->fuse[2];
+    return bs1 ? t->lock : t->fuse[0];
+  case 0x02:  // flash, no read back in lock mode 3
+    if ((t->lock & 0x03) == 0)
+      return 0xFF;
+    word = t->flash[addr % p->flash_words];
+    return bs1 ? word >> 8 : word & 0xFF;
+  case 0x03:  // EEPROM
+    if ((t->lock & 0x03) == 0)
+      return 0xFF;
+    return t->eeprom[addr % p->eeprom_bytes];
+  }
+  return 0xFF;
+}
+
+static int ready(struct tm_target *t, uint64_t ns) {  // A command may run now, 0 = the target ignores it
+  if (t->pending & P_FIRST) {
+    if (record(t, TM_FIRST_CMD, since(ns, t->hv_at) - 300 * (int64_t) US) < 0)
+      return 0;
+    t->pending &= ~P_FIRST;
+  }
+  if (ns < t->busy_until) {
+    record(t, TM_BUSY, since(ns, t->busy_until));
+    return 0;
+  }
+  return 1;
+}
+
+static void do_load(struct tm_target *t, unsigned xa, uint8_t bs1, uint8_t value) {  // XTAL1 pulse
+  switch (xa) {
+  case 0:  // load address
+    t->addr[bs1] = value;
+    event(t, "load addr %s %02X", bs1 ? "hi" : "lo", value);
+    break;
+  case 1:  // load data
+    t->load[bs1] = value;
+    event(t, "load data %s %02X", bs1 ? "hi" : "lo", value);
+    break;
+  case 2:  // load command
+    t->cmd = value;
+    event(t, "load cmd %02X", value);
+    break;
+  }
+}
+
+static void do_latch(struct tm_target *t, uint8_t bs1) {  // PAGEL pulse: into the page buffer
+  const struct tm_part *p = t->part;
+  uint8_t any = p->family == TM_TINY2313;  // PAGEL is the BS1 pin
+  uint16_t addr = t->addr[1] << 8 | t->addr[0];
+  unsigned i;
+
+  if (t->cmd == 0x10 && (bs1 || any)) {
+    i = t->addr[0] & (p->page_words - 1);
+    t->page[i] = t->load[1] << 8 | t->load[0];
+    t->page_loaded |= 1ULL << i;
+    event(t, "latch flash %02X %04X", i, t->page[i]);
+  } else if (t->cmd == 0x11 && (!bs1 || any)) {
+    for (i = 0; i < t->ee_count && t->ee_addr[i] != addr % p->eeprom_bytes; i++)
+      ;
+    if (i == TM_EE_LATCHED)
+      i--;
+    t->ee_addr[i] = addr % p->eeprom_bytes;
+    t->ee_data[i] = t->load[0];
+    if (i == t->ee_count)
+      t->ee_count++;
+    event(t, "latch eeprom %04X %02X", t->ee_addr[i], t->ee_data[i]);
+  }
+}
+
+static void do_write(struct tm_target *t, uint64_t ns, uint8_t bs1, uint8_t bs2) {  // !WR pulse
+  const struct tm_part *p = t->part;
+  uint8_t locked = !(t->lock & 0x01);  // lock mode 2 or 3: flash, EEPROM and fuses can't be written
+  uint16_t base;
+  uint64_t time = T_WRITE;
+
+  switch (t->cmd) {
+  case 0x80:  // chip erase
+    event(t, "write erase");
+    memset(t->flash, 0xFF, sizeof(t->flash));
+    if (t->fuse[p->eesave_fuse] & p->eesave_mask)  // EESAVE not programmed
+      memset(t->eeprom, 0xFF, sizeof(t->eeprom));
+    t->lock = 0xFF;
+    time = T_ERASE;
+    break;
+  case 0x40:  // fuse: BS1 = HFUSE, BS2 = EFUSE
+    event(t, "write fuse %c %02X", bs1 ? 'H' : bs2 ? 'E' : 'L', t->load[0]);
+    if (!locked && !(bs1 && bs2))
+      t->fuse[bs1 ? 1 : bs2 ? 2 : 0] = t->load[0];
+    break;
+  case 0x20:  // lock bits, only programmed
+    event(t, "write lock %02X", t->load[0]);
+    t->lock &= t->load[0];
+    break;
+  case 0x10:  // flash page, bits can only be programmed
+    base = ((t->addr[1] << 8 | t->addr[0]) % p->flash_words) & ~(p->page_words - 1);
+    event(t, "write flash page %04X", base);
+    for (unsigned i = 0; i < p->page_words && !locked; i++)
+      if (t->page_loaded & (1ULL << i))
+        t->flash[base + i] &= t->page[i];
+    t->page_loaded = 0;
+    break;
+  case 0x11:  // EEPROM bytes latched
+    event(t, "write eeprom %u bytes", t->ee_count);
+    for (unsigned i = 0; i < t->ee_count && !locked; i++)
+      t->eeprom[t->ee_addr[i]] = t->ee_data[i];
+    t->ee_count = 0;
+    break;
+  default:
+    return;
+  }
+  t->busy_until = ns + time;
+}
+
+static void enter(struct tm_target *t, uint64_t ns, unsigned lines) {  // 12V applied
+  int64_t up = since(ns, t->vcc_at + t->vcc_rise);
+  uint8_t enable;
+
+  record(t, TM_VCC_HV_MIN, up - 20 * (int64_t) US);
+  record(t, TM_VCC_HV_MAX, 60 * (int64_t) US - up);
+  if (t->part->family == TM_HVSP)  // SDI, SII and SDO low
+    enable = !(lines & (TM_XA0 | TM_XA1)) && !((lines & TM_RDY_DRIVEN) && (lines & TM_RDY));
+  else                             // PAGEL, XA1, XA0 and BS1 low
+    enable = !(lines & (TM_PAGEL | TM_XA1 | TM_XA0 | TM_BS1));
+
+  reset(t);
+  t->prog = enable;
+  event(t, enable ? "enter" : "enter refused, Prog_enable pins not low");
+  t->hv_at = ns;
+  t->pending = P_ENTRY | P_FIRST;
+  if (t->part->family == TM_HVSP && (lines & TM_RDY_DRIVEN))
+    t->pending |= P_SDO;
+  if (!(lines & TM_OE)) {  // !OE already low: the output is on from now
+    t->oe_fall = ns;
+    t->out_valid = ns + tm_limits[TM_OLDV].ns;
+  }
+}
+
+static void entry_hold(struct tm_target *t, uint64_t ns) {  // A Prog_enable pin moved
+  if (t->pending & P_ENTRY) {
+    t->pending &= ~P_ENTRY;
+    if (record(t, TM_PROG_ENABLE, since(ns, t->hv_at) - 10 * (int64_t) US) < 0) {
+      event(t, "exit, Prog_enable pins moved too early");
+      t->prog = 0;  // not latched: the part runs its program instead
+    }
+  }
+}
+
+static void hvpp(struct tm_target *t, uint64_t ns, unsigned lines, unsigned diff, uint8_t ddiff) {
+  // Parallel programming: holds of the previous edges first, then the edges of this change
+  unsigned ctl = TM_XA0 | TM_XA1 | TM_BS1;
+  uint8_t tiny = t->part->family == TM_TINY2313;
+  uint8_t value;
+  uint64_t last;
+
+  if (diff & (TM_PAGEL | TM_XA1 | TM_XA0 | TM_BS1))
+    entry_hold(t, ns);
+
+  if ((diff & ctl) || ddiff) {  // DATA and control hold after XTAL1
+    if (t->pending & P_XTAL_UP) {
+      record(t, TM_XLDX, -(int64_t) tm_limits[TM_XLDX].ns);
+      t->xtal_lines = (t->xtal_lines & ~ctl) | (lines & ctl);  // the load takes the new levels
+      t->xtal_data = t->data;
+    } else if (t->pending & P_XTAL) {
+      record(t, TM_XLDX, since(ns, t->xtal_fall) - tm_limits[TM_XLDX].ns);
+    }
+    t->pending &= ~P_XTAL;
+  }
+  if ((diff & TM_BS1) && !tiny) {  // BS1 hold after PAGEL
+    if (lines & TM_PAGEL & ~diff) {
+      record(t, TM_PLBX, -(int64_t) tm_limits[TM_PLBX].ns);
+      t->pagel_lines = lines;
+    } else if (t->pending & P_PAGEL) {
+      record(t, TM_PLBX, since(ns, t->pagel_fall) - tm_limits[TM_PLBX].ns);
+    }
+    t->pending &= ~P_PAGEL;
+  }
+  if ((diff & (TM_BS1 | TM_BS2)) && (t->pending & P_WR)) {  // BS1/BS2 hold after !WR
+    record(t, TM_WLBX, since(ns, t->wr_fall) - tm_limits[TM_WLBX].ns);
+    t->pending &= ~P_WR;
+  }
+  if ((diff & (TM_BS1 | TM_BS2)) && !(lines & TM_OE) && !(diff & TM_OE)) {  // new output selected
+    t->out_old = ns >= t->out_valid ? t->out : t->out_old;
+    t->out = read_out(t, !!(lines & TM_BS1), !!(lines & TM_BS2));
+    t->out_valid = ns + tm_limits[TM_BVDV].ns;
+  }
+
+  if (diff & TM_XTAL1) {
+    if (lines & TM_XTAL1) {
+      if (t->pending & P_XTAL_SEEN)
+        record(t, TM_XLXH, since(ns, t->xtal_fall) - tm_limits[TM_XLXH].ns);
+      last = latest(t, ctl) > t->changed[DATA_LINE] ? latest(t, ctl) : t->changed[DATA_LINE];
+      record(t, TM_DVXH, since(ns, last) - tm_limits[TM_DVXH].ns);
+      t->xtal_lines = settled(t, ns, lines, ctl, tm_limits[TM_DVXH].ns);
+      t->xtal_data = ns - t->changed[DATA_LINE] < tm_limits[TM_DVXH].ns ? t->data_before : t->data;
+      t->xtal_rise = ns;
+      t->pending |= P_XTAL_UP;
+    } else if (t->pending & P_XTAL_UP) {
+      t->pending &= ~P_XTAL_UP;
+      t->pending |= P_XTAL | P_XTAL_SEEN;
+      t->xtal_fall = ns;
+      if (record(t, TM_XHXL, since(ns, t->xtal_rise) - tm_limits[TM_XHXL].ns) >= 0 && ready(t, ns))
+        do_load(t, (t->xtal_lines & TM_XA1 ? 2 : 0) | (t->xtal_lines & TM_XA0 ? 1 : 0),
+                !!(t->xtal_lines & TM_BS1), t->xtal_data);
+    }
+  }
+
+  if (diff & TM_PAGEL) {
+    if (lines & TM_PAGEL) {
+      if (!tiny)
+        record(t, TM_BVPH, since(ns, latest(t, TM_BS1)) - tm_limits[TM_BVPH].ns);
+      t->pagel_lines = tiny ? lines : settled(t, ns, lines, TM_BS1, tm_limits[TM_BVPH].ns);
+      t->pagel_rise = ns;
+    } else {
+      t->pagel_fall = ns;
+      t->pending |= P_PAGEL | P_PAGEL_WR;
+      if (record(t, TM_PHPL, since(ns, t->pagel_rise) - tm_limits[TM_PHPL].ns) >= 0 && ready(t, ns))
+        do_latch(t, !!(t->pagel_lines & TM_BS1));
+    }
+  }
+
+  if (diff & TM_WR) {
+    if (!(lines & TM_WR)) {
+      record(t, TM_BVWL, since(ns, latest(t, TM_BS1 | TM_BS2)) - tm_limits[TM_BVWL].ns);
+      if (t->pending & P_PAGEL_WR)
+        record(t, TM_PLWL, since(ns, t->pagel_fall) - tm_limits[TM_PLWL].ns);
+      t->pending &= ~P_PAGEL_WR;
+      t->pending |= P_WR;
+      t->wr_lines = settled(t, ns, lines, TM_BS1 | TM_BS2, tm_limits[TM_BVWL].ns);
+      t->wr_fall = ns;
+    } else if (t->wr_fall > t->hv_at) {  // not the !WR release of the entry sequence
+      if (record(t, TM_WLWH, since(ns, t->wr_fall) - tm_limits[TM_WLWH].ns) >= 0 && ready(t, t->wr_fall))
+        do_write(t, t->wr_fall, !!(t->wr_lines & TM_BS1), !!(t->wr_lines & TM_BS2));
+    }
+  }
+
+  if (diff & TM_OE) {
+    if (!(lines & TM_OE)) {  // output on
+      if (t->data_mask)
+        record(t, TM_OHDZ, -(int64_t) tm_limits[TM_OHDZ].ns);  // both drive DATA
+      value = read_out(t, !!(lines & TM_BS1), !!(lines & TM_BS2));
+      event(t, "read %02X", value);
+      t->out_old = t->out;
+      t->out = value;
+      t->out_valid = ns + tm_limits[TM_OLDV].ns;
+      if (latest(t, TM_BS1 | TM_BS2) + tm_limits[TM_BVDV].ns > t->out_valid)
+        t->out_valid = latest(t, TM_BS1 | TM_BS2) + tm_limits[TM_BVDV].ns;
+      t->oe_fall = ns;
+    } else {
+      t->drive_until = ns + tm_limits[TM_OHDZ].ns;
+    }
+  }
+}
+
+static void frame(struct tm_target *t, uint64_t ns) {  // HVSP: a whole frame is in, run its instruction
+  uint8_t instr = t->sii, prev = t->instr;
+  uint8_t bs1 = !!(instr & 0x10), bs2 = !!(instr & 0x02);
+
+  // Instruction bits: XA1 XA0 BS1 !WR !OE BS2 PAGEL, like the HVPP lines; XA1/XA0 other than 11 loads
+  event(t, "frame %02X %02X", t->sdi, instr);
+  if ((instr & 0x60) != 0x60 && ready(t, ns))
+    do_load(t, (instr & 0x40 ? 2 : 0) | (instr & 0x20 ? 1 : 0), bs1, t->sdi);
+  if ((instr & 0x01) && !(prev & 0x01) && ready(t, ns))
+    do_latch(t, bs1);
+  if (!(instr & 0x08) && (prev & 0x08) && ready(t, ns))
+    do_write(t, ns, bs1, bs2);
+  if (!(instr & 0x04)) {
+    t->out = read_out(t, bs1, bs2);  // shifted out on SDO during the next frame
+    event(t, "read %02X", t->out);
+  }
+  t->instr = instr;
+}
+
+static void hvsp(struct tm_target *t, uint64_t ns, unsigned lines, unsigned diff) {
+  // Serial programming: SCI on BS1, SII on XA0, SDI on XA1, SDO on RDY
+  if (diff & (TM_XA0 | TM_XA1))
+    entry_hold(t, ns);
+  if ((diff & TM_RDY_DRIVEN) && !(lines & TM_RDY_DRIVEN) && (t->pending & P_SDO)) {
+    record(t, TM_SDO_RELEASE, (int64_t) t->sdo_drive - since(ns, t->hv_at));
+    t->pending &= ~P_SDO;
+  }
+
+  if ((diff & (TM_XA0 | TM_XA1)) && (t->pending & P_SCI)) {  // SDI/SII hold after SCI
+    if (record(t, TM_SHIX, since(ns, t->sci_rise) - tm_limits[TM_SHIX].ns) < 0 && (t->pending & P_SCI_UP)) {
+      t->sdi_bit = !!(lines & TM_XA1);  // the sample may take the new level
+      t->sii_bit = !!(lines & TM_XA0);
+    }
+    t->pending &= ~P_SCI;
+  }
+
+  if (!(diff & TM_BS1))
+    return;
+  if (lines & TM_BS1) {
+    if (t->pending & P_SDO) {  // SDO still driven by the shield on the first clock
+      record(t, TM_SDO_RELEASE, (int64_t) t->sdo_drive - since(ns, t->hv_at));
+      t->pending &= ~P_SDO;
+    }
+    if (t->pending & P_FIRST) {
+      if (record(t, TM_FIRST_CMD, since(ns, t->hv_at) - 300 * (int64_t) US) < 0)
+        return;  // the part isn't listening yet, the clock is lost
+      t->pending &= ~P_FIRST;
+    }
+    if ((t->pending & P_SCI_SEEN) && record(t, TM_SLSH, since(ns, t->sci_fall) - tm_limits[TM_SLSH].ns) < 0)
+      return;
+    record(t, TM_IVSH, since(ns, latest(t, TM_XA0 | TM_XA1)) - tm_limits[TM_IVSH].ns);
+    lines = settled(t, ns, lines, TM_XA0 | TM_XA1, tm_limits[TM_IVSH].ns);
+    t->sdi_bit = !!(lines & TM_XA1);
+    t->sii_bit = !!(lines & TM_XA0);
+    t->sci_rise = ns;
+    t->pending |= P_SCI | P_SCI_UP;
+  } else if (t->pending & P_SCI_UP) {
+    t->pending &= ~P_SCI_UP;
+    t->pending |= P_SCI_SEEN;
+    t->sci_fall = ns;
+    if (record(t, TM_SHSL, since(ns, t->sci_rise) - tm_limits[TM_SHSL].ns) < 0)
+      return;  // too short, not seen
+    if (t->bit >= 1 && t->bit <= 8) {  // start bit, 8 bits MSB first, 2 stop bits
+      t->sdi = t->sdi << 1 | t->sdi_bit;
+      t->sii = t->sii << 1 | t->sii_bit;
+    }
+    if (++t->bit == 11) {
+      t->bit = 0;
+      frame(t, ns);
+    }
+  }
+}
+
+void tm_drive(struct tm_target *t, uint64_t ns, unsigned lines, uint8_t data, uint8_t data_mask) {
+  unsigned diff;
+  uint8_t ddiff, driven;
+
+  if (t->part->family == TM_TINY2313)  // PAGEL is the BS1 pin, BS2 the XA1 pin
+    lines = (lines & ~(TM_PAGEL | TM_BS2)) | (lines & TM_BS1 ? TM_PAGEL : 0) | (lines & TM_XA1 ? TM_BS2 : 0);
+  diff = lines ^ t->lines;
+  ddiff = data ^ t->data;
+  driven = data_mask & ~t->data_mask;
+  if (!diff && !ddiff && data_mask == t->data_mask)
+    return;
+
+  if ((diff & TM_VCC) && (lines & TM_VCC))
+    t->vcc_at = ns;
+  if (!(lines & TM_VCC) || ((diff & TM_HV) && !(lines & TM_HV)))  // power or 12V gone: programming mode left
+    reset(t);
+  else if ((diff & TM_HV) && (lines & TM_HV))
+    enter(t, ns, lines);
+  else if (t->prog && t->part->family == TM_HVSP)
+    hvsp(t, ns, lines, diff);
+  else if (t->prog)
+    hvpp(t, ns, lines, diff, ddiff);
+
+  if (t->prog && t->part->family != TM_HVSP && driven && (!(lines & TM_OE) || ns < t->drive_until))
+    record(t, TM_OHDZ, since(ns, t->drive_until));  // the shield drives DATA while the target still does
+
+  for (int i = 0; i < TM_LINES; i++)
+    if (diff & line_bit[i]) {
+      t->changed[i] = ns;
+      t->before = (t->before & ~line_bit[i]) | (t->lines & line_bit[i]);
+    }
+  if (ddiff) {
+    t->changed[DATA_LINE] = ns;
+    t->data_before = t->data;
+  }
+  t->lines = lines;
+  t->data = data;
+  t->data_mask = data_mask;
+}
+
+int tm_rdy(const struct tm_target *t, uint64_t ns) {
+  if (!t->prog)
+    return -1;
+  if (t->part->family != TM_HVSP)
+    return ns >= t->busy_until;
+  if (ns < t->hv_at + t->sdo_drive)
+    return -1;
+  if (t->bit >= 1 && t->bit <= 8)  // response bits 7..0 after clocks 1..8
+    return (t->out >> (8 - t->bit)) & 1;
+  return ns >= t->busy_until;
+}
+
+uint8_t tm_data(const struct tm_target *t, uint64_t ns, uint8_t *data) {
+  if (!t->prog || t->part->family == TM_HVSP || ((t->lines & TM_OE) && ns >= t->drive_until))
+    return 0x00;
+  *data = ns >= t->out_valid ? t->out : t->out_old;
+  return 0xFF;
+}
+
+void tm_sample_rdy(struct tm_target *t, uint64_t ns) {
+  if (t->prog && t->part->family == TM_HVSP && t->bit >= 1 && t->bit <= 8)
+    record(t, TM_SHOV, since(ns, t->sci_rise) - tm_limits[TM_SHOV].ns);
+}
+
+void tm_sample_data(struct tm_target *t, uint64_t ns) {
+  if (!t->prog || t->part->family == TM_HVSP || (t->lines & TM_OE))
+    return;
+  record(t, TM_OLDV, since(ns, t->oe_fall) - tm_limits[TM_OLDV].ns);
+  record(t, TM_BVDV, since(ns, latest(t, TM_BS1 | TM_BS2)) - tm_limits[TM_BVDV].ns);
+}
+
+uint64_t tm_next_change(const struct tm_target *t, uint64_t ns) {
+  uint64_t next = 0;
+  uint64_t at[4] = { t->busy_until, t->out_valid, t->drive_until, t->hv_at + t->sdo_drive };
+
+  if (!t->prog)
+    return 0;
+  for (int i = 0; i < 4; i++)
+    if (at[i] > ns && (next == 0 || at[i] < next))
+      next = at[i];
+  return next;
+}
+
+unsigned long tm_violations(const struct tm_target *t) {
+  unsigned long n = 0;
+
+  for (int i = 0; i < TM_CHECKS; i++)
+    n += t->stat[i].violations;
+  return n;
+}
+
+double tm_margin(const struct tm_target *t, int first, int last, int *check) {
+  double margin = 1e9, m;
+
+  if (check)
+    *check = -1;
+  for (int i = first; i <= last; i++) {
+    if (t->stat[i].count == 0 || tm_limit_ns(t, i) == 0)
+      continue;
+    m = (double) t->stat[i].worst / tm_limit_ns(t, i);
+    if (m < margin) {
+      margin = m;
+      if (check)
+        *check = i;
+    }
+  }
+  return margin;
+}
@@ -0,0 +1,155 @@
+/*
+  Target model: an AVR in high voltage programming mode, as seen from the sockets of the HV Rescue Shield.
+
+  Shared by the host simulation (sim.cpp) and the simavr rig (simavr_rig.c).  The caller reports every change of
+  the lines the shield drives with tm_drive() and reads RDY/SDO and DATA back with tm_rdy()/tm_data(), all with a
+  time stamp in ns.  The model:
+   - answers HVPP (ATmega, ATtiny2313) and HVSP (8-pin ATtiny) programming: signature, fuses, lock bits, flash
+     (through the page buffer), EEPROM and chip erase, with RDY/SDO low for the datasheet write times
+   - checks the datasheet timing the sketch depends on (entry sequence, XTAL1, PAGEL, !WR, !OE and SCI) and
+     keeps the worst slack of each figure
+   - fails like a part would when a figure is violated: a load with DATA changing too late takes the old value, a
+     read too early returns the previous output, a part whose Prog_enable pins moved doesn't answer at all
+   - logs the bus events as the part takes them (entry, loads, latches, writes, reads, HVSP frames), without
+     time stamps: the logical bus trace of a run, the same for any timing within the datasheet figures
+
+  Timing references: ATmega48/88/168 datasheet "Parallel Programming Characteristics" and ATtiny25/45/85
+  "High-voltage Serial Programming Characteristics".
+*/
+
+#ifndef TARGET_MODEL_H
+#define TARGET_MODEL_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Lines driven by the shield, bits of the lines argument of tm_drive (1 = high)
+#define  TM_VCC         0x0001  // target VCC switched on
+#define  TM_HV          0x0002  // 12V on !RESET
+#define  TM_XTAL1       0x0004
+#define  TM_OE          0x0008  // !OE
+#define  TM_WR          0x0010  // !WR
+#define  TM_BS1         0x0020  // also SCI (HVSP) and PAGEL (ATtiny2313)
+#define  TM_XA0         0x0040  // also SII (HVSP)
+#define  TM_XA1         0x0080  // also SDI (HVSP) and BS2 (ATtiny2313)
+#define  TM_PAGEL       0x0100
+#define  TM_BS2         0x0200
+#define  TM_RDY         0x0400  // level the shield drives on RDY/SDO, for the HVSP entry
+#define  TM_RDY_DRIVEN  0x0800  // the shield drives RDY/SDO
+#define  TM_LINES       12
+
+#define  TM_FLASH_WORDS   16384  // largest part
+#define  TM_EEPROM_BYTES  1024
+#define  TM_PAGE_WORDS    64
+#define  TM_EE_LATCHED    8      // EEPROM bytes latched before a write
+
+enum tm_family { TM_HVPP, TM_TINY2313, TM_HVSP };
+
+struct tm_part {
+  const char *name;
+  uint8_t family;
+  uint8_t sig[3];
+  uint8_t fuse[3];        // factory LFUSE, HFUSE, EFUSE
+  uint16_t flash_words;
+  uint8_t page_words;
+  uint16_t eeprom_bytes;
+  uint8_t eesave_fuse;    // fuse holding EESAVE: 0 = LFUSE, 1 = HFUSE
+  uint8_t eesave_mask;
+};
+
+extern const struct tm_part tm_parts[];  // ends with a NULL name
+
+enum tm_check {           // datasheet figures, see tm_limits: entry sequence, then bus
+  TM_VCC_HV_MIN, TM_VCC_HV_MAX, TM_PROG_ENABLE, TM_FIRST_CMD, TM_SDO_RELEASE,
+  TM_XHXL, TM_XLXH, TM_DVXH, TM_XLDX, TM_BVPH, TM_PHPL, TM_PLBX, TM_BVWL, TM_WLWH, TM_WLBX, TM_PLWL,
+  TM_OLDV, TM_BVDV, TM_OHDZ,
+  TM_SHSL, TM_SLSH, TM_IVSH, TM_SHIX, TM_SHOV,
+  TM_BUSY,
+  TM_CHECKS
+};
+
+struct tm_limit {
+  const char *name;
+  uint32_t ns;            // shortest time allowed, the longest one if max is set; 0 = protocol check, no time
+  uint8_t max;
+};
+
+extern const struct tm_limit tm_limits[TM_CHECKS];
+
+struct tm_stat {
+  int64_t worst;          // smallest slack seen, in ns, negative = violated
+  unsigned long count;
+  unsigned long violations;
+};
+
+struct tm_target {
+  const struct tm_part *part;
+  uint32_t vcc_rise;      // VCC pin high to the target VCC at 1.8 V, in ns: the 20-60 us window starts there
+  uint32_t sdo_drive;     // 12V to the target driving SDO (HVSP), in ns: the shield must have let go by then
+
+  uint16_t flash[TM_FLASH_WORDS];
+  uint8_t eeprom[TM_EEPROM_BYTES];
+  uint8_t fuse[3];
+  uint8_t lock;
+
+  unsigned lines;         // as last driven, PAGEL and BS2 mapped on the ATtiny2313
+  uint8_t data;           // DATA levels (undriven lines read low)
+  uint8_t data_mask;      // DATA lines the shield drives
+  unsigned before;        // level of each line before its last change
+  uint8_t data_before;
+  uint64_t changed[TM_LINES + 1];  // last change of each line, [TM_LINES] = DATA
+
+  uint8_t prog;           // in programming mode
+  unsigned pending;       // checks waiting for a later edge
+  uint64_t vcc_at, hv_at;
+
+  uint8_t cmd;            // loaded command
+  uint8_t addr[2];        // address low, high
+  uint8_t load[2];        // data low, high
+  uint16_t page[TM_PAGE_WORDS];
+  uint64_t page_loaded;   // words latched into the page buffer
+  uint16_t ee_addr[TM_EE_LATCHED];
+  uint8_t ee_data[TM_EE_LATCHED];
+  uint8_t ee_count;
+  uint64_t busy_until;    // RDY/SDO low until then
+
+  uint8_t out, out_old;   // DATA/SDO output, out_old is still seen until out_valid
+  uint64_t out_valid;
+  uint64_t drive_until;   // DATA is driven until then after !OE high (tOHDZ)
+  uint64_t xtal_rise, xtal_fall, pagel_rise, pagel_fall, wr_fall, oe_fall;
+  unsigned xtal_lines;    // lines and DATA taken at the XTAL1 rising edge, loaded at the falling edge
+  uint8_t xtal_data;
+  unsigned pagel_lines, wr_lines;
+
+  uint8_t bit;            // HVSP: SCI clocks of the frame so far
+  uint8_t sdi, sii;       // HVSP: data and instruction shifted in
+  uint8_t sdi_bit, sii_bit;  // HVSP: sampled at the last SCI rising edge, shifted in at its falling edge
+  uint8_t instr;          // HVSP: last instruction
+  uint64_t sci_rise, sci_fall;
+
+  struct tm_stat stat[TM_CHECKS];
+  FILE *log;              // bus events as the part takes them ("@ load cmd 08"...), NULL = off
+};
+
+const struct tm_part *tm_find_part(const char *name);  // NULL if unknown
+void tm_init(struct tm_target *t, const struct tm_part *part);  // blank part with factory fuses
+void tm_drive(struct tm_target *t, uint64_t ns, unsigned lines, uint8_t data, uint8_t data_mask);
+int tm_rdy(const struct tm_target *t, uint64_t ns);  // RDY/SDO level, -1 if the target doesn't drive it
+uint8_t tm_data(const struct tm_target *t, uint64_t ns, uint8_t *data);  // DATA lines the target drives
+void tm_sample_rdy(struct tm_target *t, uint64_t ns);   // the shield reads RDY/SDO now: timing checks
+void tm_sample_data(struct tm_target *t, uint64_t ns);  // the shield reads DATA now: timing checks
+uint64_t tm_next_change(const struct tm_target *t, uint64_t ns);  // next output change on its own, 0 = none
+unsigned long tm_violations(const struct tm_target *t);
+double tm_margin(const struct tm_target *t, int first, int last, int *check);  // worst slack of the checks
+                          // first..last relative to its figure, 1e9 if none ran; check = the worst one, -1 if none
+uint32_t tm_limit_ns(const struct tm_target *t, int check);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
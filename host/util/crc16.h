@@ -0,0 +1,17 @@
+/*
+  CRC-16 (polynomial 0xA001, reflected) as in avr-libc util/crc16.h.
+*/
+
+#ifndef SIM_UTIL_CRC16_H
+#define SIM_UTIL_CRC16_H
+
+#include <stdint.h>
+
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t a) {
+  crc ^= a;
+  for (uint8_t i = 0; i < 8; i++)
+    crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+  return crc;
+}
+
+#endif
@@ -0,0 +1,12 @@
+/*
+  Busy loop of the host simulation: 4 cycles per iteration at 16 MHz.
+*/
+
+#ifndef SIM_UTIL_DELAY_BASIC_H
+#define SIM_UTIL_DELAY_BASIC_H
+
+#include <stdint.h>
+
+void _delay_loop_2(uint16_t count);
+
+#endif